@@ -8,6 +8,7 @@
 #include <cstring>
 #include <sstream>
 #include <cstdlib>
+#include <chrono>
 #include <imgui.h>
 #include <backends/imgui_impl_opengl3.h>
 #include <backends/imgui_impl_glfw.h>
@@ -15,7 +16,7 @@
 
 int thread_id_counter = 0;
 
-App::App(GLFWwindow *window) : window(window), w(0), h(0), initialized(false), alive(true), batch_job_count(0), done_job_count(0), ui_show_resources(false), ui_show_lua(false), current_script_path(""), code_injection(""), viewing_image_idx(-1), viewing_model_idx(-1), viewing_bvh_idx(-1), is_wayland(false), display_rect(nullptr), image_viewing_shader(nullptr), showing_image(nullptr), lua(std::make_shared<Lua>())
+App::App(GLFWwindow *window) : window(window), w(0), h(0), initialized(false), alive(true), batch_job_count(0), done_job_count(0), abort_requested(false), stop_requested(false), adaptive_running(false), adaptive_pass(0), adaptive_max_passes(0), ui_show_resources(false), ui_show_lua(false), current_script_path(""), code_injection(""), viewing_image_idx(-1), viewing_model_idx(-1), viewing_bvh_idx(-1), region_active(false), region_dragging(false), region{ 0, 0, 0, 0 }, region_image_w(0), region_image_h(0), drag_u(0.0f), drag_v(0.0f), is_wayland(false), display_rect(nullptr), image_viewing_shader(nullptr), showing_image(nullptr), lua(std::make_shared<Lua>())
 {
 
 }
@@ -84,9 +85,17 @@ bool App::init()
     initialized = true;
 
     // HACK: this implicitly makes App a singleton
-    res()->parallel_launcher = [&](int w, int h, const std::string &path)
+    res()->parallel_launcher = [&](int w, int h, const std::string &path, const ImageRect *crop)
     {
-        queue_batch_job(w, h, path, true);
+        queue_batch_job(w, h, path, true, crop);
+    };
+    res()->adaptive_launcher = [&](int w, int h, const std::string &path, const BatchParams &params)
+    {
+        return queue_adaptive_job(w, h, path, params);
+    };
+    res()->coarse_to_fine_launcher = [&](int w, int h, const std::string &path, FloatImage *target, int coarsest)
+    {
+        queue_coarse_to_fine_job(w, h, path, target, coarsest);
     };
 
     return true;
@@ -142,7 +151,11 @@ void App::render_frame()
     {
         // We are viewing an image. Sync that into our ImageGL, and pass that as uniform.
 
-        showing_image->import_from_image(res()->images[viewing_image_idx]);
+        std::vector<std::shared_ptr<BaseImage> > images = res()->get_images();
+        if (viewing_image_idx < images.size())
+        {
+            showing_image->import_from_image(images[viewing_image_idx]);
+        }
         showing_image->bind();
         glActiveTexture(GL_TEXTURE0);
         glUniform1i((GLuint) image_viewing_shader->get_location("image"), 0);
@@ -175,6 +188,8 @@ void App::render_ui()
 
     ImGui::ShowDemoWindow();
 
+    update_region_selection();
+
     // Left side: resource viewer
     constexpr int init_resviewer_w = 200;
     constexpr int bot_bar_h = 30;
@@ -185,9 +200,10 @@ void App::render_ui()
         if (ImGui::BeginListBox("Images"))
         {
             char name[MAX_INPUT_CHAR_LENGTH] = { 0 };
-            for (int i = 0; i < res()->images.size(); i++)
+            std::vector<std::shared_ptr<BaseImage> > images = res()->get_images();
+            for (int i = 0; i < images.size(); i++)
             {
-                std::sprintf(name, "Image %d", res()->images[i]->id());
+                std::sprintf(name, "Image %d", images[i]->id());
                 if (ImGui::Selectable(name, viewing_image_idx == i))
                 {
                     viewing_image_idx = i;
@@ -229,15 +245,17 @@ void App::render_ui()
             }
             ImGui::EndListBox();
         }
+        for (int i = 0; i < res()->streamed_meshes.size(); i++)
+        {
+            StreamStats stats = res()->streamed_meshes[i]->get_stats();
+            ImGui::Text("Streamed mesh %d: %d/%d clusters, %.1f/%.1f MB, %llu hits, %llu misses", i,
+                stats.resident_clusters, stats.num_clusters,
+                stats.resident_bytes / 1048576.0, stats.budget_bytes / 1048576.0,
+                (unsigned long long) stats.hits, (unsigned long long) stats.misses);
+        }
 
-        double xpos = 0.0, ypos = 0.0;
-        glfwGetCursorPos(window, &xpos, &ypos);
-        ypos = h - ypos;
-        // Evaluate the transformed & aspect corrected UVs
-        float upos = (xpos / w) * 2.0f - 1.0f, vpos = (ypos / h) * 2.0f - 1.0f;
-        upos *= ((float) w / h);
-        upos = upos * 0.5f + 0.5f;
-        vpos = vpos * 0.5f + 0.5f;
+        float upos = 0.0f, vpos = 0.0f;
+        cursor_uv(upos, vpos);
         if (showing_image->get_base_image())
         {
             RGB<float> rgb = showing_image->get_base_image()->sample_rgb(upos, vpos, SampleMethod::Repeat);
@@ -246,6 +264,19 @@ void App::render_ui()
             ImGui::Text("r %f, g %f, b %f", rgb.r, rgb.g, rgb.b);
             ImGui::Text("r %d, g %d, b %d", (int) (rgb.r * 255.0f), (int) (rgb.g * 255.0f), (int) (rgb.b * 255.0f));
         }
+        if (region_active)
+        {
+            ImGui::Text("Region %d, %d, %dx%d", region.x, region.y, region.w, region.h);
+            if (ImGui::Button("Clear region"))
+            {
+                std::lock_guard<std::mutex> lk(mu);
+                region_active = false;
+            }
+        }
+        else if (viewing_image_idx != -1)
+        {
+            ImGui::Text("Drag over the image to select a region");
+        }
     }
     ImGui::End();
 
@@ -311,6 +342,13 @@ void App::render_ui()
             previous_scripts.clear();
         }
 
+        const char *const orders[] = { "Scanline", "Morton", "Hilbert" };
+        int order = res()->pixel_order;
+        if (ImGui::Combo("Pixel order", &order, orders, 3))
+        {
+            res()->pixel_order = (PixelOrder) order;
+        }
+
         ImGui::Text("Worker stats");
         if (ImGui::BeginTable("stats", 2, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg))
         {
@@ -358,6 +396,19 @@ void App::render_ui()
             jobs = std::queue<Job>(); // Emergency stop
             batch_job_count = 0;
             done_job_count = 0;
+            abort_requested = true;
+        }
+        if (adaptive_running)
+        {
+            ImGui::SameLine();
+            if (ImGui::Button("Stop"))
+            {
+                // Good enough: drop the rest of the pass, but let running jobs finish
+                std::lock_guard<std::mutex> lk(mu);
+                done_job_count += jobs.size();
+                jobs = std::queue<Job>();
+                stop_requested = true;
+            }
         }
     }
     ImGui::End();
@@ -376,6 +427,19 @@ void App::render_ui()
     {
         ImGui::Text("Running...");
     }
+    else if (adaptive_running && done_job_count <= batch_job_count)
+    {
+        float done_percent = (float) done_job_count / batch_job_count;
+        if (adaptive_max_passes > 0)
+        {
+            ImGui::Text("Pass %d/%d: %f%%...", adaptive_pass + 1, adaptive_max_passes.load(), done_percent * 100.0f);
+        }
+        else
+        {
+            ImGui::Text("Pass %d: %f%%...", adaptive_pass + 1, done_percent * 100.0f);
+        }
+        ImGui::GetBackgroundDrawList()->AddRectFilled(ImVec2(0, 0), ImVec2(done_percent * w, h), IM_COL32(12, 235, 31, 35));
+    }
     else if (done_job_count > batch_job_count)
     {
         ImGui::Text("Unknown");
@@ -429,7 +493,7 @@ void App::worker_thread(App &app, int thread_id)
                 int tar = f.get_target_worker();
                 return tar == -1 || tar == thread_id;
             }
-            return false;
+            return app.find_straggler() != nullptr;
         });
         if (!app.alive)
         {
@@ -438,6 +502,35 @@ void App::worker_thread(App &app, int thread_id)
             return;
         }
 
+        if (app.jobs.empty())
+        {
+            // Nothing queued, but a tile is still being worked on: help it finish as a job of our own
+            std::shared_ptr<TileWork> work = app.find_straggler();
+            app.batch_job_count++;
+            me.idle = false;
+            lk.unlock();
+
+            auto start = std::chrono::steady_clock::now();
+            shade_tile_pixels(app, *lua_clone, *work);
+            if (work->pparams.costs)
+            {
+                work->pparams.costs->record(work->pparams.x, work->pparams.y, std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count());
+            }
+
+            lk.lock();
+            me.idle = true;
+            app.done_job_count++;
+            if (app.done_job_count > app.batch_job_count)
+            {
+                app.done_job_count = app.batch_job_count;
+            }
+            if (app.done_job_count + 1 >= app.batch_job_count)
+            {
+                app.cv.notify_all();
+            }
+            continue;
+        }
+
         // Take a job. Any job.
         Job job = app.jobs.front();
         app.jobs.pop();
@@ -470,7 +563,24 @@ void App::worker_thread(App &app, int thread_id)
                  * The source code is available in ParallelParams.
                  */
                 const ParallelParams &pparams = job.get_parallel_params();
-                lua_clone->call_shade(pparams.src, pparams.u, pparams.v, pparams.x, pparams.y, pparams.w, pparams.h);
+                auto start = std::chrono::steady_clock::now();
+                if (pparams.pixel_tile)
+                {
+                    shade_pixel_tile(app, *lua_clone, pparams);
+                }
+                else
+                {
+                    lua_clone->call_shade(pparams);
+                }
+                if (pparams.block > 1 && pparams.target)
+                {
+                    // Coarse job: stretch the pixel over its block
+                    pparams.target->fill_rect(pparams.x, pparams.y, pparams.block_w, pparams.block_h, pparams.target->get_rgb_float(pparams.x, pparams.y));
+                }
+                if (pparams.costs)
+                {
+                    pparams.costs->record(pparams.x, pparams.y, std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count());
+                }
 
                 break;
             }
@@ -501,6 +611,67 @@ void App::worker_thread(App &app, int thread_id)
     }
 }
 
+void App::shade_pixel_tile(App &app, Lua &lua, const ParallelParams &tile)
+{
+    std::shared_ptr<TileWork> work = std::make_shared<TileWork>();
+    work->pparams = tile;
+    order_pixels(tile.x, tile.y, tile.x + tile.tile_w, tile.y + tile.tile_h, tile.order, tile.order_tile, work->pixels);
+
+    {
+        std::lock_guard<std::mutex> lk(app.mu);
+        app.tiles_in_progress.push_back(work);
+        if (app.jobs.empty())
+        {
+            app.cv.notify_all(); // Idle workers can help right away
+        }
+    }
+    shade_tile_pixels(app, lua, *work);
+
+    // Helpers can only join while the tile is listed, so they are counted before this job is done
+    std::lock_guard<std::mutex> lk(app.mu);
+    app.tiles_in_progress.erase(std::find(app.tiles_in_progress.begin(), app.tiles_in_progress.end(), work));
+}
+
+void App::shade_tile_pixels(App &app, Lua &lua, TileWork &work)
+{
+    const ParallelParams &tile = work.pparams;
+    ParallelParams pparams = tile;
+    pparams.tile_w = 1;
+    pparams.tile_h = 1;
+    pparams.pixel_tile = false;
+    begin_tile_output(tile.x, tile.y, tile.tile_w, tile.tile_h);
+    while (!app.abort_requested && app.alive)
+    {
+        int i = work.next.fetch_add(1, std::memory_order_relaxed);
+        if (i >= (int) work.pixels.size())
+        {
+            break;
+        }
+        pparams.x = work.pixels[i].first;
+        pparams.y = work.pixels[i].second;
+        pparams.u = ((float) pparams.x + 0.5f) / pparams.w;
+        pparams.v = ((float) pparams.y + 0.5f) / pparams.h;
+        lua.call_shade(pparams);
+    }
+    end_tile_output();
+}
+
+std::shared_ptr<TileWork> App::find_straggler() const
+{
+    std::shared_ptr<TileWork> best = nullptr;
+    int most = MIN_STEAL_PIXELS - 1;
+    for (const std::shared_ptr<TileWork> &work : tiles_in_progress)
+    {
+        int left = work->unclaimed();
+        if (left > most)
+        {
+            best = work;
+            most = left;
+        }
+    }
+    return best;
+}
+
 void App::queue_single_job(const Job &job)
 {
     {
@@ -512,12 +683,117 @@ void App::queue_single_job(const Job &job)
     cv.notify_one();
 }
 
-void App::queue_batch_job(int w, int h, const std::string &path, bool wait_until_finish)
+void App::cursor_uv(float &u, float &v) const
+{
+    double xpos = 0.0, ypos = 0.0;
+    glfwGetCursorPos(window, &xpos, &ypos);
+    ypos = h - ypos;
+    // Evaluate the transformed & aspect corrected UVs
+    u = (xpos / w) * 2.0f - 1.0f;
+    v = (ypos / h) * 2.0f - 1.0f;
+    u *= ((float) w / h);
+    u = u * 0.5f + 0.5f;
+    v = v * 0.5f + 0.5f;
+}
+
+void App::uv_to_screen(float u, float v, float &x, float &y) const
+{
+    x = ((u * 2.0f - 1.0f) * ((float) h / w) * 0.5f + 0.5f) * w;
+    y = h - v * h;
+}
+
+void App::update_region_selection()
+{
+    if (viewing_image_idx == -1 || !showing_image->get_base_image())
+    {
+        region_dragging = false;
+        return;
+    }
+    std::shared_ptr<BaseImage> image = showing_image->get_base_image();
+    int iw = image->width(), ih = image->height();
+
+    float u = 0.0f, v = 0.0f;
+    cursor_uv(u, v);
+    u = std::min(std::max(u, 0.0f), 1.0f);
+    v = std::min(std::max(v, 0.0f), 1.0f);
+    if (!region_dragging && ImGui::IsMouseClicked(ImGuiMouseButton_Left) && !ImGui::GetIO().WantCaptureMouse)
+    {
+        region_dragging = true;
+        drag_u = u;
+        drag_v = v;
+    }
+    if (!region_dragging)
+    {
+        if (region_active && region_image_w == iw && region_image_h == ih)
+        {
+            float x0 = 0.0f, y0 = 0.0f, x1 = 0.0f, y1 = 0.0f;
+            uv_to_screen((float) region.x / iw, (float) region.y / ih, x0, y0);
+            uv_to_screen((float) (region.x + region.w) / iw, (float) (region.y + region.h) / ih, x1, y1);
+            ImGui::GetBackgroundDrawList()->AddRect(ImVec2(x0, y1), ImVec2(x1, y0), IM_COL32(255, 235, 31, 255));
+        }
+        return;
+    }
+
+    // Pixels the drag touched, inclusive
+    int px0 = std::min((int) (std::min(drag_u, u) * iw), iw - 1), px1 = std::min((int) (std::max(drag_u, u) * iw), iw - 1);
+    int py0 = std::min((int) (std::min(drag_v, v) * ih), ih - 1), py1 = std::min((int) (std::max(drag_v, v) * ih), ih - 1);
+    float x0 = 0.0f, y0 = 0.0f, x1 = 0.0f, y1 = 0.0f;
+    uv_to_screen((float) px0 / iw, (float) py0 / ih, x0, y0);
+    uv_to_screen((float) (px1 + 1) / iw, (float) (py1 + 1) / ih, x1, y1);
+    ImGui::GetBackgroundDrawList()->AddRect(ImVec2(x0, y1), ImVec2(x1, y0), IM_COL32(255, 235, 31, 255));
+
+    if (ImGui::IsMouseReleased(ImGuiMouseButton_Left))
+    {
+        region_dragging = false;
+        std::lock_guard<std::mutex> lk(mu);
+        if (px0 == px1 && py0 == py1)
+        {
+            region_active = false; // A click clears the region
+            return;
+        }
+        region = ImageRect{ px0, py0, px1 - px0 + 1, py1 - py0 + 1 };
+        region_image_w = iw;
+        region_image_h = ih;
+        region_active = true;
+    }
+}
+
+ImageRect App::batch_area(int w, int h, const ImageRect *crop) const
+{
+    // Explicit crops win; otherwise the viewer's region applies to batches of its image's size
+    ImageRect area = { 0, 0, w, h };
+    if (crop)
+    {
+        area = *crop;
+    }
+    else if (region_active && region_image_w == w && region_image_h == h)
+    {
+        area = region;
+    }
+    int x0 = std::max(area.x, 0), y0 = std::max(area.y, 0);
+    int x1 = std::min(area.x + area.w, w), y1 = std::min(area.y + area.h, h);
+    return ImageRect{ x0, y0, std::max(x1 - x0, 0), std::max(y1 - y0, 0) };
+}
+
+void App::queue_batch_job(int w, int h, const std::string &path, bool wait_until_finish, const ImageRect *crop)
 {
     {
         std::lock_guard<std::mutex> lk(mu);
-        batch_job_count = w * h + 1;
+
+        ImageRect area = batch_area(w, h, crop);
+        int x0 = area.x, y0 = area.y, x1 = area.x + area.w, y1 = area.y + area.h;
+
+        // Jobs are whole tiles, aligned to the frame, so that workers write to separate cache lines
+        PixelOrder order = res()->pixel_order;
+        int tile = std::max(res()->pixel_order_tile.load(), 1);
+        std::vector<std::pair<int, int>> tiles;
+        if (x1 > x0 && y1 > y0)
+        {
+            order_pixels(x0 / tile, y0 / tile, (x1 - 1) / tile + 1, (y1 - 1) / tile + 1, order, 1, tiles);
+        }
+        batch_job_count = 1;
         done_job_count = 0;
+        abort_requested = false;
 
         // Read the source code.
         std::ifstream reader(path);
@@ -533,14 +809,30 @@ void App::queue_batch_job(int w, int h, const std::string &path, bool wait_until
 
         std::stringstream ss;
         ss << reader.rdbuf();
+        std::string src = ss.str();
 
-        for (int y = 0; y < h; y++)
+        // Tiles that were slow last time go first, in smaller jobs, so they do not hold up the end of the batch
+        batch_costs.begin(w, h, tile, src);
+        batch_costs.prioritize(tiles);
+        for (const auto &t : tiles)
         {
-            for (int x = 0; x < w; x++)
+            int tx0 = std::max(t.first * tile, x0), ty0 = std::max(t.second * tile, y0);
+            int tx1 = std::min((t.first + 1) * tile, x1), ty1 = std::min((t.second + 1) * tile, y1);
+            int sub = std::max(tile / batch_costs.split_factor(t.first, t.second), MIN_JOB_TILE);
+            for (int sy = ty0; sy < ty1; sy += sub)
             {
-                float u = ((float) x + 0.5f) / w, v = ((float) y + 0.5f) / h;
-                Job job(JobType::ExecuteParallel, ParallelParams(u, v, x, y, w, h, ss.str()));
-                jobs.push(job);
+                for (int sx = tx0; sx < tx1; sx += sub)
+                {
+                    ParallelParams pparams(((float) sx + 0.5f) / w, ((float) sy + 0.5f) / h, sx, sy, w, h, src);
+                    pparams.tile_w = std::min(sub, tx1 - sx);
+                    pparams.tile_h = std::min(sub, ty1 - sy);
+                    pparams.pixel_tile = true;
+                    pparams.order = order;
+                    pparams.order_tile = tile;
+                    pparams.costs = &batch_costs;
+                    jobs.push(Job(JobType::ExecuteParallel, pparams));
+                    batch_job_count++;
+                }
             }
         }
     }
@@ -573,6 +865,268 @@ void App::set_script_path(const std::string &path)
     std::strncpy(this->current_script_path, path.c_str(), std::min(MAX_INPUT_CHAR_LENGTH, (int) path.size()));
 }
 
+BatchResult App::queue_adaptive_job(int w, int h, const std::string &path, const BatchParams &params)
+{
+    BatchResult result = { 0, 0, 0.0f, 0.0f, false };
+    assert(params.accum && "Adaptive batches need an accumulation buffer");
+    if (params.accum->width() != w || params.accum->height() != h)
+    {
+        std::stringstream ss;
+        ss << "Error: accumulation buffer is " << params.accum->width() << "x" << params.accum->height() << ", but the batch is " << w << "x" << h;
+        res()->report_error(ss.str());
+        return result;
+    }
+    if (params.preview && (params.preview->w != w || params.preview->h != h))
+    {
+        std::stringstream ss;
+        ss << "Error: preview image is " << params.preview->w << "x" << params.preview->h << ", but the batch is " << w << "x" << h;
+        res()->report_error(ss.str());
+        return result;
+    }
+
+    std::ifstream reader(path);
+    if (!reader.good())
+    {
+        std::stringstream ss;
+        ss << "Error: cannot load file: " << path;
+        res()->report_error(ss.str());
+        return result;
+    }
+    std::stringstream ss;
+    ss << reader.rdbuf();
+    std::string src = ss.str();
+
+    struct Tile
+    {
+        int x, y, w, h;
+        int samples, pending; // Per pixel: done so far, and in the pass in flight
+        bool active;
+    };
+    ImageRect area;
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        area = batch_area(w, h, nullptr);
+    }
+
+    // Tiles stay aligned to the frame (their costs are kept by cell), but are cut off at the area's edges
+    int tile_size = std::max(params.tile_size, 1);
+    std::vector<std::pair<int, int>> grid; // Tiles are visited in pixel order as well
+    if (area.w > 0 && area.h > 0)
+    {
+        order_pixels(area.x / tile_size, area.y / tile_size, (area.x + area.w - 1) / tile_size + 1, (area.y + area.h - 1) / tile_size + 1, res()->pixel_order.load(), 1, grid);
+    }
+    int cells_x = (w + tile_size - 1) / tile_size;
+    std::vector<Tile> tiles((size_t) cells_x * ((h + tile_size - 1) / tile_size), Tile{ 0, 0, 0, 0, 0, 0, false }); // By cell
+    for (const auto &cell : grid)
+    {
+        int x0 = std::max(cell.first * tile_size, area.x), y0 = std::max(cell.second * tile_size, area.y);
+        int x1 = std::min((cell.first + 1) * tile_size, area.x + area.w), y1 = std::min((cell.second + 1) * tile_size, area.y + area.h);
+        tiles[(size_t) cell.second * cells_x + cell.first] = { x0, y0, x1 - x0, y1 - y0, 0, 0, true };
+    }
+    if (params.clear_accum)
+    {
+        params.accum->clear_rect(area.x, area.y, area.w, area.h);
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        abort_requested = false;
+        stop_requested = false;
+        adaptive_running = true;
+        adaptive_pass = 0;
+        adaptive_max_passes = params.max_passes;
+    }
+    auto start = std::chrono::steady_clock::now();
+    double total_samples = 0.0, pixels = (double) area.w * area.h;
+    bool keep_partial = false;
+    while (true)
+    {
+        // The tiles that were slow in the last pass go first, cut into smaller jobs
+        std::vector<std::pair<int, int>> active;
+        for (const auto &cell : grid)
+        {
+            if (tiles[(size_t) cell.second * cells_x + cell.first].active)
+            {
+                active.push_back(cell);
+            }
+        }
+        adaptive_costs.begin(w, h, tile_size, src);
+        adaptive_costs.prioritize(active);
+
+        int launched = 0;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            for (const auto &cell : active)
+            {
+                Tile &tile = tiles[(size_t) cell.second * cells_x + cell.first];
+                int samples = result.passes == 0 ? params.base_samples : params.pass_samples;
+                if (params.max_samples > 0)
+                {
+                    samples = std::min(samples, params.max_samples - tile.samples);
+                }
+                tile.pending = std::max(samples, 1);
+                int sub = std::max(tile_size / adaptive_costs.split_factor(cell.first, cell.second), MIN_JOB_TILE);
+                for (int sy = tile.y; sy < tile.y + tile.h; sy += sub)
+                {
+                    for (int sx = tile.x; sx < tile.x + tile.w; sx += sub)
+                    {
+                        ParallelParams pparams(((float) sx + 0.5f) / w, ((float) sy + 0.5f) / h, sx, sy, w, h, src);
+                        pparams.tile_w = std::min(sub, tile.x + tile.w - sx);
+                        pparams.tile_h = std::min(sub, tile.y + tile.h - sy);
+                        pparams.samples = tile.pending;
+                        pparams.pass = result.passes;
+                        pparams.costs = &adaptive_costs;
+                        jobs.push(Job(JobType::ExecuteParallel, pparams));
+                        launched++;
+                    }
+                }
+            }
+            batch_job_count = launched + 1; // The script waiting here is a job as well
+            done_job_count = 0;
+        }
+        if (launched == 0)
+        {
+            break;
+        }
+        cv.notify_all();
+
+        {
+            std::unique_lock<std::mutex> lk(mu);
+            cv.wait(lk, [&]()
+            {
+                return !alive || (batch_job_count <= done_job_count + 1);
+            });
+            if (!alive || abort_requested || stop_requested)
+            {
+                result.stopped = true;
+                keep_partial = alive && stop_requested && !abort_requested;
+                break;
+            }
+        }
+
+        // Only now every sample of the pass is in the buffer.
+        for (Tile &tile : tiles)
+        {
+            if (!tile.active)
+            {
+                continue;
+            }
+            tile.samples += tile.pending;
+            total_samples += (double) tile.pending * tile.w * tile.h;
+            result.tiles_shaded++;
+
+            bool saturated = params.max_samples > 0 && tile.samples >= params.max_samples;
+            tile.active = !saturated && params.accum->estimate_error(tile.x, tile.y, tile.w, tile.h) > params.error_threshold;
+        }
+        result.passes++;
+        if (params.preview)
+        {
+            params.accum->resolve_rect(*params.preview, area.x, area.y, area.w, area.h);
+        }
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            adaptive_pass = result.passes;
+        }
+
+        float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+        if ((params.time_limit > 0.0f && seconds >= params.time_limit) ||
+            (params.sample_budget > 0.0f && total_samples >= params.sample_budget * pixels) ||
+            (params.max_passes > 0 && result.passes >= params.max_passes))
+        {
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        batch_job_count = 1; // Back to the script alone
+        done_job_count = 0;
+        adaptive_running = false;
+    }
+    if (params.preview && keep_partial)
+    {
+        params.accum->resolve_rect(*params.preview, area.x, area.y, area.w, area.h); // Whatever the unfinished pass got done
+    }
+    result.samples_per_pixel = pixels > 0.0 ? total_samples / pixels : 0.0f;
+    result.seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+void App::queue_coarse_to_fine_job(int w, int h, const std::string &path, FloatImage *target, int coarsest)
+{
+    std::ifstream reader(path);
+    if (!reader.good())
+    {
+        std::stringstream ss;
+        ss << "Error: cannot load file: " << path;
+        res()->report_error(ss.str());
+        return;
+    }
+    std::stringstream ss;
+    ss << reader.rdbuf();
+    std::string src = ss.str();
+
+    // Block sizes are powers of two, so that every level's pixels include the previous level's
+    int block = 1;
+    while (block * 2 <= coarsest)
+    {
+        block *= 2;
+    }
+
+    // Blocks start at the corner of the area, so that they never spill out of it
+    ImageRect area;
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        abort_requested = false;
+        area = batch_area(w, h, nullptr);
+    }
+    PixelOrder order = res()->pixel_order;
+    int order_tile = res()->pixel_order_tile;
+    for (int level = 0; block >= 1 && area.w > 0 && area.h > 0; level++, block /= 2)
+    {
+        int launched = 0;
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            std::vector<std::pair<int, int>> blocks;
+            order_pixels(0, 0, (area.w + block - 1) / block, (area.h + block - 1) / block, order, std::max(order_tile / block, 1), blocks);
+            for (const auto &b : blocks)
+            {
+                int bx = b.first * block, by = b.second * block; // Relative to the area
+                if (level > 0 && bx % (block * 2) == 0 && by % (block * 2) == 0)
+                {
+                    continue; // Done by the level before
+                }
+                int x = area.x + bx, y = area.y + by;
+                float u = ((float) x + 0.5f) / w, v = ((float) y + 0.5f) / h;
+                ParallelParams pparams(u, v, x, y, w, h, src);
+                pparams.block = block;
+                pparams.block_w = std::min(block, area.w - bx);
+                pparams.block_h = std::min(block, area.h - by);
+                pparams.target = target;
+                jobs.push(Job(JobType::ExecuteParallel, pparams));
+                launched++;
+            }
+            batch_job_count = launched + 1; // The script waiting here is a job as well
+            done_job_count = 0;
+        }
+        cv.notify_all();
+
+        std::unique_lock<std::mutex> lk(mu);
+        cv.wait(lk, [&]()
+        {
+            return !alive || (batch_job_count <= done_job_count + 1);
+        });
+        if (!alive || abort_requested)
+        {
+            break;
+        }
+    }
+
+    std::lock_guard<std::mutex> lk(mu);
+    batch_job_count = 1; // Back to the script alone
+    done_job_count = 0;
+}
+
 bool App::is_busy()
 {
     std::lock_guard<std::mutex> lk(mu);
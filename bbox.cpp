@@ -10,46 +10,93 @@
 int bvh_id_counter = 0;
 
 
-BVH::BVH(std::shared_ptr<Model> model) : model(model), id_(bvh_id_counter++)
+static glm::vec3 to_glm(const Vec3C &v)
 {
+    return glm::vec3(v.x, v.y, v.z);
+}
+
+static float tri_area(const Triangle &t)
+{
+    return 0.5f * glm::length(glm::cross(t.b.position - t.a.position, t.c.position - t.a.position));
+}
+
+BVH::BVH(std::shared_ptr<Model> model) : total_power(0.0f), prebuilt(false), model(model), id_(bvh_id_counter++)
+{
+    // Emission only depends on the material, so evaluate it once per material rather than per triangle.
+    std::vector<float> material_emission(model->get_num_materials());
+    for (int i = 0; i < material_emission.size(); i++)
+    {
+        RGB<float> em = model->get_average_emission(i);
+        material_emission[i] = (em.r + em.g + em.b) / 3.0f;
+    }
+
     // First make an empty node to fit ALL triangles inside
 
     BBox root_bbox = bbox();
+    tri.reserve(model->get_num_tris());
     for (int i = 0; i < model->get_num_tris(); i++)
     {
-        TriC *t = model_get_tri(model.get(), i);
-        enclose(root_bbox, t->a.position);
-        enclose(root_bbox, t->b.position);
-        enclose(root_bbox, t->c.position);
+        TriC t = model_get_tri(model.get(), i);
+        enclose(root_bbox, t.a.position);
+        enclose(root_bbox, t.b.position);
+        enclose(root_bbox, t.c.position);
 
-        const Triangle *triangle = &model->get_triangle(i);
-        tri.push_back(triangle);
+        tri.push_back(i);
 
-        if (t->a.material_id >= 0 && len3(model->get_hit_info(t->a.material_id, glm::vec2(0.5f, 0.5f)).emission) > 0.0f)
+        // Triangles without materials are emitters, as strong as trace() shades them.
+        int material_id = t.a.material_id;
+        float emission = material_id >= 0 ? material_emission[material_id] : (float) MISSING_MATERIAL_EMISSION;
+        if (emission > 0.0f)
         {
-            emitters.push_back(triangle);
-        }
-        if (t->a.material_id < 0)
-        {
-            emitters.push_back(triangle);
+            float area = tri_area(model->get_triangle(i));
+            emitters.push_back(i);
+            emitter_area.push_back(area);
+            emitter_power.push_back(area * emission);
         }
     }
 
+    build_alias_table();
+
+    // Binary mesh files can carry a BVH built earlier; adopt it instead of starting from a single leaf.
+    ArrayView<Node> prebuilt_nodes = model->get_prebuilt_nodes();
+    ArrayView<int> prebuilt_order = model->get_prebuilt_order();
+    if (!prebuilt_nodes.empty() && prebuilt_order.size() == tri.size())
+    {
+        nodes.assign(prebuilt_nodes.begin(), prebuilt_nodes.end());
+        tri.assign(prebuilt_order.begin(), prebuilt_order.end());
+        prebuilt = true;
+        finalize();
+        return;
+    }
     make_node(root_bbox, 0, tri.size(), 0, 0);
 }
 
 int BVH::make_node(const BBox &bbox, int start, int size, int l, int r)
 {
+    assert(!is_compressed() && "Compressed BVHs cannot be modified");
+
     Node node{ bbox, start, size, l, r };
     nodes.push_back(node);
     return nodes.size() - 1;
 }
 
-const Triangle &BVH::get_triangle(int index) const
+Triangle BVH::get_triangle(int index) const
+{
+    assert(index >= 0 && index < tri.size() && "Triangle index out of bound");
+
+    return model->get_triangle(tri[index]);
+}
+
+int BVH::get_model_index(int index) const
 {
-    assert((index >= 0 || index < tri.size()) && "Triangle index out of bound");
+    assert(index >= 0 && index < tri.size() && "Triangle index out of bound");
 
-    return *tri[index];
+    return tri[index];
+}
+
+bool BVH::is_prebuilt() const
+{
+    return prebuilt;
 }
 
 int BVH::id() const
@@ -59,13 +106,14 @@ int BVH::id() const
 
 const Node &BVH::get_node(int index) const
 {
-    assert((index >= 0 || index < nodes.size()) && "Node index out of bound");
+    assert(index >= 0 && index < nodes.size() && "Node index out of bound");
     return nodes[index];
 }
 
 void BVH::set_children(int who, int l, int r)
 {
-    assert((who >= 0 || who < nodes.size()) && "Node index out of bound");
+    assert(!is_compressed() && "Compressed BVHs cannot be modified");
+    assert(who >= 0 && who < nodes.size() && "Node index out of bound");
     nodes[who].l = l;
     nodes[who].r = r;
 }
@@ -75,11 +123,11 @@ int BVH::get_num_triangles() const
     return tri.size();
 }
 
-const Triangle &BVH::get_emitter(int index) const
+Triangle BVH::get_emitter(int index) const
 {
-    assert((index >= 0 || index < emitters.size()) && "Emitter index out of bound");
+    assert(index >= 0 && index < emitters.size() && "Emitter index out of bound");
 
-    return *emitters[index];
+    return model->get_triangle(emitters[index]);
 }
 
 int BVH::get_num_emitters() const
@@ -87,6 +135,239 @@ int BVH::get_num_emitters() const
     return emitters.size();
 }
 
+float BVH::get_emitter_power(int index) const
+{
+    assert(index >= 0 && index < emitters.size() && "Emitter index out of bound");
+
+    return emitter_power[index];
+}
+
+void BVH::build_alias_table()
+{
+    // Vose's alias method.
+    int n = emitters.size();
+    total_power = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        total_power += emitter_power[i];
+    }
+
+    alias.assign(n, AliasEntry{ 1.0f, 0 });
+    if (n == 0 || total_power <= 0.0f)
+    {
+        return;
+    }
+
+    std::vector<float> scaled(n);
+    std::vector<int> small, large;
+    for (int i = 0; i < n; i++)
+    {
+        scaled[i] = emitter_power[i] / total_power * n;
+        if (scaled[i] < 1.0f)
+        {
+            small.push_back(i);
+        }
+        else
+        {
+            large.push_back(i);
+        }
+    }
+    while (!small.empty() && !large.empty())
+    {
+        int s = small.back(), l = large.back();
+        small.pop_back();
+        alias[s] = AliasEntry{ scaled[s], l };
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+        if (scaled[l] < 1.0f)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Whatever is left is 1 up to rounding errors.
+    for (int i : small)
+    {
+        alias[i] = AliasEntry{ 1.0f, i };
+    }
+    for (int i : large)
+    {
+        alias[i] = AliasEntry{ 1.0f, i };
+    }
+}
+
+int BVH::build_light_node(std::vector<int> &order, int begin, int end, int parent)
+{
+    int index = light_nodes.size();
+    light_nodes.push_back(LightNode{ bbox(), 0.0f, 0, 0, parent, -1 });
+
+    BBox box = bbox(), centroids = bbox();
+    float power = 0.0f;
+    for (int i = begin; i < end; i++)
+    {
+        Triangle t = get_emitter(order[i]);
+        enclose(box, *((Vec3C *) &t.a.position));
+        enclose(box, *((Vec3C *) &t.b.position));
+        enclose(box, *((Vec3C *) &t.c.position));
+        glm::vec3 c = (t.a.position + t.b.position + t.c.position) * (1.0f / 3.0f);
+        enclose(centroids, *((Vec3C *) &c));
+        power += emitter_power[order[i]];
+    }
+    light_nodes[index].bbox = box;
+    light_nodes[index].power = power;
+
+    if (end - begin == 1)
+    {
+        light_nodes[index].emitter = order[begin];
+        emitter_leaf[order[begin]] = index;
+        return index;
+    }
+
+    // Median split along the longest axis of the centroids.
+    Vec3C span = sub3(centroids.max, centroids.min);
+    int axis = 0;
+    if (span.y > span.x)
+    {
+        axis = 1;
+    }
+    if (span.z > std::max(span.x, span.y))
+    {
+        axis = 2;
+    }
+    int mid = (begin + end) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b)
+    {
+        Triangle ta = get_emitter(a), tb = get_emitter(b);
+        return ta.a.position[axis] + ta.b.position[axis] + ta.c.position[axis] < tb.a.position[axis] + tb.b.position[axis] + tb.c.position[axis];
+    });
+
+    int l = build_light_node(order, begin, mid, index);
+    int r = build_light_node(order, mid, end, index);
+    light_nodes[index].l = l;
+    light_nodes[index].r = r;
+    return index;
+}
+
+void BVH::build_light_tree()
+{
+    light_nodes.clear();
+    if (emitters.empty())
+    {
+        return;
+    }
+
+    std::vector<int> order(emitters.size());
+    for (int i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    emitter_leaf.assign(emitters.size(), -1);
+    light_nodes.reserve(2 * emitters.size() - 1);
+    build_light_node(order, 0, order.size(), -1);
+}
+
+float BVH::light_importance(int node, const glm::vec3 &ref) const
+{
+    // Power over squared distance, where the distance is clamped to the size of the node
+    // so that being near (or inside) a cluster doesn't blow up.
+    const LightNode &n = light_nodes[node];
+    glm::vec3 bmin = to_glm(n.bbox.min), bmax = to_glm(n.bbox.max);
+    glm::vec3 d = (bmin + bmax) * 0.5f - ref;
+    float r = glm::length(bmax - bmin) * 0.5f;
+    return n.power / std::max(glm::dot(d, d), std::max(r * r, 1e-8f));
+}
+
+EmitterSample BVH::sample_emitter(const glm::vec3 &ref, float u0, float u1, float u2) const
+{
+    EmitterSample sample{ vec3(0.0f, 0.0f, 0.0f), vec3(0.0f, 0.0f, 0.0f), -1, 0.0f };
+    int n = emitters.size();
+    if (n == 0)
+    {
+        return sample;
+    }
+    u0 = std::clamp(u0, 0.0f, 0.99999994f);
+
+    float prob = 0.0f;
+    if (!light_nodes.empty())
+    {
+        int node = 0;
+        prob = 1.0f;
+        while (light_nodes[node].emitter < 0)
+        {
+            float il = light_importance(light_nodes[node].l, ref);
+            float ir = light_importance(light_nodes[node].r, ref);
+            float pl = il + ir > 0.0f ? il / (il + ir) : 0.5f;
+            if (u0 < pl)
+            {
+                u0 = std::min(u0 / pl, 0.99999994f);
+                node = light_nodes[node].l;
+                prob *= pl;
+            }
+            else
+            {
+                u0 = std::min((u0 - pl) / (1.0f - pl), 0.99999994f);
+                node = light_nodes[node].r;
+                prob *= 1.0f - pl;
+            }
+        }
+        sample.emitter = light_nodes[node].emitter;
+    }
+    else
+    {
+        float scaled = u0 * n;
+        int column = std::min((int) scaled, n - 1);
+        sample.emitter = (scaled - column) < alias[column].prob ? column : alias[column].alias;
+        prob = total_power > 0.0f ? emitter_power[sample.emitter] / total_power : 1.0f / n;
+    }
+
+    // Uniformly sample the triangle; see sample_uniform_triangle in Lua.
+    Triangle t = get_emitter(sample.emitter);
+    float su0 = std::sqrt(u1);
+    float b0 = 1.0f - su0, b1 = u2 * su0;
+    glm::vec3 p = t.a.position * b0 + t.b.position * b1 + t.c.position * (1.0f - b0 - b1);
+    glm::vec3 nor = glm::cross(t.b.position - t.a.position, t.c.position - t.a.position);
+    float len = glm::length(nor);
+    if (len > 0.0f)
+    {
+        nor = nor * (1.0f / len);
+    }
+
+    sample.position = *((Vec3C *) &p);
+    sample.normal = *((Vec3C *) &nor);
+    sample.pdf = emitter_area[sample.emitter] > 0.0f ? prob / emitter_area[sample.emitter] : 0.0f;
+    return sample;
+}
+
+float BVH::emitter_pdf(const glm::vec3 &ref, int emitter) const
+{
+    assert((emitter >= 0 && emitter < emitters.size()) && "Emitter index out of bound");
+
+    if (emitter_area[emitter] <= 0.0f)
+    {
+        return 0.0f;
+    }
+
+    float prob = 1.0f;
+    if (!light_nodes.empty())
+    {
+        // Walk up from the leaf, multiplying the probabilities of taking each branch.
+        int node = emitter_leaf[emitter];
+        while (light_nodes[node].parent >= 0)
+        {
+            const LightNode &parent = light_nodes[light_nodes[node].parent];
+            float il = light_importance(parent.l, ref);
+            float ir = light_importance(parent.r, ref);
+            float pl = il + ir > 0.0f ? il / (il + ir) : 0.5f;
+            prob *= parent.l == node ? pl : 1.0f - pl;
+            node = light_nodes[node].parent;
+        }
+    }
+    else
+    {
+        prob = total_power > 0.0f ? emitter_power[emitter] / total_power : 1.0f / emitters.size();
+    }
+    return prob / emitter_area[emitter];
+}
+
 int BVH::get_num_nodes() const
 {
     return nodes.size();
@@ -94,13 +375,15 @@ int BVH::get_num_nodes() const
 
 int BVH::partition(bool *pred, int begin, int end)
 {
+    assert(!is_compressed() && "Compressed BVHs cannot be modified");
     assert(begin >= 0 && end < tri.size() && "Invalid partition range");
+    hot.clear();
 
     while (begin <= end)
     {
         if (!pred[begin])
         {
-            const Triangle *t = tri[begin];
+            int t = tri[begin];
             tri[begin] = tri[end];
             tri[end] = t;
 
@@ -118,3 +401,406 @@ int BVH::partition(bool *pred, int begin, int end)
     }
     return begin;
 }
+
+
+/**
+ * Child boxes are decoded relative to the parent box. q = 0 maps exactly onto the parent's min,
+ * and q = 255 maps exactly onto the parent's max, so no amount of rounding can make the
+ * decoded box of a child poke out of its parent.
+ */
+static float dequantize_min(float pmin, float scale, uint8_t q)
+{
+    return pmin + q * scale;
+}
+
+static float dequantize_max(float pmax, float scale, uint8_t q)
+{
+    return pmax - (255 - q) * scale;
+}
+
+static void decode_qnode(const QNode &q, const glm::vec3 &pmin, const glm::vec3 &pmax, glm::vec3 &bmin, glm::vec3 &bmax)
+{
+    for (int a = 0; a < 3; a++)
+    {
+        float scale = (pmax[a] - pmin[a]) * (1.0f / 255.0f);
+        bmin[a] = dequantize_min(pmin[a], scale, q.qmin[a]);
+        bmax[a] = dequantize_max(pmax[a], scale, q.qmax[a]);
+    }
+}
+
+/**
+ * Slab test. Returns false if the ray misses the box within [tmin, tmax].
+ * The interval is widened slightly so that boxes of zero thickness (and rounding) don't cause misses.
+ */
+bool intersect_bbox(const glm::vec3 &ro, const glm::vec3 &rd_inv, const glm::vec3 &bmin, const glm::vec3 &bmax, float tmin, float tmax, float &tnear)
+{
+    for (int a = 0; a < 3; a++)
+    {
+        float t1 = (bmin[a] - ro[a]) * rd_inv[a];
+        float t2 = (bmax[a] - ro[a]) * rd_inv[a];
+        if (t1 > t2)
+        {
+            std::swap(t1, t2);
+        }
+        // NaN (ray parallel to & on the slab) comparisons are false, which leaves the interval untouched
+        if (t1 > tmin)
+        {
+            tmin = t1;
+        }
+        if (t2 < tmax)
+        {
+            tmax = t2;
+        }
+    }
+    tnear = tmin;
+    return tmin <= tmax + (std::abs(tmax) + 1.0f) * 1e-5f;
+}
+
+BBox BVH::exact_bbox(int node, std::vector<BBox> &boxes) const
+{
+    const Node &n = nodes[node];
+    BBox box = bbox();
+    if (n.l == 0 && n.r == 0)
+    {
+        for (int i = n.start; i < n.start + n.size; i++)
+        {
+            Triangle t = get_triangle(i);
+            enclose(box, *((Vec3C *) &t.a.position));
+            enclose(box, *((Vec3C *) &t.b.position));
+            enclose(box, *((Vec3C *) &t.c.position));
+        }
+    }
+    else
+    {
+        BBox l = exact_bbox(n.l, boxes);
+        BBox r = exact_bbox(n.r, boxes);
+        box.min = min3(l.min, r.min);
+        box.max = max3(l.max, r.max);
+    }
+    boxes[node] = box;
+    return box;
+}
+
+void BVH::compress_node(int node, int qnode, const glm::vec3 &pmin, const glm::vec3 &pmax, const std::vector<BBox> &boxes)
+{
+    const Node &n = nodes[node];
+    if (n.l == 0 && n.r == 0)
+    {
+        qnodes[qnode].size = n.size;
+        qnodes[qnode].index = n.start;
+        return;
+    }
+
+    int children = qnodes.size();
+    qnodes.resize(qnodes.size() + 2);
+    qnodes[qnode].size = QNODE_INNER;
+    qnodes[qnode].index = children;
+
+    int child_nodes[2] = { n.l, n.r };
+    for (int c = 0; c < 2; c++)
+    {
+        QNode &q = qnodes[children + c];
+        glm::vec3 cmin = to_glm(boxes[child_nodes[c]].min), cmax = to_glm(boxes[child_nodes[c]].max);
+        for (int a = 0; a < 3; a++)
+        {
+            float extent = pmax[a] - pmin[a];
+            float scale = extent * (1.0f / 255.0f);
+            int lo = 0, hi = 255;
+            if (extent > 0.0f)
+            {
+                lo = (int) std::clamp(std::floor((cmin[a] - pmin[a]) / extent * 255.0f), 0.0f, 255.0f);
+                hi = (int) std::clamp(std::ceil((cmax[a] - pmin[a]) / extent * 255.0f), 0.0f, 255.0f);
+            }
+            // Walk outwards until the dequantized values really do enclose the child
+            while (lo > 0 && dequantize_min(pmin[a], scale, lo) > cmin[a])
+            {
+                lo--;
+            }
+            while (hi < 255 && dequantize_max(pmax[a], scale, hi) < cmax[a])
+            {
+                hi++;
+            }
+            q.qmin[a] = lo;
+            q.qmax[a] = hi;
+        }
+    }
+
+    for (int c = 0; c < 2; c++)
+    {
+        glm::vec3 bmin, bmax;
+        decode_qnode(qnodes[children + c], pmin, pmax, bmin, bmax);
+        compress_node(child_nodes[c], children + c, bmin, bmax, boxes);
+    }
+}
+
+bool BVH::compress()
+{
+    if (is_compressed())
+    {
+        return true;
+    }
+    if (nodes.empty())
+    {
+        return false;
+    }
+
+    for (const Node &n : nodes)
+    {
+        if (n.l == 0 && n.r == 0 && n.size >= QNODE_INNER)
+        {
+            res()->report_error("Cannot compress BVH: leaf has too many triangles");
+            return false;
+        }
+    }
+
+    std::vector<BBox> boxes(nodes.size());
+    qroot = exact_bbox(0, boxes);
+    if (tri.empty())
+    {
+        qroot = BBox{ vec3(0.0f, 0.0f, 0.0f), vec3(0.0f, 0.0f, 0.0f) };
+    }
+
+    finalize();
+    qnodes.reserve(nodes.size());
+    qnodes.push_back(QNode{ { 0, 0, 0 }, { 255, 255, 255 }, 0, 0 });
+    compress_node(0, 0, to_glm(qroot.min), to_glm(qroot.max), boxes);
+
+    // Float nodes are no longer needed.
+    nodes.clear();
+    nodes.shrink_to_fit();
+    return true;
+}
+
+bool BVH::is_compressed() const
+{
+    return !qnodes.empty();
+}
+
+void BVH::finalize()
+{
+    hot.resize(tri.size());
+    for (int i = 0; i < tri.size(); i++)
+    {
+        Triangle t = get_triangle(i);
+        hot[i] = TriHot{ t.a.position, t.b.position - t.a.position, t.c.position - t.a.position };
+    }
+}
+
+VertexC BVH::get_hit_surface(const RayHit &hit) const
+{
+    assert((hit.tri >= 0 && hit.tri < tri.size()) && "Triangle index out of bound");
+
+    Triangle t = get_triangle(hit.tri);
+    float u = hit.uvt.x, v = hit.uvt.y, w = 1.0f - u - v;
+    glm::vec3 p = t.a.position * w + t.b.position * u + t.c.position * v;
+    glm::vec3 n = t.a.normal * w + t.b.normal * u + t.c.normal * v;
+    glm::vec2 uv = t.a.tex_coord * w + t.b.tex_coord * u + t.c.tex_coord * v;
+    return VertexC{ vec3(p.x, p.y, p.z), vec3(n.x, n.y, n.z), vec2(uv.x, uv.y), t.a.material_id };
+}
+
+/**
+ * Barycentric weights (of b and c) of the point where the ray crosses the plane of the triangle.
+ * Returns false if the ray runs parallel to it.
+ */
+static bool plane_barycentrics(const Triangle &t, const glm::vec3 &ro, const glm::vec3 &rd, glm::vec2 &bary)
+{
+    glm::vec3 e1 = t.b.position - t.a.position, e2 = t.c.position - t.a.position;
+    glm::vec3 n = glm::cross(e1, e2);
+    float denom = glm::dot(rd, n);
+    if (std::abs(denom) < 1e-12f)
+    {
+        return false;
+    }
+    glm::vec3 p = ro + rd * (glm::dot(t.a.position - ro, n) / denom) - t.a.position;
+    float d11 = glm::dot(e1, e1), d12 = glm::dot(e1, e2), d22 = glm::dot(e2, e2);
+    float p1 = glm::dot(p, e1), p2 = glm::dot(p, e2);
+    float det = d11 * d22 - d12 * d12;
+    if (std::abs(det) < 1e-20f)
+    {
+        return false;
+    }
+    bary = glm::vec2(d22 * p1 - d12 * p2, d11 * p2 - d12 * p1) / det;
+    return true;
+}
+
+void BVH::get_uv_differentials(const RayHit &hit, const glm::vec3 &ro, const glm::vec3 &rd_dx, const glm::vec3 &rd_dy, glm::vec2 &duvdx, glm::vec2 &duvdy) const
+{
+    assert((hit.tri >= 0 && hit.tri < tri.size()) && "Triangle index out of bound");
+
+    Triangle t = get_triangle(hit.tri);
+    glm::vec2 tu = t.b.tex_coord - t.a.tex_coord, tv = t.c.tex_coord - t.a.tex_coord;
+    glm::vec2 bx, by;
+    duvdx = glm::vec2(0.0f);
+    duvdy = glm::vec2(0.0f);
+    if (plane_barycentrics(t, ro, rd_dx, bx))
+    {
+        duvdx = tu * (bx.x - hit.uvt.x) + tv * (bx.y - hit.uvt.y);
+    }
+    if (plane_barycentrics(t, ro, rd_dy, by))
+    {
+        duvdy = tu * (by.x - hit.uvt.x) + tv * (by.y - hit.uvt.y);
+    }
+}
+
+bool intersect_triangle(const glm::vec3 &a, const glm::vec3 &e1, const glm::vec3 &e2, const glm::vec3 &ro, const glm::vec3 &rd, float tmin, int index, RayHit &hit)
+{
+    // The Moller-Trumbore method; the same as intersect_mt in Lua.
+    glm::vec3 pvec = glm::cross(rd, e2);
+    float det = glm::dot(e1, pvec);
+    if (std::abs(det) < 0.0001f)
+    {
+        return false;
+    }
+
+    float inv = 1.0f / det;
+    glm::vec3 tvec = ro - a;
+    float u = glm::dot(pvec, tvec) * inv;
+    if (u < 0.0f || u > 1.0f)
+    {
+        return false;
+    }
+
+    glm::vec3 qvec = glm::cross(tvec, e1);
+    float v = glm::dot(rd, qvec) * inv;
+    if (v < 0.0f || u + v > 1.0f)
+    {
+        return false;
+    }
+
+    float dist = glm::dot(e2, qvec) * inv;
+    if (dist < tmin || dist > hit.uvt.z)
+    {
+        return false;
+    }
+
+    hit.tri = index;
+    hit.uvt = vec3(u, v, dist);
+    return true;
+}
+
+bool BVH::intersect_tri(int index, const glm::vec3 &ro, const glm::vec3 &rd, float tmin, RayHit &hit) const
+{
+    if (!hot.empty())
+    {
+        const TriHot &t = hot[index];
+        return intersect_triangle(t.a, t.e1, t.e2, ro, rd, tmin, index, hit);
+    }
+    Triangle t = get_triangle(index);
+    return intersect_triangle(t.a.position, t.b.position - t.a.position, t.c.position - t.a.position, ro, rd, tmin, index, hit);
+}
+
+RayHit BVH::intersect(const glm::vec3 &ro, const glm::vec3 &rd, float tmin, float tmax) const
+{
+    if (is_compressed())
+    {
+        return intersect_qnodes(ro, rd, tmin, tmax);
+    }
+    return intersect_nodes(ro, rd, tmin, tmax);
+}
+
+RayHit BVH::intersect_nodes(const glm::vec3 &ro, const glm::vec3 &rd, float tmin, float tmax) const
+{
+    RayHit hit{ -1, vec3(0.0f, 0.0f, tmax) };
+    if (nodes.empty())
+    {
+        return hit;
+    }
+
+    glm::vec3 rd_inv(1.0f / rd.x, 1.0f / rd.y, 1.0f / rd.z);
+    thread_local std::vector<int> stack;
+    stack.clear();
+    stack.push_back(0);
+
+    while (!stack.empty())
+    {
+        const Node &n = nodes[stack.back()];
+        stack.pop_back();
+
+        float tnear;
+        if (!intersect_bbox(ro, rd_inv, to_glm(n.bbox.min), to_glm(n.bbox.max), tmin, hit.uvt.z, tnear))
+        {
+            continue;
+        }
+
+        if (n.l == 0 && n.r == 0)
+        {
+            for (int i = n.start; i < n.start + n.size; i++)
+            {
+                intersect_tri(i, ro, rd, tmin, hit);
+            }
+        }
+        else
+        {
+            stack.push_back(n.r);
+            stack.push_back(n.l);
+        }
+    }
+    return hit;
+}
+
+struct QEntry
+{
+    uint32_t node;
+    float tnear;
+    glm::vec3 bmin, bmax;
+};
+
+RayHit BVH::intersect_qnodes(const glm::vec3 &ro, const glm::vec3 &rd, float tmin, float tmax) const
+{
+    RayHit hit{ -1, vec3(0.0f, 0.0f, tmax) };
+    if (tri.empty())
+    {
+        return hit;
+    }
+
+    glm::vec3 rd_inv(1.0f / rd.x, 1.0f / rd.y, 1.0f / rd.z);
+    thread_local std::vector<QEntry> stack;
+    stack.clear();
+
+    QEntry root{ 0, 0.0f, to_glm(qroot.min), to_glm(qroot.max) };
+    if (!intersect_bbox(ro, rd_inv, root.bmin, root.bmax, tmin, tmax, root.tnear))
+    {
+        return hit;
+    }
+    stack.push_back(root);
+
+    while (!stack.empty())
+    {
+        QEntry e = stack.back();
+        stack.pop_back();
+        if (e.tnear > hit.uvt.z)
+        {
+            continue;
+        }
+
+        const QNode &q = qnodes[e.node];
+        if (q.size != QNODE_INNER)
+        {
+            for (uint32_t i = q.index; i < q.index + q.size; i++)
+            {
+                intersect_tri(i, ro, rd, tmin, hit);
+            }
+            continue;
+        }
+
+        // Decode both children, and visit the closer one first.
+        QEntry children[2];
+        bool hits[2];
+        for (int c = 0; c < 2; c++)
+        {
+            children[c].node = q.index + c;
+            decode_qnode(qnodes[q.index + c], e.bmin, e.bmax, children[c].bmin, children[c].bmax);
+            hits[c] = intersect_bbox(ro, rd_inv, children[c].bmin, children[c].bmax, tmin, hit.uvt.z, children[c].tnear);
+        }
+        int first = (hits[0] && hits[1] && children[1].tnear < children[0].tnear) ? 1 : 0;
+        if (hits[1 - first])
+        {
+            stack.push_back(children[1 - first]);
+        }
+        if (hits[first])
+        {
+            stack.push_back(children[first]);
+        }
+    }
+    return hit;
+}
@@ -13,13 +13,109 @@
 
 int BaseImage::image_id_counter = 0;
 
+void BaseImage::reset_dirty(int w, int h)
+{
+    dirty_w = (w + IMAGE_DIRTY_SIZE - 1) >> IMAGE_DIRTY_SHIFT;
+    dirty_h = (h + IMAGE_DIRTY_SIZE - 1) >> IMAGE_DIRTY_SHIFT;
+    dirty_image_w = w;
+    dirty_image_h = h;
+    dirty.reset(new std::atomic<bool>[dirty_w * dirty_h]);
+    mark_all_dirty();
+}
+
+void BaseImage::mark_all_dirty()
+{
+    for (int i = 0; i < dirty_w * dirty_h; i++)
+    {
+        dirty[i].store(true, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void BaseImage::mark_dirty_rect(int rx, int ry, int rw, int rh)
+{
+    int x0 = std::max(rx, 0) >> IMAGE_DIRTY_SHIFT, x1 = std::min(rx + rw - 1, dirty_image_w - 1) >> IMAGE_DIRTY_SHIFT;
+    int y0 = std::max(ry, 0) >> IMAGE_DIRTY_SHIFT, y1 = std::min(ry + rh - 1, dirty_image_h - 1) >> IMAGE_DIRTY_SHIFT;
+    for (int by = y0; by <= y1; by++)
+    {
+        for (int bx = x0; bx <= x1; bx++)
+        {
+            mark_dirty(bx << IMAGE_DIRTY_SHIFT, by << IMAGE_DIRTY_SHIFT);
+        }
+    }
+}
+
+void BaseImage::take_dirty(std::vector<ImageRect> &out)
+{
+    for (int by = 0; by < dirty_h; by++)
+    {
+        for (int bx = 0; bx < dirty_w; bx++)
+        {
+            // seq_cst pairs with the fence in mark_dirty: whatever the writer wrote before it checked the flag is visible below
+            if (dirty[by * dirty_w + bx].exchange(false, std::memory_order_seq_cst))
+            {
+                int x = bx << IMAGE_DIRTY_SHIFT, y = by << IMAGE_DIRTY_SHIFT;
+                out.push_back({ x, y, std::min(IMAGE_DIRTY_SIZE, dirty_image_w - x), std::min(IMAGE_DIRTY_SIZE, dirty_image_h - y) });
+            }
+        }
+    }
+}
+
+static float srgb_to_linear(float c)
+{
+    return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static float linear_to_srgb(float c)
+{
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+}
+
+static std::array<float, 256> make_u8_lut(bool srgb)
+{
+    std::array<float, 256> lut;
+    for (int i = 0; i < 256; i++)
+    {
+        lut[i] = (float) i / 255.0f;
+        if (srgb)
+        {
+            lut[i] = srgb_to_linear(lut[i]);
+        }
+    }
+    return lut;
+}
+
+const std::array<float, 256> u8_linear_lut = make_u8_lut(false);
+const std::array<float, 256> u8_srgb_lut = make_u8_lut(true);
+
+/**
+ * Index of the alpha channel for stb_image_resize's sRGB path.
+ */
+static int alpha_channel(int ch)
+{
+    if (ch == 2 || ch == 4)
+    {
+        return ch - 1;
+    }
+    return STBIR_ALPHA_CHANNEL_NONE;
+}
+
 template<>
 bool U8Image::save(const std::string &dest) const
 {
     assert(initialized && "Image is not initialized");
 
+    const unsigned char *pixels = image.get();
+    std::unique_ptr<unsigned char[]> linear;
+    if (layout != ImageLayout::Linear)
+    {
+        linear.reset(new unsigned char[w * h * ch]);
+        copy_linear(linear.get());
+        pixels = linear.get();
+    }
+
     stbi_flip_vertically_on_write(true);
-    int res = stbi_write_png(dest.c_str(), w, h, ch, image.get(), w * ch);
+    int res = stbi_write_png(dest.c_str(), w, h, ch, pixels, w * ch);
 
     return res != 0;
 }
@@ -29,8 +125,17 @@ bool U8Image::save_compressed(const std::string &dest, int quality) const
 {
     assert(initialized && "Image is not initialized");
 
+    const unsigned char *pixels = image.get();
+    std::unique_ptr<unsigned char[]> linear;
+    if (layout != ImageLayout::Linear)
+    {
+        linear.reset(new unsigned char[w * h * ch]);
+        copy_linear(linear.get());
+        pixels = linear.get();
+    }
+
     stbi_flip_vertically_on_write(true);
-    int res = stbi_write_jpg(dest.c_str(), w, h, ch, image.get(), quality);
+    int res = stbi_write_jpg(dest.c_str(), w, h, ch, pixels, quality);
 
     return res != 0;
 }
@@ -38,7 +143,8 @@ bool U8Image::save_compressed(const std::string &dest, int quality) const
 template<>
 bool U8Image::load(const std::string &path)
 {
-    stbi_set_flip_vertically_on_load(true);
+    // Textures are decoded concurrently (see Resources::load_textures), so keep the flag per-thread.
+    stbi_set_flip_vertically_on_load_thread(true);
 
     int image_ch = 0;
 
@@ -52,14 +158,28 @@ bool U8Image::load(const std::string &path)
     }
 
     unsigned char *data = stbi_load(path_sanitized.c_str(), &w, &h, &image_ch, 0);
-    assert((image_ch == 1 || image_ch == 3 || image_ch == 4) && "Unsupported number of channels");
 
     if (!data)
     {
         return false;
     }
+    assert((image_ch >= 1 && image_ch <= 4) && "Unsupported number of channels");
 
-    ch = 4; // Always reset it to 4
+    layout = ImageLayout::Linear;
+    mips.clear();
+    if (image_ch <= 2)
+    {
+        // Gray (+ alpha) is kept as is: metallic, roughness and bump maps take a quarter of the memory
+        ch = image_ch;
+        image.reset(new unsigned char[w * h * ch]);
+        std::memcpy(image.get(), data, w * h * ch);
+        stbi_image_free(data);
+        reset_dirty(w, h);
+        initialized = true;
+        return true;
+    }
+
+    ch = 4; // Color is always padded to 4
     image.reset(new unsigned char[w * h * ch]);
 
     // Now we need to convert the untis
@@ -69,23 +189,15 @@ bool U8Image::load(const std::string &path)
         {
             int offset_load = (y * w + x) * image_ch;
             image[at(x, y) + 0] = data[offset_load + 0];
-
-            if (ch == 3 || ch == 4)
-            {
-                image[at(x, y) + 1] = data[offset_load + 1];
-                image[at(x, y) + 2] = data[offset_load + 2];
-                image[at(x, y) + 3] = 255;
-
-                if (ch == 4)
-                {
-                    image[at(x, y) + 3] = data[offset_load + 3];
-                }
-            }
+            image[at(x, y) + 1] = data[offset_load + 1];
+            image[at(x, y) + 2] = data[offset_load + 2];
+            image[at(x, y) + 3] = image_ch == 4 ? data[offset_load + 3] : 255;
         }
     }
 
     stbi_image_free(data);
 
+    reset_dirty(w, h);
     initialized = true;
 
     return true;
@@ -94,18 +206,97 @@ bool U8Image::load(const std::string &path)
 template<>
 bool U8Image::resize(int nx, int ny)
 {
+    // stb_image_resize wants scanlines
+    ImageLayout old_layout = layout;
+    set_layout(ImageLayout::Linear);
+
     // 1. Allocate needed amount of memory
     std::unique_ptr<unsigned char[]> ptr(new unsigned char[nx * ny * ch]);
-    int ok = stbir_resize_uint8(image.get(), w, h, 0, ptr.get(), nx, ny, 0, ch);
+    int ok = 0;
+    if (srgb)
+    {
+        ok = stbir_resize_uint8_srgb(image.get(), w, h, 0, ptr.get(), nx, ny, 0, ch, alpha_channel(ch), 0);
+    }
+    else
+    {
+        ok = stbir_resize_uint8(image.get(), w, h, 0, ptr.get(), nx, ny, 0, ch);
+    }
 
     if (ok == 0)
     {
+        set_layout(old_layout);
         return false;
     }
 
     w = nx;
     h = ny;
     image = std::move(ptr);
+    mips.clear();
+    set_layout(old_layout);
+    reset_dirty(w, h);
+    return true;
+}
+
+template<>
+bool U8Image::generate_mipmaps()
+{
+    assert(initialized && "Image is not initialized");
+
+    // Levels are built from scanlines and then brought into the image's layout
+    ImageLayout old_layout = layout;
+    set_layout(ImageLayout::Linear);
+    mips.clear();
+    const unsigned char *src = image.get();
+    int sw = w, sh = h;
+    while (sw > 1 || sh > 1)
+    {
+        int nw = std::max(1, sw / 2), nh = std::max(1, sh / 2);
+        MipLevel level{ nw, nh, 0, std::unique_ptr<unsigned char[]>(new unsigned char[nw * nh * ch]) };
+        int ok = srgb ?
+            stbir_resize_uint8_srgb(src, sw, sh, 0, level.data.get(), nw, nh, 0, ch, alpha_channel(ch), 0) :
+            stbir_resize_uint8(src, sw, sh, 0, level.data.get(), nw, nh, 0, ch);
+        if (ok == 0)
+        {
+            mips.clear();
+            set_layout(old_layout);
+            return false;
+        }
+        mips.push_back(std::move(level));
+        src = mips.back().data.get();
+        sw = nw;
+        sh = nh;
+    }
+    set_layout(old_layout);
+    return true;
+}
+
+template<>
+bool FloatImage::generate_mipmaps()
+{
+    assert(initialized && "Image is not initialized");
+
+    // Levels are built from scanlines and then brought into the image's layout
+    ImageLayout old_layout = layout;
+    set_layout(ImageLayout::Linear);
+    mips.clear();
+    const float *src = image.get();
+    int sw = w, sh = h;
+    while (sw > 1 || sh > 1)
+    {
+        int nw = std::max(1, sw / 2), nh = std::max(1, sh / 2);
+        MipLevel level{ nw, nh, 0, std::unique_ptr<float[]>(new float[nw * nh * ch]) };
+        if (stbir_resize_float(src, sw, sh, 0, level.data.get(), nw, nh, 0, ch) == 0)
+        {
+            mips.clear();
+            set_layout(old_layout);
+            return false;
+        }
+        mips.push_back(std::move(level));
+        src = mips.back().data.get();
+        sw = nw;
+        sh = nh;
+    }
+    set_layout(old_layout);
     return true;
 }
 
@@ -114,11 +305,12 @@ RGB<unsigned char> U8Image::get_rgb(int x, int y) const
 {
     assert(initialized && "Image is not initialized");
 
-    RGB<unsigned char> ret;
-    ret.r = image[at(x, y) + 0];
-    ret.g = image[at(x, y) + 1];
-    ret.b = image[at(x, y) + 2];
-    return ret;
+    const unsigned char *texel = &image[at(x, y)];
+    if (ch < 3)
+    {
+        return RGB<unsigned char>(texel[0], texel[0], texel[0]);
+    }
+    return RGB<unsigned char>(texel[0], texel[1], texel[2]);
 }
 
 template<>
@@ -126,11 +318,7 @@ RGB<float> U8Image::get_rgb_float(int x, int y) const
 {
     assert(initialized && "Image is not initialized");
 
-    RGB<float> ret;
-    ret.r = (float) image[at(x, y) + 0] / 255.0f;
-    ret.g = (float) image[at(x, y) + 1] / 255.0f;
-    ret.b = (float) image[at(x, y) + 2] / 255.0f;
-    return ret;
+    return texel_rgb(&image[at(x, y)]);
 }
 
 template<>
@@ -138,14 +326,29 @@ void U8Image::set_rgb(int x, int y, const RGB<float> &rgb)
 {
     assert(initialized && "Image is not initialized");
 
-    image[at(x, y) + 0] = float_to_u8(rgb.r);
-    image[at(x, y) + 1] = float_to_u8(rgb.g);
-    image[at(x, y) + 2] = float_to_u8(rgb.b);
+    RGB<float> c = rgb;
+    if (srgb)
+    {
+        c = RGB<float>(linear_to_srgb(std::max(c.r, 0.0f)), linear_to_srgb(std::max(c.g, 0.0f)), linear_to_srgb(std::max(c.b, 0.0f)));
+    }
 
-    if (ch == 4)
+    unsigned char *texel = &image[at(x, y)];
+    if (ch < 3)
+    {
+        texel[0] = float_to_u8((c.r + c.g + c.b) / 3.0f);
+    }
+    else
+    {
+        texel[0] = float_to_u8(c.r);
+        texel[1] = float_to_u8(c.g);
+        texel[2] = float_to_u8(c.b);
+    }
+
+    if (ch == 2 || ch == 4)
     {
-        image[at(x, y) + 3] = 255;
+        texel[ch - 1] = 255;
     }
+    mark_dirty(x, y);
 }
 
 unsigned char float_to_u8(float t)
@@ -193,6 +396,8 @@ bool FloatImage::load(const std::string &path)
     }
 
     ch = 4; // Always reset it to 4
+    layout = ImageLayout::Linear;
+    mips.clear();
     image.reset(new float[w * h * ch]);
 
     // Now we need to convert the untis
@@ -215,6 +420,7 @@ bool FloatImage::load(const std::string &path)
 
     stbi_image_free(data);
 
+    reset_dirty(w, h);
     initialized = true;
 
     return true;
@@ -246,6 +452,108 @@ RGB<float> FloatImage::get_rgb_float(int x, int y) const
     return ret;
 }
 
+/**
+ * Calls fn(dst, src, n) for every row of the part of a rectangle that lies inside the image.
+ * dst points at n pixels of the image (ch floats each), src at the matching 3-float pixels of the rectangle.
+ */
+template<typename Fn>
+static void for_rect_rows(int w, int h, int ch, int rx, int ry, int rw, int rh, Fn fn)
+{
+    int x0 = std::max(rx, 0), x1 = std::min(rx + rw, w);
+    int y0 = std::max(ry, 0), y1 = std::min(ry + rh, h);
+    for (int y = y0; y < y1; y++)
+    {
+        fn((size_t) (y * w + x0) * ch, (size_t) ((y - ry) * rw + (x0 - rx)) * 3, x1 - x0);
+    }
+}
+
+template<>
+void FloatImage::write_rect(int rx, int ry, int rw, int rh, const float *rgb)
+{
+    assert(initialized && "Image is not initialized");
+    assert(layout == ImageLayout::Linear && "Rects are only supported on linear images");
+
+    float *dst = image.get();
+    int c = ch;
+    for_rect_rows(w, h, ch, rx, ry, rw, rh, [&](size_t d, size_t s, int n)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            dst[d + i * c + 0] = rgb[s + i * 3 + 0];
+            dst[d + i * c + 1] = rgb[s + i * 3 + 1];
+            dst[d + i * c + 2] = rgb[s + i * 3 + 2];
+            if (c == 4)
+            {
+                dst[d + i * c + 3] = 1.0f;
+            }
+        }
+    });
+    mark_dirty_rect(rx, ry, rw, rh);
+}
+
+template<>
+void FloatImage::read_rect(int rx, int ry, int rw, int rh, float *rgb) const
+{
+    assert(initialized && "Image is not initialized");
+    assert(layout == ImageLayout::Linear && "Rects are only supported on linear images");
+
+    const float *src = image.get();
+    int c = ch;
+    for_rect_rows(w, h, ch, rx, ry, rw, rh, [&](size_t d, size_t s, int n)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            rgb[s + i * 3 + 0] = src[d + i * c + 0];
+            rgb[s + i * 3 + 1] = src[d + i * c + 1];
+            rgb[s + i * 3 + 2] = src[d + i * c + 2];
+        }
+    });
+}
+
+template<>
+void FloatImage::accumulate_rect(int rx, int ry, int rw, int rh, const float *rgb)
+{
+    assert(initialized && "Image is not initialized");
+    assert(layout == ImageLayout::Linear && "Rects are only supported on linear images");
+
+    float *dst = image.get();
+    int c = ch;
+    for_rect_rows(w, h, ch, rx, ry, rw, rh, [&](size_t d, size_t s, int n)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            dst[d + i * c + 0] += rgb[s + i * 3 + 0];
+            dst[d + i * c + 1] += rgb[s + i * 3 + 1];
+            dst[d + i * c + 2] += rgb[s + i * 3 + 2];
+        }
+    });
+    mark_dirty_rect(rx, ry, rw, rh);
+}
+
+template<>
+void FloatImage::fill_rect(int rx, int ry, int rw, int rh, const RGB<float> &rgb)
+{
+    assert(initialized && "Image is not initialized");
+    assert(layout == ImageLayout::Linear && "Rects are only supported on linear images");
+
+    float *dst = image.get();
+    int c = ch;
+    for_rect_rows(w, h, ch, rx, ry, rw, rh, [&](size_t d, size_t s, int n)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            dst[d + i * c + 0] = rgb.r;
+            dst[d + i * c + 1] = rgb.g;
+            dst[d + i * c + 2] = rgb.b;
+            if (c == 4)
+            {
+                dst[d + i * c + 3] = 1.0f;
+            }
+        }
+    });
+    mark_dirty_rect(rx, ry, rw, rh);
+}
+
 template<>
 bool FloatImage::save(const std::string &dest) const
 {
@@ -284,4 +592,5 @@ void FloatImage::set_rgb(int x, int y, const RGB<float> &rgb)
     {
         image[at(x, y) + 3] = 1.0f;
     }
+    mark_dirty(x, y);
 }
@@ -4,8 +4,10 @@
 
 #include "imagegl.h"
 #include <cassert>
+#include <vector>
+#include <cstring>
 
-ImageGL::ImageGL() : initialized(false), texture(GL_NONE), image(nullptr)
+ImageGL::ImageGL() : initialized(false), texture(GL_NONE), image(nullptr), tex_w(0), tex_h(0), tex_ch(0), tex_unit(0), pbos{ GL_NONE, GL_NONE }, next_pbo(0)
 {
 
 }
@@ -19,6 +21,26 @@ ImageGL::ImageGL(std::shared_ptr<BaseImage> image) : ImageGL()
     }
 }
 
+/**
+ * Gray (+ alpha) images are shown as gray.
+ */
+static GLenum gl_format(int ch)
+{
+    const GLenum formats[] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+    assert(ch >= 1 && ch <= 4 && "Unsupported number of channels");
+    return formats[ch - 1];
+}
+
+static GLenum gl_type(int unit_size)
+{
+    if (unit_size == sizeof(unsigned char))
+    {
+        return GL_UNSIGNED_BYTE;
+    }
+    assert(unit_size == sizeof(float) && "Unsupported base image");
+    return GL_FLOAT;
+}
+
 bool ImageGL::import_from_image(std::shared_ptr<BaseImage> image)
 {
     if (image == nullptr)
@@ -26,8 +48,6 @@ bool ImageGL::import_from_image(std::shared_ptr<BaseImage> image)
         return false;
     }
 
-    initialized = false;
-    this->image = image;
     if (texture == GL_NONE)
     {
         glGenTextures(1, &texture);
@@ -36,19 +56,27 @@ bool ImageGL::import_from_image(std::shared_ptr<BaseImage> image)
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glGenBuffers(2, pbos);
     }
+    glBindTexture(GL_TEXTURE_2D, texture); // Something else (e.g. the UI) might be bound by now
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // Rows of 1 and 3 channel images are not 4-byte aligned
 
-    if (image->unit_size() == sizeof(unsigned char))
-    {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image->width(), image->height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, image->get());
-    }
-    else if (image->unit_size() == sizeof(float))
+    bool same = initialized && image == this->image && image->width() == tex_w && image->height() == tex_h &&
+        image->channels() == tex_ch && image->unit_size() == tex_unit;
+    this->image = image;
+    dirty.clear();
+    image->take_dirty(dirty);
+    if (!same || image->get_layout() != ImageLayout::Linear)
     {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image->width(), image->height(), 0, GL_RGBA, GL_FLOAT, image->get());
+        // New, resized or tiled (which is never written to after loading): start over
+        if (!same || !dirty.empty())
+        {
+            upload_all();
+        }
     }
-    else
+    else if (!dirty.empty())
     {
-        assert(false && "Unsupported base image");
+        upload_dirty(dirty);
     }
 
     initialized = true;
@@ -56,6 +84,77 @@ bool ImageGL::import_from_image(std::shared_ptr<BaseImage> image)
     return true;
 }
 
+void ImageGL::upload_all()
+{
+    // GL wants scanlines; tiled images are unswizzled first
+    const void *pixels = image->get();
+    std::vector<char> linear;
+    if (image->get_layout() != ImageLayout::Linear)
+    {
+        linear.resize((size_t) image->width() * image->height() * image->channels() * image->unit_size());
+        image->copy_linear(linear.data());
+        pixels = linear.data();
+    }
+
+    const GLint swizzles[][4] = {
+        { GL_RED, GL_RED, GL_RED, GL_ONE },
+        { GL_RED, GL_RED, GL_RED, GL_GREEN },
+        { GL_RED, GL_GREEN, GL_BLUE, GL_ONE },
+        { GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA }
+    };
+    int ch = image->channels();
+    glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzles[ch - 1]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image->width(), image->height(), 0, gl_format(ch), gl_type(image->unit_size()), pixels);
+
+    tex_w = image->width();
+    tex_h = image->height();
+    tex_ch = ch;
+    tex_unit = image->unit_size();
+}
+
+void ImageGL::upload_dirty(const std::vector<ImageRect> &rects)
+{
+    size_t pixel_size = (size_t) tex_ch * tex_unit, row_size = (size_t) tex_w * pixel_size;
+    size_t total = 0;
+    for (const ImageRect &r : rects)
+    {
+        total += (size_t) r.w * r.h * pixel_size;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[next_pbo]);
+    next_pbo = (next_pbo + 1) % 2;
+    // Orphan the old storage; the driver keeps it alive until its transfer is done
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, total, nullptr, GL_STREAM_DRAW);
+    char *dst = (char *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, total, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (dst == nullptr)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        upload_all();
+        return;
+    }
+
+    // Pack the blocks one after another, then let GL pull them out of the buffer asynchronously
+    const char *src = (const char *) image->get();
+    size_t offset = 0;
+    for (const ImageRect &r : rects)
+    {
+        for (int y = 0; y < r.h; y++)
+        {
+            std::memcpy(dst + offset + y * r.w * pixel_size, src + (r.y + y) * row_size + r.x * pixel_size, r.w * pixel_size);
+        }
+        offset += (size_t) r.w * r.h * pixel_size;
+    }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    offset = 0;
+    for (const ImageRect &r : rects)
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, r.w, r.h, gl_format(tex_ch), gl_type(tex_unit), (const void *) offset);
+        offset += (size_t) r.w * r.h * pixel_size;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
 const std::shared_ptr<BaseImage> ImageGL::get_base_image() const
 {
     return image;
@@ -63,9 +162,10 @@ const std::shared_ptr<BaseImage> ImageGL::get_base_image() const
 
 ImageGL::~ImageGL()
 {
-    if (initialized)
+    if (texture != GL_NONE)
     {
         glDeleteTextures(1, &texture);
+        glDeleteBuffers(2, pbos);
         initialized = false;
     }
 }
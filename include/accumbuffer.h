@@ -0,0 +1,261 @@
+// Accumulation buffers: running per-pixel means and variances for progressive rendering.
+// SPDX-FileCopyrightText: 2023 42yeah <email>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef ACCUMBUFFER_H
+#define ACCUMBUFFER_H
+
+#include <memory>
+#include <mutex>
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include "image.h"
+
+#define ACCUM_LOCK_STRIPES 256
+
+/**
+ * Accumulation buffers collect any number of samples per pixel. Every pixel keeps its sample count,
+ * its mean and its sum of squared differences from the mean (Welford's method), so the variance is
+ * available at any time without a second pass. Adds are thread-safe.
+ */
+class AccumBuffer
+{
+public:
+    virtual ~AccumBuffer() = default;
+
+    /**
+     * Add one sample to pixel (x, y). Samples outside the buffer are dropped.
+     */
+    virtual void add(int x, int y, const RGB<float> &rgb) = 0;
+
+    /**
+     * Add one sample to every pixel of a rw x rh rectangle at (rx, ry). rgb holds 3 floats per pixel,
+     * row after row (like FloatImage::write_rect.) Pixels outside the buffer are skipped.
+     */
+    virtual void add_rect(int rx, int ry, int rw, int rh, const float *rgb) = 0;
+
+    virtual int get_count(int x, int y) const = 0;
+    virtual RGB<float> get_sum(int x, int y) const = 0;
+    virtual RGB<float> get_mean(int x, int y) const = 0;
+
+    /**
+     * Sample variance per channel (0 with less than two samples.)
+     */
+    virtual RGB<float> get_variance(int x, int y) const = 0;
+
+    /**
+     * How noisy a rectangle still is: the mean over its pixels of the relative standard error of the
+     * pixel mean (using the average of the channel variances.) Pixels with less than two samples make
+     * it infinite.
+     */
+    virtual float estimate_error(int rx, int ry, int rw, int rh) const = 0;
+
+    /**
+     * Write the mean of every pixel to dst, which has to be the same size.
+     */
+    virtual void resolve(FloatImage &dst) const = 0;
+
+    /**
+     * Same, for the pixels of a rw x rh rectangle at (rx, ry) only; the rest of dst is left alone.
+     */
+    virtual void resolve_rect(FloatImage &dst, int rx, int ry, int rw, int rh) const = 0;
+
+    virtual void clear() = 0;
+    virtual void clear_rect(int rx, int ry, int rw, int rh) = 0;
+
+    virtual int width() const = 0;
+    virtual int height() const = 0;
+};
+
+/**
+ * T is the precision of the accumulated mean and M2 (float or double.)
+ */
+template<typename T>
+class TypedAccumBuffer : public AccumBuffer
+{
+public:
+    TypedAccumBuffer(int w, int h) : w(w), h(h), pixels(new Pixel[(size_t) w * h])
+    {
+        assert(w >= 0 && h >= 0 && "Invalid accumulation buffer size");
+        clear();
+    }
+
+    TypedAccumBuffer(const TypedAccumBuffer &other) = delete;
+
+    virtual void add(int x, int y, const RGB<float> &rgb) override
+    {
+        if (x < 0 || y < 0 || x >= w || y >= h)
+        {
+            return;
+        }
+        size_t i = (size_t) y * w + x;
+        std::lock_guard<std::mutex> lk(stripes[i % ACCUM_LOCK_STRIPES]);
+        accumulate(pixels[i], rgb.r, rgb.g, rgb.b);
+    }
+
+    virtual void add_rect(int rx, int ry, int rw, int rh, const float *rgb) override
+    {
+        int x0 = std::max(rx, 0), x1 = std::min(rx + rw, w);
+        int y0 = std::max(ry, 0), y1 = std::min(ry + rh, h);
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                const float *c = &rgb[((size_t) (y - ry) * rw + (x - rx)) * 3];
+                size_t i = (size_t) y * w + x;
+                std::lock_guard<std::mutex> lk(stripes[i % ACCUM_LOCK_STRIPES]);
+                accumulate(pixels[i], c[0], c[1], c[2]);
+            }
+        }
+    }
+
+    virtual int get_count(int x, int y) const override
+    {
+        return read(x, y).count;
+    }
+
+    virtual RGB<float> get_sum(int x, int y) const override
+    {
+        Pixel p = read(x, y);
+        return RGB<float>(p.mean[0] * p.count, p.mean[1] * p.count, p.mean[2] * p.count);
+    }
+
+    virtual RGB<float> get_mean(int x, int y) const override
+    {
+        Pixel p = read(x, y);
+        return RGB<float>(p.mean[0], p.mean[1], p.mean[2]);
+    }
+
+    virtual RGB<float> get_variance(int x, int y) const override
+    {
+        Pixel p = read(x, y);
+        if (p.count < 2)
+        {
+            return RGB<float>(0.0f, 0.0f, 0.0f);
+        }
+        T n = p.count - 1;
+        return RGB<float>(p.m2[0] / n, p.m2[1] / n, p.m2[2] / n);
+    }
+
+    virtual float estimate_error(int rx, int ry, int rw, int rh) const override
+    {
+        int x0 = std::max(rx, 0), x1 = std::min(rx + rw, w);
+        int y0 = std::max(ry, 0), y1 = std::min(ry + rh, h);
+        double total = 0.0;
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                Pixel p = read(x, y);
+                if (p.count < 2)
+                {
+                    return std::numeric_limits<float>::infinity();
+                }
+                double variance = (p.m2[0] + p.m2[1] + p.m2[2]) / (3.0 * (p.count - 1));
+                double mean = (p.mean[0] + p.mean[1] + p.mean[2]) / 3.0;
+                total += std::sqrt(variance / p.count) / (std::abs(mean) + 1e-3); // The epsilon keeps black pixels from dominating
+            }
+        }
+        int n = (x1 - x0) * (y1 - y0);
+        return n > 0 ? total / n : 0.0f;
+    }
+
+    virtual void resolve(FloatImage &dst) const override
+    {
+        resolve_rect(dst, 0, 0, w, h);
+    }
+
+    virtual void resolve_rect(FloatImage &dst, int rx, int ry, int rw, int rh) const override
+    {
+        assert(dst.w == w && dst.h == h && "Resolve target has the wrong size");
+        int x0 = std::max(rx, 0), x1 = std::min(rx + rw, w);
+        int y0 = std::max(ry, 0), y1 = std::min(ry + rh, h);
+        if (x1 <= x0)
+        {
+            return;
+        }
+        std::unique_ptr<float[]> row(new float[(size_t) (x1 - x0) * 3]);
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                Pixel p = read(x, y);
+                row[(x - x0) * 3 + 0] = p.mean[0];
+                row[(x - x0) * 3 + 1] = p.mean[1];
+                row[(x - x0) * 3 + 2] = p.mean[2];
+            }
+            dst.write_rect(x0, y, x1 - x0, 1, row.get());
+        }
+    }
+
+    virtual void clear() override
+    {
+        clear_rect(0, 0, w, h);
+    }
+
+    virtual void clear_rect(int rx, int ry, int rw, int rh) override
+    {
+        int x0 = std::max(rx, 0), x1 = std::min(rx + rw, w);
+        int y0 = std::max(ry, 0), y1 = std::min(ry + rh, h);
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                size_t i = (size_t) y * w + x;
+                std::lock_guard<std::mutex> lk(stripes[i % ACCUM_LOCK_STRIPES]);
+                pixels[i] = Pixel();
+            }
+        }
+    }
+
+    virtual int width() const override
+    {
+        return w;
+    }
+
+    virtual int height() const override
+    {
+        return h;
+    }
+
+private:
+    struct Pixel
+    {
+        uint32_t count = 0;
+        T mean[3] = { 0, 0, 0 };
+        T m2[3] = { 0, 0, 0 };
+    };
+
+    static void accumulate(Pixel &p, T r, T g, T b)
+    {
+        T sample[3] = { r, g, b };
+        p.count++;
+        for (int c = 0; c < 3; c++)
+        {
+            T delta = sample[c] - p.mean[c];
+            p.mean[c] += delta / p.count;
+            p.m2[c] += delta * (sample[c] - p.mean[c]);
+        }
+    }
+
+    /**
+     * A consistent copy of pixel (x, y), which is clamped into the buffer.
+     */
+    Pixel read(int x, int y) const
+    {
+        x = std::min(std::max(x, 0), w - 1);
+        y = std::min(std::max(y, 0), h - 1);
+        size_t i = (size_t) y * w + x;
+        std::lock_guard<std::mutex> lk(stripes[i % ACCUM_LOCK_STRIPES]);
+        return pixels[i];
+    }
+
+    int w, h;
+    std::unique_ptr<Pixel[]> pixels;
+    mutable std::mutex stripes[ACCUM_LOCK_STRIPES]; // Pixel i is guarded by stripes[i % ACCUM_LOCK_STRIPES]
+};
+
+#endif // ACCUMBUFFER_H
@@ -12,6 +12,8 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <atomic>
+#include <memory>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include "job.h"
@@ -20,6 +22,24 @@
 #include "imagegl.h"
 #include "luaenv.h"
 #define MAX_INPUT_CHAR_LENGTH 256
+#define MIN_JOB_TILE 4 // Jobs are never cut below 4x4 pixels (4 float pixels are a cache line)
+#define MIN_STEAL_PIXELS 2 // Idle workers only help with tiles that have at least this many pixels left
+
+/**
+ * A pixel tile job being shaded. Its pixels are handed out one at a time: to the worker that took the
+ * job, and, once the queue is empty, to idle workers that help it finish.
+ */
+struct TileWork
+{
+    ParallelParams pparams;
+    std::vector<std::pair<int, int>> pixels;
+    std::atomic<int> next{ 0 };
+
+    int unclaimed() const
+    {
+        return std::max((int) pixels.size() - next.load(std::memory_order_relaxed), 0);
+    }
+};
 
 /**
  * App manages both the OpenGL context and the Lua context. Basically the user interface.
@@ -56,9 +76,39 @@ private:
     void render_ui();
     void launch_new_thread();
     void queue_single_job(const Job &job);
-    void queue_batch_job(int w, int h, const std::string &path, bool wait_until_finish);
+    /**
+     * Queue one job per pixel of a w x h image, or only those inside crop if it is given.
+     */
+    void queue_batch_job(int w, int h, const std::string &path, bool wait_until_finish, const ImageRect *crop = nullptr);
+
+    /**
+     * Runs an adaptive batch (see BatchParams) and waits until it is done.
+     */
+    BatchResult queue_adaptive_job(int w, int h, const std::string &path, const BatchParams &params);
+
+    /**
+     * Runs coarse to fine batches (see shade_coarse_to_fine) and waits until they are done.
+     */
+    void queue_coarse_to_fine_job(int w, int h, const std::string &path, FloatImage *target, int coarsest);
     void update_framebuffer_size();
 
+    /**
+     * Where the cursor is on the displayed image, in texture coordinates, and back.
+     */
+    void cursor_uv(float &u, float &v) const;
+    void uv_to_screen(float u, float v, float &x, float &y) const;
+
+    /**
+     * Dragging over the viewed image selects the region plain shade() calls are cropped to.
+     */
+    void update_region_selection();
+
+    /**
+     * The pixels a batch over a w x h image covers: crop if given, else the selected region if it
+     * was selected on an image of that size, else everything. Clipped to the image; mu has to be held.
+     */
+    ImageRect batch_area(int w, int h, const ImageRect *crop) const;
+
     /**
      * @returns if a batch job is launched at the moment.
      */
@@ -66,10 +116,26 @@ private:
 
     static void worker_thread(App &app, int thread_id);
 
+    /**
+     * Runs the script of a per-pixel tile job for each of its pixels, buffering their output (see begin_tile_output.)
+     */
+    static void shade_pixel_tile(App &app, Lua &lua, const ParallelParams &tile);
+
+    /**
+     * Shade pixels of work until none are left to claim.
+     */
+    static void shade_tile_pixels(App &app, Lua &lua, TileWork &work);
+
+    /**
+     * The tile in progress with the most pixels left to claim, if that is at least MIN_STEAL_PIXELS.
+     * Call with mu held.
+     */
+    std::shared_ptr<TileWork> find_straggler() const;
+
     GLFWwindow *window;
     int w, h;
     bool initialized;
-    bool alive;
+    std::atomic<bool> alive; // Read by workers between pixels, without mu
 
     // Threads
     std::vector<std::thread> threads;
@@ -77,8 +143,15 @@ private:
     std::queue<Job> jobs;
     int batch_job_count;
     int done_job_count;
+    // Set under mu (so waiters see them), but also polled without it by workers and the UI
+    std::atomic<bool> abort_requested; // Stops adaptive batches from launching their next pass
+    std::atomic<bool> stop_requested; // Same, but the partial result is still resolved
+    std::atomic<bool> adaptive_running;
+    std::atomic<int> adaptive_pass, adaptive_max_passes; // For the bottom bar
     std::condition_variable cv;
     std::mutex mu;
+    TileCosts batch_costs, adaptive_costs; // Of the last plain and adaptive batches (or passes)
+    std::vector<std::shared_ptr<TileWork>> tiles_in_progress; // Guarded by mu
 
     // UI flags
     bool ui_show_resources, ui_show_lua;
@@ -86,6 +159,12 @@ private:
     char code_injection[MAX_INPUT_CHAR_LENGTH];
     std::vector<std::string> previous_scripts;
     int viewing_image_idx, viewing_model_idx, viewing_bvh_idx;
+
+    // Region of interest, in pixels of an image of region_image_w x region_image_h
+    bool region_active, region_dragging;
+    ImageRect region;
+    int region_image_w, region_image_h;
+    float drag_u, drag_v;
     bool is_wayland;
 
     // Misc resources
@@ -8,9 +8,61 @@
 #include <glm/glm.hpp>
 #include <vector>
 #include <memory>
+#include <cstdint>
 #include "model.h"
 #include "luamath.h"
 
+#define QNODE_INNER 0xffff
+
+/**
+ * A compressed BVH node (12 bytes, versus 40 for a Node).
+ * The bounding box is stored as 8-bit offsets relative to the parent's decoded bounding box.
+ * Siblings are stored next to each other, so inner nodes only need to know where the left child is.
+ */
+struct QNode
+{
+    uint8_t qmin[3], qmax[3];
+    uint16_t size; // Number of triangles for leaves, QNODE_INNER for inner nodes
+    uint32_t index; // First triangle for leaves, left child for inner nodes (right child is index + 1)
+};
+
+/**
+ * The only part of a triangle intersection needs. Kept in BVH order, separate from
+ * normals, texture coordinates and materials, which are only fetched for the closest hit.
+ */
+struct TriHot
+{
+    glm::vec3 a, e1, e2; // e1 = b - a, e2 = c - a
+};
+
+struct AliasEntry
+{
+    float prob;
+    int alias;
+};
+
+/**
+ * Light tree node. Leaves hold exactly one emitter.
+ */
+struct LightNode
+{
+    BBox bbox;
+    float power;
+    int l, r, parent;
+    int emitter; // -1 for inner nodes
+};
+
+/**
+ * Slab test of the ray against [bmin, bmax], clipped to [tmin, tmax]. tnear is where the ray enters the box.
+ */
+bool intersect_bbox(const glm::vec3 &ro, const glm::vec3 &rd_inv, const glm::vec3 &bmin, const glm::vec3 &bmax, float tmin, float tmax, float &tnear);
+
+/**
+ * Moller-Trumbore intersection of the ray against the triangle (a, a + e1, a + e2).
+ * Records the hit as index if it is in [tmin, hit.uvt.z].
+ */
+bool intersect_triangle(const glm::vec3 &a, const glm::vec3 &e1, const glm::vec3 &e2, const glm::vec3 &ro, const glm::vec3 &rd, float tmin, int index, RayHit &hit);
+
 /**
  * A Bounding Volume Hierarchy (BVH), used to accelerate pathtracing.
  */
@@ -26,11 +78,40 @@ public:
     void set_children(int who, int l, int r);
     int get_num_nodes() const;
 
-    const Triangle &get_triangle(int index) const;
+    Triangle get_triangle(int index) const;
     int get_num_triangles() const;
 
-    const Triangle &get_emitter(int index) const;
+    /**
+     * Index into the model of the triangle at index (in BVH order.)
+     */
+    int get_model_index(int index) const;
+
+    /**
+     * Whether the nodes came prebuilt with the model (from a binary mesh file.)
+     * Such BVHs are already finalized and need no construction.
+     */
+    bool is_prebuilt() const;
+
+    Triangle get_emitter(int index) const;
     int get_num_emitters() const;
+    float get_emitter_power(int index) const;
+
+    /**
+     * Pick an emitter proportional to its power (area * average emission) using the alias table,
+     * or according to its estimated contribution to ref if the light tree has been built.
+     * u0 selects the emitter, while u1 and u2 select the point on it.
+     */
+    EmitterSample sample_emitter(const glm::vec3 &ref, float u0, float u1, float u2) const;
+
+    /**
+     * PDF (with respect to area) of sample_emitter() choosing a point on the emitter.
+     */
+    float emitter_pdf(const glm::vec3 &ref, int emitter) const;
+
+    /**
+     * Build a light tree over the emitters for spatially-aware many-light sampling.
+     */
+    void build_light_tree();
 
     /**
      * Partition the table based on preds.
@@ -39,10 +120,60 @@ public:
      */
     int partition(bool *pred, int begin, int end);
 
+    /**
+     * Build the intersection-only triangle array. Call once the BVH is constructed;
+     * partitioning afterwards discards it again.
+     */
+    void finalize();
+
+    /**
+     * Interpolate the shading attributes (position, normal, texture coordinates) of a hit.
+     */
+    VertexC get_hit_surface(const RayHit &hit) const;
+
+    /**
+     * Texture coordinate differentials of a hit: the rays (ro, rd_dx) and (ro, rd_dy) through the
+     * neighbouring pixels are intersected with the plane of the hit triangle.
+     */
+    void get_uv_differentials(const RayHit &hit, const glm::vec3 &ro, const glm::vec3 &rd_dx, const glm::vec3 &rd_dy, glm::vec2 &duvdx, glm::vec2 &duvdy) const;
+
+    /**
+     * Convert the (fully constructed) node list into compressed nodes.
+     * The float nodes are discarded afterwards; the BVH can then only be traversed through intersect().
+     * Returns false if the BVH cannot be compressed (e.g. a leaf is too large.)
+     */
+    bool compress();
+    bool is_compressed() const;
+
+    /**
+     * Find the closest triangle hit by the ray within [tmin, tmax].
+     * Uses the compressed nodes if they are available.
+     */
+    RayHit intersect(const glm::vec3 &ro, const glm::vec3 &rd, float tmin, float tmax) const;
+
 private:
-    std::vector<const Triangle *> tri; // We will need to rearrange these triangles
-    std::vector<const Triangle *> emitters; // During the iteration, we will meet emitters
+    void build_alias_table();
+    int build_light_node(std::vector<int> &order, int begin, int end, int parent);
+    float light_importance(int node, const glm::vec3 &ref) const;
+
+    BBox exact_bbox(int node, std::vector<BBox> &boxes) const;
+    void compress_node(int node, int qnode, const glm::vec3 &pmin, const glm::vec3 &pmax, const std::vector<BBox> &boxes);
+    bool intersect_tri(int index, const glm::vec3 &ro, const glm::vec3 &rd, float tmin, RayHit &hit) const;
+    RayHit intersect_nodes(const glm::vec3 &ro, const glm::vec3 &rd, float tmin, float tmax) const;
+    RayHit intersect_qnodes(const glm::vec3 &ro, const glm::vec3 &rd, float tmin, float tmax) const;
+
+    std::vector<int> tri; // Model triangle indices. We will need to rearrange these triangles
+    std::vector<TriHot> hot; // Positions only, in the same order as tri
+    std::vector<int> emitters; // During the iteration, we will meet emitters
+    std::vector<float> emitter_power, emitter_area;
+    std::vector<AliasEntry> alias;
+    float total_power;
+    bool prebuilt;
+    std::vector<LightNode> light_nodes;
+    std::vector<int> emitter_leaf;
     std::vector<Node> nodes;
+    std::vector<QNode> qnodes; // Compressed nodes; qroot is the bounding box of the root
+    BBox qroot;
     std::shared_ptr<Model> model;
 
     int id_;
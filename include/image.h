@@ -10,6 +10,11 @@
 #include <cassert>
 #include <cstring>
 #include <cmath>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <type_traits>
 
 
 template<typename T>
@@ -35,6 +40,29 @@ enum class SampleMethod
     Clamp, Repeat
 };
 
+/**
+ * How pixels are laid out in memory. Linear is plain scanline order.
+ * Tiled stores 4x4 tiles (one 64-byte cache line for RGBA8) in scanline order of tiles, so that texels
+ * close to each other in 2D are also close in memory. Sampled textures use it; anything that needs
+ * scanlines (saving, GL uploads) goes through copy_linear().
+ */
+enum class ImageLayout
+{
+    Linear, Tiled
+};
+
+#define IMAGE_TILE_SHIFT 2
+#define IMAGE_TILE_SIZE (1 << IMAGE_TILE_SHIFT)
+#define IMAGE_TILE_MASK (IMAGE_TILE_SIZE - 1)
+
+#define IMAGE_DIRTY_SHIFT 6 // Dirty tracking works on 64x64 pixel blocks
+#define IMAGE_DIRTY_SIZE (1 << IMAGE_DIRTY_SHIFT)
+
+struct ImageRect
+{
+    int x, y, w, h;
+};
+
 /**
  * Images need to satisfy:
  * 1. Have a width and a height;
@@ -50,16 +78,80 @@ public:
     virtual RGB<float> get_rgb_float(int x, int y) const = 0;
     virtual RGB<float> sample_rgb(float u, float v, SampleMethod method) const = 0;
 
+    /**
+     * Trilinearly filtered lookup. lod 0 is the full-resolution image, every level above halves it.
+     * Images without mipmaps are filtered bilinearly at level 0.
+     */
+    virtual RGB<float> sample_rgb_lod(float u, float v, float lod, SampleMethod method) const = 0;
+
+    /**
+     * Lookup with the level picked so that a texel roughly covers footprint (a width in texture space,
+     * e.g. from ray differentials.)
+     */
+    RGB<float> sample_rgb_footprint(float u, float v, float footprint, SampleMethod method) const
+    {
+        float texels = footprint * std::max(width(), height());
+        return sample_rgb_lod(u, v, texels > 1.0f ? log2f(texels) : 0.0f, method);
+    }
+
     virtual ~BaseImage() = default;
     virtual const void *const get() const = 0;
 
+    /**
+     * The storage layout of get(). copy_linear writes width * height pixels in scanline order to dst regardless.
+     */
+    virtual ImageLayout get_layout() const = 0;
+    virtual void copy_linear(void *dst) const = 0;
+
     virtual int unit_size() const = 0;
+    virtual int channels() const = 0;
 
     virtual int id() const = 0;
     virtual int width() const = 0;
     virtual int height() const = 0;
 
+    /**
+     * Writes mark the IMAGE_DIRTY_SIZE blocks they touch as dirty, so that viewers only upload what
+     * changed. Appends the dirty blocks (clipped to the image) to out and marks them clean.
+     * Safe to call while other threads are writing: a write that is missed now is reported next time.
+     * There should only be one consumer per image (the viewer.)
+     */
+    void take_dirty(std::vector<ImageRect> &out);
+    void mark_all_dirty();
+
     static int image_id_counter;
+
+protected:
+    /**
+     * Start tracking a w x h image with every block dirty. Has to be called whenever the size changes.
+     */
+    void reset_dirty(int w, int h);
+
+    /**
+     * (x, y) is clamped into the image, like at() does.
+     */
+    void mark_dirty(int x, int y)
+    {
+        if (!dirty)
+        {
+            return;
+        }
+        int bx = std::min(std::max(x, 0), dirty_image_w - 1) >> IMAGE_DIRTY_SHIFT;
+        int by = std::min(std::max(y, 0), dirty_image_h - 1) >> IMAGE_DIRTY_SHIFT;
+        std::atomic<bool> &flag = dirty[by * dirty_w + bx];
+        // Orders the write before the check; reading first keeps clean writers from bouncing the flag's cache line
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!flag.load(std::memory_order_relaxed))
+        {
+            flag.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    void mark_dirty_rect(int rx, int ry, int rw, int rh);
+
+private:
+    std::unique_ptr<std::atomic<bool>[]> dirty;
+    int dirty_w = 0, dirty_h = 0, dirty_image_w = 0, dirty_image_h = 0;
 };
 
 template<typename T>
@@ -69,15 +161,16 @@ public:
     /**
      * Default constructor
      */
-    Image() : w(0), h(0), ch(4), id_(BaseImage::image_id_counter++), image(nullptr), initialized(false)
+    Image() : w(0), h(0), ch(4), id_(BaseImage::image_id_counter++), image(nullptr), layout(ImageLayout::Linear), tiles_x(0), srgb(false), initialized(false)
     {
 
     }
 
-    Image(int w, int h, int ch) : w(w), h(h), ch(ch), id_(BaseImage::image_id_counter++), image(nullptr), initialized(false)
+    Image(int w, int h, int ch) : w(w), h(h), ch(ch), id_(BaseImage::image_id_counter++), image(nullptr), layout(ImageLayout::Linear), tiles_x(0), srgb(false), initialized(false)
     {
-        assert((ch == 3 || ch == 4) && "Unsupported numer of channels");
+        assert((ch >= 1 && ch <= 4) && "Unsupported numer of channels");
         image.reset(new T[w * h * ch]);
+        reset_dirty(w, h);
         initialized = true;
         for (int y = 0; y < h; y++)
         {
@@ -92,7 +185,8 @@ public:
     }
 
     /**
-     * Load image from file.
+     * Load image from file. Grayscale (and grayscale + alpha) files keep their 1 (or 2) channels;
+     * everything else is stored as RGBA. Fetches from 1 and 2 channel images return gray.
      * Returns false upon failure.
      */
     bool load(const std::string &path);
@@ -103,15 +197,93 @@ public:
         if (y < 0) { y = 0; }
         if (x >= w) { x = w - 1; }
         if (y >= h) { y = h - 1; }
-        return (y * w + x) * ch;
+        return texel_index(x, y, w, tiles_x, layout) * ch;
+    }
+
+    /**
+     * Index of texel (x, y) (which has to be in range) in a level of width w.
+     */
+    static int texel_index(int x, int y, int w, int tiles_x, ImageLayout layout)
+    {
+        if (layout == ImageLayout::Tiled)
+        {
+            int tile = (y >> IMAGE_TILE_SHIFT) * tiles_x + (x >> IMAGE_TILE_SHIFT);
+            return (tile << (2 * IMAGE_TILE_SHIFT)) + ((y & IMAGE_TILE_MASK) << IMAGE_TILE_SHIFT) + (x & IMAGE_TILE_MASK);
+        }
+        return y * w + x;
+    }
+
+    /**
+     * Switch the storage layout of the image and all of its mip levels.
+     */
+    void set_layout(ImageLayout new_layout)
+    {
+        if (new_layout == layout || !initialized)
+        {
+            return;
+        }
+        image = relayout(image.get(), w, h, layout, new_layout);
+        for (MipLevel &m : mips)
+        {
+            m.data = relayout(m.data.get(), m.w, m.h, layout, new_layout);
+            m.tiles_x = (m.w + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT;
+        }
+        tiles_x = (w + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT;
+        layout = new_layout;
+    }
+
+    virtual ImageLayout get_layout() const override
+    {
+        return layout;
+    }
+
+    /**
+     * 8-bit images can hold sRGB-encoded color. Fetches then decode to linear, mipmaps are filtered
+     * in linear space and set_rgb encodes. Set this before generating mipmaps. Float images are always linear.
+     */
+    void set_srgb(bool srgb)
+    {
+        this->srgb = srgb && std::is_same<T, unsigned char>::value;
+    }
+
+    bool is_srgb() const
+    {
+        return srgb;
+    }
+
+    virtual void copy_linear(void *dst) const override
+    {
+        T *out = (T *) dst;
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                std::memcpy(&out[(y * w + x) * ch], &image[texel_index(x, y, w, tiles_x, layout) * ch], sizeof(T) * ch);
+            }
+        }
     }
 
     virtual void set_rgb(int x, int y, const RGB<float> &rgb) override;
     virtual RGB<unsigned char> get_rgb(int x, int y) const override;
     virtual RGB<float> get_rgb_float(int x, int y) const override;
 
+    /**
+     * Block versions of set_rgb and get_rgb_float, for whole tiles at once. rgb holds rw x rh pixels of
+     * 3 floats each, row after row, for the rectangle starting at (rx, ry). Pixels outside the image
+     * are skipped (and left alone in rgb when reading.) accumulate_rect adds to what is there, and
+     * fill_rect sets the whole rectangle to one color. Only implemented for FloatImage.
+     */
+    void write_rect(int rx, int ry, int rw, int rh, const float *rgb);
+    void read_rect(int rx, int ry, int rw, int rh, float *rgb) const;
+    void accumulate_rect(int rx, int ry, int rw, int rh, const float *rgb);
+    void fill_rect(int rx, int ry, int rw, int rh, const RGB<float> &rgb);
+
     virtual RGB<float> sample_rgb(float u, float v, SampleMethod method) const override
     {
+        if (method == SampleMethod::Repeat && is_pow2())
+        {
+            return sample_rgb_repeat_pow2(u, v);
+        }
         switch (method)
         {
             case SampleMethod::Repeat:
@@ -142,6 +314,48 @@ public:
         return get_rgb_float(x, y);
     }
 
+    /**
+     * Wrapped nearest lookup without any clamping, for power-of-two images: the wrap is a mask.
+     */
+    RGB<float> sample_rgb_repeat_pow2(float u, float v) const
+    {
+        int x = (int) floorf(u * w) & (w - 1), y = (int) floorf(v * h) & (h - 1);
+        return get_rgb_float_level(0, x, y);
+    }
+
+    bool is_pow2() const
+    {
+        return w > 0 && h > 0 && (w & (w - 1)) == 0 && (h & (h - 1)) == 0;
+    }
+
+    virtual RGB<float> sample_rgb_lod(float u, float v, float lod, SampleMethod method) const override
+    {
+        assert(initialized && "Image is not initialized");
+
+        int top = mips.size();
+        lod = std::min(std::max(lod, 0.0f), (float) top);
+        int level = (int) lod;
+        float t = lod - level;
+        RGB<float> a = sample_level_bilinear(level, u, v, method);
+        if (t <= 0.0f || level >= top)
+        {
+            return a;
+        }
+        RGB<float> b = sample_level_bilinear(level + 1, u, v, method);
+        return RGB<float>(a.r + (b.r - a.r) * t, a.g + (b.g - a.g) * t, a.b + (b.b - a.b) * t);
+    }
+
+    /**
+     * Build the mip pyramid (down to 1x1) using stb_image_resize. Levels are not kept up to date
+     * by set_rgb or resize; call this again afterwards.
+     */
+    bool generate_mipmaps();
+
+    int num_levels() const
+    {
+        return 1 + mips.size();
+    }
+
     bool save(const std::string &dest) const;
     bool save_compressed(const std::string &dest, int quality) const;
 
@@ -160,13 +374,27 @@ public:
      *
      * @param other The other image, to be copied from.
      */
-    Image(const Image& other)
+    Image(const Image& other) : id_(BaseImage::image_id_counter++)
     {
         w = other.w;
         h = other.h;
         ch = other.ch;
+        layout = other.layout;
+        tiles_x = other.tiles_x;
+        srgb = other.srgb;
         initialized = other.initialized;
-        std::memcpy(image.get(), other.image.get(), sizeof(T) * w * h * ch);
+        size_t size = storage_size(w, h, layout);
+        image.reset(new T[size]);
+        std::memcpy(image.get(), other.image.get(), sizeof(T) * size);
+        mips.resize(other.mips.size());
+        for (int i = 0; i < mips.size(); i++)
+        {
+            const MipLevel &m = other.mips[i];
+            size_t level_size = storage_size(m.w, m.h, layout);
+            mips[i] = MipLevel{ m.w, m.h, m.tiles_x, std::unique_ptr<T[]>(new T[level_size]) };
+            std::memcpy(mips[i].data.get(), m.data.get(), sizeof(T) * level_size);
+        }
+        reset_dirty(w, h);
     }
 
     virtual int unit_size() const override
@@ -174,6 +402,11 @@ public:
         return sizeof(T);
     }
 
+    virtual int channels() const override
+    {
+        return ch;
+    }
+
     virtual int id() const override
     {
         return id_;
@@ -203,7 +436,112 @@ protected:
     int id_;
 
 private:
+    struct MipLevel
+    {
+        int w, h, tiles_x;
+        std::unique_ptr<T[]> data;
+    };
+
+    /**
+     * Texel fetch without clamping; (x, y) has to be in range for the level.
+     */
+    RGB<float> get_rgb_float_level(int level, int x, int y) const
+    {
+        if (level == 0)
+        {
+            return texel_rgb(&image[texel_index(x, y, w, tiles_x, layout) * ch]);
+        }
+        const MipLevel &m = mips[level - 1];
+        return texel_rgb(&m.data[texel_index(x, y, m.w, m.tiles_x, layout) * ch]);
+    }
+
+    /**
+     * Color of the texel starting at texel; gray images are replicated to all three channels.
+     */
+    RGB<float> texel_rgb(const T *texel) const
+    {
+        if (ch < 3)
+        {
+            float gray = to_float(texel[0]);
+            return RGB<float>(gray, gray, gray);
+        }
+        return RGB<float>(to_float(texel[0]), to_float(texel[1]), to_float(texel[2]));
+    }
+
+    float to_float(T value) const;
+
+    /**
+     * Number of Ts a w x h level takes up. Tiled storage is padded to whole tiles.
+     */
+    size_t storage_size(int lw, int lh, ImageLayout in_layout) const
+    {
+        if (in_layout == ImageLayout::Tiled)
+        {
+            size_t tx = (lw + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT, ty = (lh + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT;
+            return tx * ty * IMAGE_TILE_SIZE * IMAGE_TILE_SIZE * ch;
+        }
+        return (size_t) lw * lh * ch;
+    }
+
+    /**
+     * Copy of a w x h level in another layout.
+     */
+    std::unique_ptr<T[]> relayout(const T *src, int lw, int lh, ImageLayout from, ImageLayout to) const
+    {
+        int level_tiles_x = (lw + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT;
+        std::unique_ptr<T[]> dst(new T[storage_size(lw, lh, to)]());
+        for (int y = 0; y < lh; y++)
+        {
+            for (int x = 0; x < lw; x++)
+            {
+                std::memcpy(&dst[texel_index(x, y, lw, level_tiles_x, to) * ch], &src[texel_index(x, y, lw, level_tiles_x, from) * ch], sizeof(T) * ch);
+            }
+        }
+        return dst;
+    }
+
+    RGB<float> sample_level_bilinear(int level, float u, float v, SampleMethod method) const
+    {
+        int lw = level == 0 ? w : mips[level - 1].w;
+        int lh = level == 0 ? h : mips[level - 1].h;
+        float fx = u * lw - 0.5f, fy = v * lh - 0.5f;
+        int x0 = (int) floorf(fx), y0 = (int) floorf(fy);
+        float tx = fx - x0, ty = fy - y0;
+        int xs[2] = { x0, x0 + 1 }, ys[2] = { y0, y0 + 1 };
+        bool pow2 = (lw & (lw - 1)) == 0 && (lh & (lh - 1)) == 0;
+        for (int i = 0; i < 2; i++)
+        {
+            if (method == SampleMethod::Repeat && pow2)
+            {
+                xs[i] &= lw - 1;
+                ys[i] &= lh - 1;
+            }
+            else if (method == SampleMethod::Repeat)
+            {
+                xs[i] = ((xs[i] % lw) + lw) % lw;
+                ys[i] = ((ys[i] % lh) + lh) % lh;
+            }
+            else
+            {
+                xs[i] = std::min(std::max(xs[i], 0), lw - 1);
+                ys[i] = std::min(std::max(ys[i], 0), lh - 1);
+            }
+        }
+        RGB<float> c00 = get_rgb_float_level(level, xs[0], ys[0]), c10 = get_rgb_float_level(level, xs[1], ys[0]);
+        RGB<float> c01 = get_rgb_float_level(level, xs[0], ys[1]), c11 = get_rgb_float_level(level, xs[1], ys[1]);
+        float w00 = (1.0f - tx) * (1.0f - ty), w10 = tx * (1.0f - ty), w01 = (1.0f - tx) * ty, w11 = tx * ty;
+        return RGB<float>(
+            c00.r * w00 + c10.r * w10 + c01.r * w01 + c11.r * w11,
+            c00.g * w00 + c10.g * w10 + c01.g * w01 + c11.g * w11,
+            c00.b * w00 + c10.b * w10 + c01.b * w01 + c11.b * w11
+        );
+    }
+
     std::unique_ptr<T[]> image;
+    std::vector<MipLevel> mips; // Level 1 and up; level 0 is image
+    ImageLayout layout;
+    int tiles_x; // Tiles per row of level 0 (when tiled)
+    bool srgb;
     bool initialized;
 };
 
@@ -212,6 +550,25 @@ using FloatImage = Image<float>;
 
 unsigned char float_to_u8(float t);
 
+/**
+ * 8-bit to float conversion tables, so that fetches do not divide (or evaluate the sRGB curve.)
+ * u8_linear_lut[c] is exactly c / 255.0f; u8_srgb_lut[c] is c decoded from sRGB to linear.
+ */
+extern const std::array<float, 256> u8_linear_lut;
+extern const std::array<float, 256> u8_srgb_lut;
+
+template<>
+inline float Image<unsigned char>::to_float(unsigned char value) const
+{
+    return srgb ? u8_srgb_lut[value] : u8_linear_lut[value];
+}
+
+template<>
+inline float Image<float>::to_float(float value) const
+{
+    return value;
+}
+
 /**
  * Generates a test gradient image.
  */
@@ -7,6 +7,7 @@
 
 #include <glad/glad.h>
 #include <memory>
+#include <vector>
 #include "image.h"
 
 /**
@@ -22,6 +23,11 @@ public:
 
     ImageGL(std::shared_ptr<BaseImage> image);
 
+    /**
+     * Sync the texture with image. Re-importing the same image (as the viewer does every frame) only
+     * uploads the blocks written since the last import (see BaseImage::take_dirty), through a pixel
+     * buffer object so that the copy to the GPU does not stall the caller.
+     */
     bool import_from_image(std::shared_ptr<BaseImage> image);
 
     const std::shared_ptr<BaseImage> get_base_image() const;
@@ -38,9 +44,18 @@ public:
     ~ImageGL();
 
 private:
+    void upload_all();
+    void upload_dirty(const std::vector<ImageRect> &rects);
+
     bool initialized;
     GLuint texture;
     std::shared_ptr<BaseImage> image;
+
+    // What the texture was allocated for
+    int tex_w, tex_h, tex_ch, tex_unit;
+    GLuint pbos[2]; // Alternated, so that filling one does not wait on the transfer from the other
+    int next_pbo;
+    std::vector<ImageRect> dirty;
 };
 
 #endif // IMAGEGL_H
@@ -7,29 +7,176 @@
 
 #include <string>
 #include <iostream>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <mutex>
+
+class AccumBuffer;
+class TileCosts;
+template<typename T>
+class Image;
+using FloatImage = Image<float>;
+
+extern "C"
+{
+    /**
+     * The order batches queue their jobs in. Along a space-filling curve, jobs running at the same
+     * time shade pixels close to each other, whose rays mostly hit the same geometry and textures.
+     */
+    typedef enum
+    {
+        PIXEL_ORDER_SCANLINE, PIXEL_ORDER_MORTON, PIXEL_ORDER_HILBERT
+    } PixelOrder;
+}
 
 enum class JobType
 {
     Nothing, Suicide, RunScript, Execute, ExecuteParallel, Reset
 };
 
+/**
+ * What a parallel job shades. Per-pixel jobs shade pixel (x, y) of a w x h image and have a 1 x 1 tile.
+ * Tile jobs (see BatchParams) shade the tile_w x tile_h pixels starting at (x, y), taking samples samples
+ * per pixel; pass counts the passes over the image so far.
+ * Coarse jobs (see App::queue_coarse_to_fine_job) shade pixel (x, y) as well, after which the worker
+ * copies it over the block_w x block_h pixels starting there in target (block x block, unless the block
+ * sticks out of the batch's area.)
+ * Pixel tiles bundle the per-pixel jobs of a tile: the worker runs the script once for each of its
+ * pixels, which see 1 x 1 tiles of their own. It goes through them in order (along the curve through
+ * order_tile x order_tile tiles), as set when the batch was queued.
+ * If costs is set, the worker records how long the job took there.
+ */
 struct ParallelParams
 {
-    ParallelParams() : u(0.0f), v(0.0f), x(0), y(0), w(0), h(0), src("")
+    ParallelParams() : u(0.0f), v(0.0f), x(0), y(0), w(0), h(0), tile_w(1), tile_h(1), samples(0), pass(0), block(1), block_w(1), block_h(1), target(nullptr), pixel_tile(false), order(PIXEL_ORDER_HILBERT), order_tile(16), costs(nullptr), src("")
     {
 
     }
 
-    ParallelParams(float u, float v, int x, int y, int w, int h, const std::string &src) : u(u), v(v), x(x), y(y), w(w), h(h), src(src)
+    ParallelParams(float u, float v, int x, int y, int w, int h, const std::string &src) : u(u), v(v), x(x), y(y), w(w), h(h), tile_w(1), tile_h(1), samples(0), pass(0), block(1), block_w(1), block_h(1), target(nullptr), pixel_tile(false), order(PIXEL_ORDER_HILBERT), order_tile(16), costs(nullptr), src(src)
     {
 
     }
 
     float u, v;
     int x, y, w, h;
+    int tile_w, tile_h;
+    int samples, pass;
+    int block, block_w, block_h;
+    FloatImage *target;
+    bool pixel_tile;
+    PixelOrder order;
+    int order_tile;
+    TileCosts *costs;
     std::string src;
 };
 
+extern "C"
+{
+    /**
+     * Adaptive batches. The image is split into tiles; a first pass takes base_samples per pixel
+     * everywhere, and later passes only revisit the tiles whose estimated error (see
+     * AccumBuffer::estimate_error) is still above error_threshold, pass_samples at a time.
+     * Scripts accumulate their samples into accum. The batch ends when every tile converged, reached
+     * max_samples per pixel, or when the time limit (in seconds) or the sample budget (in samples per
+     * pixel, over the batch's area) is used up, or after max_passes passes. Limits of 0 are ignored.
+     *
+     * The batch's area is the region selected in the image viewer if that image has the batch's size,
+     * and the whole image otherwise. Only the tiles touching it are shaded, and nothing outside of it
+     * is cleared, written to or resolved. Set clear_accum to start over inside the area.
+     *
+     * If preview is set, the accumulated mean is resolved into it after every pass, so the viewer
+     * shows the render getting better; the Stop button ends the batch early and keeps what is there.
+     * Progressive rendering is the special case of an error_threshold of 0.
+     */
+    typedef struct
+    {
+        int tile_size;
+        int base_samples, pass_samples, max_samples;
+        float error_threshold;
+        float time_limit;
+        float sample_budget;
+        int max_passes;
+        bool clear_accum;
+        AccumBuffer *accum;
+        FloatImage *preview;
+    } BatchParams;
+
+    typedef struct
+    {
+        int passes, tiles_shaded;
+        float samples_per_pixel; // Mean over the batch's area, of the passes that finished
+        float seconds;
+        bool stopped; // By the user, through Stop or Abort
+    } BatchResult;
+}
+
+/**
+ * Position of (x, y) along the curve through an n x n grid (n a power of two.) Scanline is y * n + x.
+ */
+uint64_t curve_index(int x, int y, int n, PixelOrder order);
+
+/**
+ * The pixels of [x0, x1) x [y0, y1) in order: the tile_size x tile_size tiles are visited along the
+ * curve, and so are the pixels inside every tile.
+ */
+void order_pixels(int x0, int y0, int x1, int y1, PixelOrder order, int tile_size, std::vector<std::pair<int, int>> &out);
+
+/**
+ * How long the tiles of a frame took to shade, so that the next batch (or pass) over the same frame can
+ * start with the expensive tiles and cut them into smaller jobs. Costs are kept per tile x tile cell;
+ * jobs smaller than a cell add up.
+ */
+class TileCosts
+{
+public:
+    TileCosts();
+
+    TileCosts(const TileCosts &other) = delete;
+
+    /**
+     * Start recording a batch. What the previous batch recorded becomes the history if the frame size,
+     * the cell size and the script are the same as back then; otherwise the history is forgotten.
+     */
+    void begin(int w, int h, int tile, const std::string &src);
+
+    /**
+     * Thread-safe. (x, y) is any pixel of the job.
+     */
+    void record(int x, int y, float seconds);
+
+    /**
+     * Seconds cell (cx, cy) took last time, or a negative number if it is not known.
+     */
+    float cost(int cx, int cy) const;
+
+    /**
+     * The median over the cells with known costs, 0 if there are none. Costs are heavy-tailed (a light
+     * or glass tile can take 50 times as long as the sky), so the mean would mostly follow the outliers.
+     */
+    float typical_cost() const;
+
+    /**
+     * How many times smaller (per side) a job over a cell should be cut, judging by its cost:
+     * 1, 2 or 4.
+     */
+    int split_factor(int cx, int cy) const;
+
+    /**
+     * Move the cells that cost more than the typical cell to the front, most expensive first. The others keep
+     * their order (e.g. along a curve.)
+     */
+    void prioritize(std::vector<std::pair<int, int>> &cells) const;
+
+private:
+    int w, h, tile, cells_x, cells_y;
+    size_t src_hash;
+    float typical;
+    std::vector<float> last, current; // Per cell; negative if unknown or not run
+    std::mutex mu;
+};
+
 /**
  * Job description of what to execute.
  */
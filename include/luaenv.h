@@ -51,7 +51,7 @@ public:
 
     int execute(const std::string &buffer);
     int execute_file(const std::string &file);
-    void call_shade(const std::string &src, float u, float v, int x, int y, int w, int h);
+    void call_shade(const ParallelParams &pparams);
 
     static Lua *get_self(lua_State *l);
     static int whatever(lua_State *l);
@@ -63,6 +63,16 @@ private:
     std::uniform_real_distribution<float> distrib;
 };
 
+/**
+ * While a worker shades a tile, the calling thread's set_pixel calls for pixels inside it (on the first
+ * image written to) are kept in a buffer of its own, and end_tile_output writes them to the image a row
+ * at a time. Workers shading neighboring pixels would otherwise keep writing to the same cache lines.
+ * get_pixel sees the buffered pixels; every other call that reads or writes the image (rects, sampling,
+ * resolves, saving) writes them out first, so the order of writes within a tile is kept.
+ */
+void begin_tile_output(int x, int y, int w, int h);
+void end_tile_output();
+
 
 extern "C"
 {
@@ -74,27 +84,130 @@ extern "C"
     void free_image(FloatImage *img);
     Vec3C get_pixel(FloatImage *img, int x, int y);
     Vec3C sample_image(FloatImage *img, float u, float v);
+
+    /**
+     * set_pixel/get_pixel for a w x h block at (x, y) at once. rgb holds 3 floats per pixel, row after row.
+     * Pixels outside the image are skipped. image_accumulate_rect adds rgb to the pixels instead.
+     */
+    void image_write_rect(FloatImage *img, int x, int y, int w, int h, const float *rgb);
+    void image_read_rect(const FloatImage *img, int x, int y, int w, int h, float *rgb);
+    void image_accumulate_rect(FloatImage *img, int x, int y, int w, int h, const float *rgb);
+
+    /**
+     * Accumulation buffers (see accumbuffer.h.) Adds can come from any number of workers at once.
+     * accum_resolve writes the per-pixel means to an image of the same size.
+     */
+    AccumBuffer *make_accum_buffer(int width, int height, bool double_precision);
+    void accum_add(AccumBuffer *buf, int x, int y, float r, float g, float b);
+    void accum_add_rect(AccumBuffer *buf, int x, int y, int w, int h, const float *rgb);
+    int accum_count(const AccumBuffer *buf, int x, int y);
+    Vec3C accum_sum(const AccumBuffer *buf, int x, int y);
+    Vec3C accum_mean(const AccumBuffer *buf, int x, int y);
+    Vec3C accum_variance(const AccumBuffer *buf, int x, int y);
+    void accum_resolve(const AccumBuffer *buf, FloatImage *img);
+    void accum_clear(AccumBuffer *buf);
+    void free_accum_buffer(AccumBuffer *buf);
+
+    /**
+     * Splat buffers (see splatbuffer.h), for contributions to arbitrary pixels from any worker, as in
+     * light tracing. splat_resolve writes the sums times scale to an image of the same size, or adds them
+     * to it with accumulate.
+     */
+    SplatBuffer *make_splat_buffer(int width, int height);
+    void splat(SplatBuffer *buf, int x, int y, float r, float g, float b);
+    Vec3C splat_get(const SplatBuffer *buf, int x, int y);
+    void splat_resolve(const SplatBuffer *buf, FloatImage *img, float scale, bool accumulate);
+    void splat_clear(SplatBuffer *buf);
+    void free_splat_buffer(SplatBuffer *buf);
     void generate_demo_image(int w, int h, const char *path);
 
     // Models
     Model *make_model(const char *path, const char *mtl_base_path);
     int model_tri_count(const Model *model);
-    TriC *model_get_tri(const Model *model, int index);
+    // Triangles are reconstructed from the index buffer, and are therefore returned by value.
+    TriC model_get_tri(const Model *model, int index);
     void free_model(Model *model);
     HitInfo model_hit_info(Model *model, int material_id, Vec2C uv);
+    HitInfo model_hit_info_footprint(Model *model, int material_id, Vec2C uv, float footprint);
+
+    /**
+     * Only the HitInfoFields in mask are evaluated; the rest stay zero. The batched variant fills
+     * out[0...count-1]; footprints may be null, and negative material IDs get hit_info().
+     */
+    HitInfo model_hit_info_masked(const Model *model, int material_id, Vec2C uv, float footprint, unsigned int mask);
+    void model_hit_info_batch(const Model *model, const int *material_ids, const Vec2C *uvs, const float *footprints, int count, unsigned int mask, HitInfo *out);
+
+    /**
+     * The material parameters of a model as plain arrays (see MaterialTable), for reading constant
+     * parameters without a call per hit. Textured fields can be sampled with texture_sample.
+     */
+    const MaterialTable *model_material_table(const Model *model);
+    Vec3C texture_sample(const U8Image *tex, Vec2C uv, float footprint);
+
+    /**
+     * Binary mesh files (see meshfile.h) are memory-mapped by make_model and used without parsing.
+     * bvh may be null; if it is given, it is stored alongside the mesh and adopted by make_bvh later.
+     * convert_model loads an OBJ and writes it out as a binary mesh file (without a BVH.)
+     */
+    bool model_save_binary(Model *model, const BVH *bvh, const char *path);
+    bool convert_model(const char *path, const char *mtl_base_path, const char *out_path);
+
+    /**
+     * Whether the color textures (emission, ambient, diffuse, specular) of models loaded from now on
+     * are sRGB-encoded and should be decoded to linear. Off by default, i.e. texels are used as they are.
+     */
+    void set_texture_srgb(bool srgb);
+
+    /**
+     * Pick the order batches queue their pixels in, to compare them (see PixelOrder.)
+     * Curves go through tile_size x tile_size tiles, and through the pixels inside each.
+     */
+    void set_pixel_order(PixelOrder order, int tile_size);
 
     // BVHs
     BVH *make_bvh(Model *model);
-    TriC *bvh_get_tri(const BVH *bvh, int index);
+    TriC bvh_get_tri(const BVH *bvh, int index);
     int bvh_tri_count(const BVH *bvh);
-    TriC *bvh_get_emitter(const BVH *bvh, int index);
+    TriC bvh_get_emitter(const BVH *bvh, int index);
     int bvh_emitter_count(const BVH *bvh);
+
+    /**
+     * Light sampling. Emitters are picked proportional to their power, or by their estimated
+     * contribution to ref once the light tree is built. u0, u1 and u2 are uniform random numbers.
+     * The returned PDF (and that of bvh_emitter_pdf) is with respect to area.
+     */
+    EmitterSample bvh_sample_emitter(const BVH *bvh, const Vec3C &ref, float u0, float u1, float u2);
+    float bvh_emitter_pdf(const BVH *bvh, const Vec3C &ref, int emitter);
+    float bvh_emitter_power(const BVH *bvh, int emitter);
+    void bvh_build_light_tree(BVH *bvh);
     int bvh_push_node(BVH *bvh, const BBox &bbox, int start, int size, int l, int r);
     const Node bvh_get_node(BVH *bvh, int index);
     void bvh_node_set_children(BVH *bvh, int who, int l, int r);
     int bvh_node_count(const BVH *bvh);
+    // True if the BVH was loaded with the model and needs no construction.
+    bool bvh_prebuilt(const BVH *bvh);
     void free_bvh(BVH *bvh);
 
+    /**
+     * Compress a fully constructed BVH. Afterwards, nodes can no longer be accessed from Lua;
+     * use bvh_trace for traversal instead.
+     */
+    bool bvh_compress(BVH *bvh);
+    RayHit bvh_trace(const BVH *bvh, const Vec3C &ro, const Vec3C &rd, float tmin, float tmax);
+
+    /**
+     * Build the intersection-only triangle array once construction is done (bvh_compress does this as well.)
+     * Shading attributes of a hit are only fetched afterwards, through bvh_hit_surface.
+     */
+    void bvh_finalize(BVH *bvh);
+    VertexC bvh_hit_surface(const BVH *bvh, const RayHit &hit);
+
+    /**
+     * bvh_trace for camera rays: rd_dx and rd_dy are the directions through the next pixel over in x and y.
+     * Pass the resulting footprint to model_hit_info_footprint to sample textures at a matching mip level.
+     */
+    RayDiffHit bvh_trace_differential(const BVH *bvh, const Vec3C &ro, const Vec3C &rd, const Vec3C &rd_dx, const Vec3C &rd_dy, float tmin, float tmax);
+
     /**
      * Returns an array of booleans. This will be used to partition the array.
      * The partitioning array __will be freed__ upon calling `partition`.
@@ -102,6 +215,26 @@ extern "C"
     bool *make_partitioning_table(BVH *bvh);
     int partition(BVH *bvh, bool *table, int begin, int end);
 
+    /**
+     * Out-of-core meshes. build_streamed_mesh splits a model into clusters of at most cluster_size
+     * triangles on disk; load_streamed_mesh only reads the cluster table, and clusters are paged in
+     * by streamed_trace within budget_bytes (0 picks a default of 256 MB.)
+     * Triangle indices in the returned RayHits only mean something to the same mesh.
+     */
+    bool build_streamed_mesh(const Model *model, const char *path, int cluster_size);
+    StreamedMesh *load_streamed_mesh(const char *path, uint64_t budget_bytes);
+    void streamed_set_budget(StreamedMesh *mesh, uint64_t budget_bytes);
+    RayHit streamed_trace(const StreamedMesh *mesh, const Vec3C &ro, const Vec3C &rd, float tmin, float tmax);
+    VertexC streamed_hit_surface(const StreamedMesh *mesh, const RayHit &hit);
+    HitInfo streamed_hit_info(const StreamedMesh *mesh, int material_id, Vec2C uv);
+    HitInfo streamed_hit_info_masked(const StreamedMesh *mesh, int material_id, Vec2C uv, float footprint, unsigned int mask);
+    void streamed_hit_info_batch(const StreamedMesh *mesh, const int *material_ids, const Vec2C *uvs, const float *footprints, int count, unsigned int mask, HitInfo *out);
+    const MaterialTable *streamed_material_table(const StreamedMesh *mesh);
+    int streamed_tri_count(const StreamedMesh *mesh);
+    StreamStats streamed_stats(const StreamedMesh *mesh);
+    void streamed_reset_stats(StreamedMesh *mesh);
+    void free_streamed_mesh(StreamedMesh *mesh);
+
     // Inventory
     void inventory_add(const char *k, void *v);
     void *inventory_get(const char *k);
@@ -120,6 +253,30 @@ extern "C"
      */
     void shade(int width, int height, const char *path);
 
+    /**
+     * shade, but only the pixels of the rw x rh rectangle at (rx, ry) are queued. Their coordinates
+     * (and u, v) are still those of the full width x height frame.
+     * shade, shade_coarse_to_fine and shade_adaptive also crop, to the region selected in the image
+     * viewer, if that is the same size.
+     */
+    void shade_region(int width, int height, const char *path, int rx, int ry, int rw, int rh);
+
+    /**
+     * Like shade, but for a quick first look: the first batch only shades every coarsest-th pixel in
+     * both directions, and each of them is copied over the coarsest x coarsest block it starts, in target
+     * (which the script has to write to with set_pixel.) Every following batch halves the block size and
+     * skips the pixels that are already done, until the last one fills in single pixels.
+     * All in all, every pixel is shaded exactly once. Blocks start at the corner of the viewer's region, if
+     * there is one (see shade_region), and nothing outside of it is touched.
+     */
+    void shade_coarse_to_fine(int width, int height, const char *path, FloatImage *target, int coarsest);
+
+    /**
+     * Shade in tiles, spending samples where the image is still noisy (see BatchParams.)
+     * The script gets its tile and sample count through pparams, and has to add its samples to params->accum.
+     */
+    BatchResult shade_adaptive(int width, int height, const char *path, const BatchParams *params);
+
     /**
      * TODO: Add one single extra job (to be traced.)
      * This can be used in, for example, Russian-Roulette situations.
@@ -70,6 +70,39 @@ extern "C"
     } Node;
     BBox bbox();
     void enclose(BBox &bbox, const Vec3C &p);
+
+    /**
+     * Result of a native BVH traversal.
+     * uvt follows the convention of intersect() in Lua: (u, v) are the barycentric weights of b and c,
+     * and t is the distance along the ray.
+     */
+    typedef struct
+    {
+        int tri; // Triangle index in BVH order, -1 if nothing is hit
+        Vec3C uvt;
+    } RayHit;
+
+    /**
+     * A RayHit plus ray differentials: how far the texture coordinates move when the ray is
+     * replaced by the ones through the neighbouring pixels. footprint is the larger of the two.
+     */
+    typedef struct
+    {
+        RayHit hit;
+        Vec2C duvdx, duvdy;
+        float footprint;
+    } RayDiffHit;
+
+    /**
+     * A point sampled on an emitter. The PDF is with respect to surface area.
+     */
+    typedef struct
+    {
+        Vec3C position;
+        Vec3C normal;
+        int emitter; // Emitter index, -1 if there are no emitters
+        float pdf;
+    } EmitterSample;
 }
 
 #endif // LUAMATH_H
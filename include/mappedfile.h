@@ -0,0 +1,38 @@
+// Read-only memory-mapped files.
+// SPDX-FileCopyrightText: 2023 42yeah <email>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <memory>
+#include <cstddef>
+
+/**
+ * A read-only view of a whole file. The file is memory-mapped where possible,
+ * and read into memory otherwise.
+ */
+class MappedFile
+{
+public:
+    MappedFile();
+
+    MappedFile(const MappedFile &other) = delete;
+
+    ~MappedFile();
+
+    bool open(const std::string &path);
+    void close();
+
+    const char *data() const;
+    size_t size() const;
+
+private:
+    const char *ptr;
+    size_t len;
+    bool mapped;
+    std::unique_ptr<char[]> fallback;
+};
+
+#endif // MAPPEDFILE_H
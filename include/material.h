@@ -6,6 +6,7 @@
 #define MATERIAL_H
 
 #include <memory>
+#include <vector>
 #include <glm/glm.hpp>
 #include <tiny_obj_loader.h>
 #include "image.h"
@@ -30,8 +31,68 @@ extern "C"
     };
 
     HitInfo hit_info();
+
+    /**
+     * Fields of a HitInfo, for evaluating only some of them (shadow rays and emission checks
+     * rarely need all six textures.) Fields outside the mask are left zero.
+     */
+    enum HitInfoField
+    {
+        HIT_INFO_METALLIC = 1 << 0,
+        HIT_INFO_IOR = 1 << 1,
+        HIT_INFO_EMISSION = 1 << 2,
+        HIT_INFO_AMBIENT = 1 << 3,
+        HIT_INFO_DIFFUSE = 1 << 4,
+        HIT_INFO_NORMAL_BUMP = 1 << 5,
+        HIT_INFO_SPECULAR = 1 << 6,
+        HIT_INFO_ALL = (1 << 7) - 1
+    };
+
+    /**
+     * Triangles without a material are lights of this (grey) emission. Light sampling weighs them
+     * by it as well, so it has to match what trace() shades them with.
+     */
+    enum
+    {
+        MISSING_MATERIAL_EMISSION = 10
+    };
+
+    /**
+     * The constant parameters of all materials of a mesh, one array per field (indexed by material ID.)
+     * textured[i] has the HitInfoFields of material i that come from a texture; those have to be
+     * sampled (through the *_tex handles, or a hit info call). Everything else is the constant here.
+     * The table is read-only and lives as long as the mesh.
+     */
+    typedef struct
+    {
+        int count;
+        const unsigned int *textured;
+        const float *metallic;
+        const float *ior;
+        const Vec3C *emission;
+        const Vec3C *ambient;
+        const Vec3C *diffuse;
+        const Vec3C *normal_bump;
+        const Vec3C *specular;
+        const U8Image *const *metallic_tex; // Null where there is no texture
+        const U8Image *const *emissive_tex;
+        const U8Image *const *ambient_tex;
+        const U8Image *const *diffuse_tex;
+        const U8Image *const *normal_tex;
+        const U8Image *const *specular_tex;
+    } MaterialTable;
 }
 
+/**
+ * A texture a material refers to. Color textures can be sRGB-encoded (see Resources::srgb_textures);
+ * data textures (metallic, normals) never are.
+ */
+struct TextureRef
+{
+    std::string path;
+    bool srgb;
+};
+
 /**
  * Material describes what the "material" is. It encloses textures and other things as well.
  * Material is heavy and therefore must be specified by a flyweight by the others.
@@ -45,10 +106,15 @@ public:
     Material();
 
     /**
-     * Support for direct importation from tinyobj
+     * Support for direct importation from tinyobj. Textures come from the shared texture cache.
      */
     Material(const tinyobj::material_t &mat, std::string mtl_base_dir);
 
+    /**
+     * Every texture the material would load, so they can be decoded up front.
+     */
+    static std::vector<TextureRef> textures(const tinyobj::material_t &mat, std::string mtl_base_dir);
+
     /**
      * Copy constructor
      */
@@ -60,19 +126,35 @@ public:
     ~Material();
 
     const std::string &get_name() const;
-    float get_metallic(const glm::vec2 &uv) const;
+    float get_metallic(const glm::vec2 &uv, float footprint = 0.0f) const;
     float get_ior() const;
-    RGB<float> get_emission(const glm::vec2 &uv) const;
-    RGB<float> get_ambient(const glm::vec2 &uv) const;
-    RGB<float> get_diffuse(const glm::vec2 &uv) const;
-    RGB<float> get_normal_bump(const glm::vec2 &uv) const;
-    RGB<float> get_specular(const glm::vec2 &uv) const;
+    RGB<float> get_emission(const glm::vec2 &uv, float footprint = 0.0f) const;
+    RGB<float> get_ambient(const glm::vec2 &uv, float footprint = 0.0f) const;
+    RGB<float> get_diffuse(const glm::vec2 &uv, float footprint = 0.0f) const;
+    RGB<float> get_normal_bump(const glm::vec2 &uv, float footprint = 0.0f) const;
+    RGB<float> get_specular(const glm::vec2 &uv, float footprint = 0.0f) const;
 
-    HitInfo get_hit_info(const glm::vec2 &uv) const;
+    /**
+     * Emission averaged over the whole surface (i.e. over the emissive texture, if there is one.)
+     */
+    RGB<float> get_average_emission() const;
+
+    /**
+     * footprint is the width of the shaded pixel in texture space (see BaseImage::sample_rgb_footprint);
+     * 0 point samples the full-resolution textures. mask is a set of HitInfoFields.
+     */
+    HitInfo get_hit_info(const glm::vec2 &uv, float footprint = 0.0f, unsigned int mask = HIT_INFO_ALL) const;
 
     int id() const;
 
+    /**
+     * The HitInfoFields that are sampled from textures.
+     */
+    unsigned int textured_fields() const;
+
 private:
+    friend class MaterialTableData;
+
     std::string material_name;
 
     float metallic;
@@ -92,5 +174,36 @@ private:
     int id_;
 };
 
+/**
+ * Owns the arrays of a MaterialTable.
+ */
+class MaterialTableData
+{
+public:
+    MaterialTableData();
+    MaterialTableData(const MaterialTableData &other) = delete;
+
+    void build(const std::vector<Material> &mat);
+    const MaterialTable *get() const;
+
+private:
+    std::vector<unsigned int> textured;
+    std::vector<float> metallic, ior;
+    std::vector<Vec3C> emission, ambient, diffuse, normal_bump, specular;
+    std::vector<const U8Image *> metallic_tex, emissive_tex, ambient_tex, diffuse_tex, normal_tex, specular_tex;
+    MaterialTable table;
+};
+
+/**
+ * How materials sample their textures: with a footprint, from the matching mip level;
+ * without (footprint 0), point sampled at full resolution.
+ */
+RGB<float> sample_texture(const U8Image &tex, const glm::vec2 &uv, float footprint);
+
+/**
+ * get_hit_info for count hits at once: out[i] is the info of mat[material_ids[i]] at uvs[i].
+ * footprints may be null (point sampling.) Hits with a negative material ID get hit_info().
+ */
+void get_hit_info_batch(const std::vector<Material> &mat, const int *material_ids, const glm::vec2 *uvs, const float *footprints, int count, unsigned int mask, HitInfo *out);
 
 #endif // MATERIAL_H
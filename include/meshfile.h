@@ -0,0 +1,82 @@
+// Binary mesh files: a native layout that can be memory-mapped and used as-is.
+// SPDX-FileCopyrightText: 2023 42yeah <email>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef MESHFILE_H
+#define MESHFILE_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <tiny_obj_loader.h>
+#include "luamath.h"
+#include "mappedfile.h"
+
+#define MESH_FILE_MAGIC "LUAPTMSH"
+#define MESH_FILE_VERSION 1
+#define MESH_FILE_BYTE_ORDER 0x01020304
+#define MESH_FILE_ALIGNMENT 64
+
+class Model;
+class BVH;
+
+/**
+ * The file starts with this header. Every section starts at a MESH_FILE_ALIGNMENT-aligned offset
+ * and is stored exactly as it is laid out in memory, so a mapping of the file can be used directly.
+ * Only the material table is serialized (it is tiny and needs to be turned into Materials anyway.)
+ */
+struct MeshFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // MESH_FILE_BYTE_ORDER as written by the host; files from other byte orders are rejected
+    uint32_t num_verts, num_tris;
+    uint32_t num_materials, num_nodes; // num_nodes is 0 if there is no prebuilt BVH
+    uint64_t positions, normals, tex_coords; // vec3, vec3 and vec2, num_verts each
+    uint64_t indices, material_ids; // Three per triangle, one per triangle
+    uint64_t nodes, order; // num_nodes Nodes, num_tris triangle indices in BVH order
+    uint64_t materials, materials_size;
+};
+
+/**
+ * Pointers into a mapped mesh file, plus the deserialized material table.
+ */
+struct MeshFileView
+{
+    const MeshFileHeader *header;
+    const glm::vec3 *positions;
+    const glm::vec3 *normals;
+    const glm::vec2 *tex_coords;
+    const uint32_t *indices;
+    const int *material_ids;
+    const Node *nodes;
+    const int *order;
+    std::string mtl_base_dir;
+    std::vector<tinyobj::material_t> materials;
+};
+
+/**
+ * The material table (and the directory its textures are relative to) as stored in mesh files.
+ * Only the fields Material actually reads are kept.
+ */
+std::string serialize_materials(const std::string &mtl_base_dir, const std::vector<tinyobj::material_t> &materials);
+bool deserialize_materials(const char *ptr, const char *end, int num_materials, std::string &mtl_base_dir, std::vector<tinyobj::material_t> &materials);
+
+/**
+ * Cheap check for whether path is a binary mesh file (only the magic is read.)
+ */
+bool is_mesh_file(const std::string &path);
+
+/**
+ * Validate the header, section bounds and contents of a mapped mesh file and fill in the view.
+ */
+bool read_mesh_file(const MappedFile &file, MeshFileView &view, std::string &errors);
+
+/**
+ * Write model (and, if not null, the node list and triangle order of bvh) to path.
+ * The BVH has to be fully constructed and not compressed.
+ */
+bool write_mesh_file(const std::string &path, const Model &model, const BVH *bvh, std::string &errors);
+
+#endif // MESHFILE_H
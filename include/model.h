@@ -7,8 +7,35 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <memory>
 #include <glm/glm.hpp>
 #include "material.h"
+#include "objloader.h"
+#include "mappedfile.h"
+
+/**
+ * A read-only view of a contiguous array owned by someone else (a vector or a mapped file.)
+ */
+template<typename T>
+class ArrayView
+{
+public:
+    ArrayView() : ptr(nullptr), count(0) {}
+    ArrayView(const T *ptr, size_t count) : ptr(ptr), count(count) {}
+    ArrayView(const std::vector<T> &v) : ptr(v.data()), count(v.size()) {}
+
+    const T &operator[](size_t index) const { return ptr[index]; }
+    const T *data() const { return ptr; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T *begin() const { return ptr; }
+    const T *end() const { return ptr + count; }
+
+private:
+    const T *ptr;
+    size_t count;
+};
 
 struct Vertex {
     glm::vec3 position;
@@ -21,8 +48,14 @@ struct Triangle {
     Vertex a, b, c;
 };
 
+class BVH;
+
 /**
  * The scene representation (for now.)
+ * Geometry is indexed: deduplicated vertex streams, three indices and one material ID per triangle.
+ * Triangles are reconstructed on demand.
+ * The streams are views: into the model's own storage for OBJs, or straight into the mapping
+ * for binary mesh files, which are used without parsing or copying.
  */
 class Model
 {
@@ -33,7 +66,7 @@ public:
     Model();
 
     /**
-     * Model can be constructed from an array of triangles.
+     * Model can be constructed from an array of triangles. Vertices are not deduplicated.
      */
     Model(const std::vector<Triangle> &tri);
 
@@ -50,26 +83,67 @@ public:
     int id() const;
 
     /**
-     * Load a model from path, using tinyobjloader.
+     * Load a model from path. Binary mesh files (see meshfile.h) are memory-mapped;
+     * everything else is parsed as OBJ.
      * @param path the path to load the model.
+     * @param mtl_base_dir where materials and textures are; binary mesh files remember their own if this is empty.
      */
     bool load(const std::string &path, const std::string &mtl_base_dir = "");
 
+    /**
+     * Write the model (and optionally a constructed BVH over it) as a binary mesh file.
+     */
+    bool save_binary(const std::string &path, const BVH *bvh = nullptr);
+
+    /**
+     * Number of unique vertices; triangles share vertices through the index buffer.
+     */
     int get_num_verts() const;
     int get_num_tris() const;
     std::string get_load_warnings() const;
     std::string get_load_errors() const;
 
-    const Triangle &get_triangle(int index) const;
-    const std::vector<Triangle> &get_all_triangles() const;
+    Triangle get_triangle(int index) const;
 
-    HitInfo get_hit_info(int material_id, const glm::vec2 &uv) const;
+    ArrayView<glm::vec3> get_positions() const;
+    ArrayView<glm::vec3> get_normals() const;
+    ArrayView<glm::vec2> get_tex_coords() const;
+    ArrayView<uint32_t> get_indices() const;
+    ArrayView<int> get_material_ids() const;
+    const std::vector<tinyobj::material_t> &get_material_descs() const;
+    const std::string &get_mtl_base_dir() const;
+
+    /**
+     * BVH stored alongside the mesh in a binary mesh file. Both are empty if there is none.
+     */
+    ArrayView<Node> get_prebuilt_nodes() const;
+    ArrayView<int> get_prebuilt_order() const;
+
+    HitInfo get_hit_info(int material_id, const glm::vec2 &uv, float footprint = 0.0f, unsigned int mask = HIT_INFO_ALL) const;
+    const MaterialTable *get_material_table() const;
+    void get_hit_info_batch(const int *material_ids, const glm::vec2 *uvs, const float *footprints, int count, unsigned int mask, HitInfo *out) const;
+    RGB<float> get_average_emission(int material_id) const;
+    int get_num_materials() const;
 
 private:
+    bool load_binary(const std::string &path, const std::string &mtl_base_dir);
+    void make_materials();
+    void bind_storage();
+
     int id_;
     bool initialized;
-    std::vector<Triangle> tri;
+    ArrayView<glm::vec3> positions;
+    ArrayView<glm::vec3> normals;
+    ArrayView<glm::vec2> tex_coords;
+    ArrayView<uint32_t> indices; // Three per triangle
+    ArrayView<int> material_ids; // One per triangle
+    ArrayView<Node> prebuilt_nodes;
+    ArrayView<int> prebuilt_order;
+    ObjMesh storage; // Owned geometry; only the material descriptions are used for mapped models
+    std::unique_ptr<MappedFile> mapping;
+    std::string mtl_base_dir;
     std::vector<Material> mat;
+    MaterialTableData material_table;
     std::string load_warnings, load_errors;
 };
 
@@ -37,8 +37,8 @@ public:
 
 private:
     bool initialized;
-    GLuint vao, vbo;
-    int num_verts;
+    GLuint vao, vbo, ebo;
+    int num_indices;
     std::shared_ptr<Model> model;
 };
 
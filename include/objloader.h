@@ -0,0 +1,35 @@
+// Parallel OBJ loader.
+// SPDX-FileCopyrightText: 2023 42yeah <email>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef OBJLOADER_H
+#define OBJLOADER_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <tiny_obj_loader.h>
+
+/**
+ * Mesh data as it comes out of an OBJ file: indexed, with vertices deduplicated by their
+ * (position, texcoord, normal) index triple. Polygons are triangulated as fans.
+ */
+struct ObjMesh
+{
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> tex_coords;
+    std::vector<uint32_t> indices; // Three per triangle
+    std::vector<int> material_ids; // One per triangle, -1 if there is no material
+    std::vector<tinyobj::material_t> materials;
+};
+
+/**
+ * Load an OBJ file. The file is memory-mapped, split into line-aligned chunks, and the chunks
+ * are parsed in parallel. MTL files are still read by tinyobjloader.
+ * Returns false (and fills in errors) upon failure.
+ */
+bool load_obj(const std::string &path, const std::string &mtl_base_dir, ObjMesh &mesh, std::string &warnings, std::string &errors);
+
+#endif // OBJLOADER_H
@@ -0,0 +1,24 @@
+// Minimal data-parallel helpers for loading assets.
+// SPDX-FileCopyrightText: 2023 42yeah <email>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <functional>
+
+/**
+ * Number of threads parallel_for uses at most.
+ */
+int parallel_concurrency();
+
+/**
+ * Call fn(i) for every i in [0, count), spread over a handful of short-lived threads.
+ * Returns once all calls are done.
+ *
+ * The App's workers can't be used for this: loading happens inside a job running on one of them,
+ * and the rest may be busy with jobs of their own.
+ */
+void parallel_for(int count, const std::function<void(int)> &fn);
+
+#endif // PARALLEL_H
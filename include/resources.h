@@ -9,9 +9,14 @@
 #include <memory>
 #include <functional>
 #include <mutex>
+#include <atomic>
 #include "image.h"
 #include "model.h"
 #include "bbox.h"
+#include "streamedmesh.h"
+#include "accumbuffer.h"
+#include "splatbuffer.h"
+#include "job.h"
 #define MAX_ERR_LOG_SIZE 128
 
 
@@ -30,13 +35,19 @@ public:
     Resources() = default;
     ~Resources() = default;
 
-    std::vector<std::shared_ptr<BaseImage> > images;
     std::vector<std::shared_ptr<Model> > models;
     std::vector<std::shared_ptr<BVH> > bvhs;
+    std::vector<std::shared_ptr<StreamedMesh> > streamed_meshes;
+    std::vector<std::shared_ptr<AccumBuffer> > accum_buffers;
+    std::vector<std::shared_ptr<SplatBuffer> > splat_buffers;
 
     // We will try to call this when we need to aunch w*h number of threads.
     // Parameters: w, h, and script path
-    std::function<void(int, int, std::string)> parallel_launcher;
+    std::function<void(int, int, std::string, const ImageRect *)> parallel_launcher;
+    // Same, for adaptive batches of tiles (see BatchParams.)
+    std::function<BatchResult(int, int, std::string, const BatchParams &)> adaptive_launcher;
+    // And for coarse to fine previews.
+    std::function<void(int, int, std::string, FloatImage *, int)> coarse_to_fine_launcher;
     void report_error(const std::string &msg);
     void clear_error();
 
@@ -63,6 +74,35 @@ public:
     const SharedInfo *shared_get(const std::string &key) const;
     void shared_clear();
 
+    /**
+     * Images are added from Lua jobs and texture loads on any thread, and listed by the UI thread,
+     * so the list is only reachable through these. get_images returns a snapshot.
+     */
+    void add_image(std::shared_ptr<BaseImage> image);
+    bool remove_image(const BaseImage *image);
+    std::vector<std::shared_ptr<BaseImage> > get_images();
+
+    /**
+     * Textures are shared: every path (after canonicalization) is decoded once, and later
+     * requests get the same image for as long as someone still holds on to it.
+     * Images that failed to load are returned (empty) as well, like before.
+     * srgb textures are cached separately from linear ones (see U8Image::set_srgb.)
+     */
+    std::shared_ptr<U8Image> load_texture(const std::string &path, bool srgb = false);
+
+    /**
+     * Decode the distinct textures in parallel, so that the load_texture calls afterwards all hit the cache.
+     */
+    void load_textures(const std::vector<TextureRef> &refs);
+
+    // Whether color textures of materials loaded from now on are sRGB-encoded. Off by default.
+    bool srgb_textures = false;
+
+    // The order batches queue their pixels in (see order_pixels), and the tiles the curves go through.
+    // Set from the UI and from Lua at any time; batches read them once, when they are queued.
+    std::atomic<PixelOrder> pixel_order{ PIXEL_ORDER_HILBERT };
+    std::atomic<int> pixel_order_tile{ 16 };
+
 private:
     std::vector<std::string> err_log;
     std::map<std::string, void *> inventory;
@@ -70,6 +110,13 @@ private:
     // Shared, serialized tables (or what not) using LuaJIT stringbuffer library.
     std::map<std::string, SharedInfo> shared;
 
+    // Texture cache, keyed by canonical path (and whether it is sRGB.)
+    std::map<std::string, std::weak_ptr<U8Image> > textures;
+    std::mutex texture_mu;
+
+    std::vector<std::shared_ptr<BaseImage> > images;
+    std::mutex images_mu;
+
     std::mutex mu;
 };
 
@@ -0,0 +1,111 @@
+// Splat buffers: per-pixel sums that any worker can add to, for light tracing.
+// SPDX-FileCopyrightText: 2023 42yeah <email>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SPLATBUFFER_H
+#define SPLATBUFFER_H
+
+#include <memory>
+#include <atomic>
+#include <cassert>
+#include <algorithm>
+#include "image.h"
+
+/**
+ * Light paths land on arbitrary pixels, so unlike set_pixel, adds to a splat buffer can come from any
+ * number of workers at once, for the same pixel even. Every channel is an atomic float added to with
+ * compare-and-swap; splats from different paths rarely hit the same pixel at the same time, so the
+ * loop almost never goes around twice.
+ */
+class SplatBuffer
+{
+public:
+    SplatBuffer(int w, int h) : w(w), h(h), sums(new std::atomic<float>[(size_t) w * h * 3])
+    {
+        assert(w >= 0 && h >= 0 && "Invalid splat buffer size");
+        clear();
+    }
+
+    SplatBuffer(const SplatBuffer &other) = delete;
+
+    /**
+     * Add rgb to pixel (x, y). Splats outside the buffer are dropped.
+     */
+    void splat(int x, int y, const RGB<float> &rgb)
+    {
+        if (x < 0 || y < 0 || x >= w || y >= h)
+        {
+            return;
+        }
+        std::atomic<float> *p = &sums[((size_t) y * w + x) * 3];
+        add(p[0], rgb.r);
+        add(p[1], rgb.g);
+        add(p[2], rgb.b);
+    }
+
+    RGB<float> get(int x, int y) const
+    {
+        x = std::min(std::max(x, 0), w - 1);
+        y = std::min(std::max(y, 0), h - 1);
+        const std::atomic<float> *p = &sums[((size_t) y * w + x) * 3];
+        return RGB<float>(p[0].load(std::memory_order_relaxed), p[1].load(std::memory_order_relaxed), p[2].load(std::memory_order_relaxed));
+    }
+
+    /**
+     * Write the sums times scale (usually one over the number of light paths) to dst, which has to be the
+     * same size. With accumulate, they are added to what dst holds already, e.g. the camera paths' image.
+     */
+    void resolve(FloatImage &dst, float scale, bool accumulate) const
+    {
+        assert(dst.w == w && dst.h == h && "Resolve target has the wrong size");
+        std::unique_ptr<float[]> row(new float[(size_t) w * 3]);
+        for (int y = 0; y < h; y++)
+        {
+            for (int i = 0; i < w * 3; i++)
+            {
+                row[i] = sums[(size_t) y * w * 3 + i].load(std::memory_order_relaxed) * scale;
+            }
+            if (accumulate)
+            {
+                dst.accumulate_rect(0, y, w, 1, row.get());
+            }
+            else
+            {
+                dst.write_rect(0, y, w, 1, row.get());
+            }
+        }
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < (size_t) w * h * 3; i++)
+        {
+            sums[i].store(0.0f, std::memory_order_relaxed);
+        }
+    }
+
+    int width() const
+    {
+        return w;
+    }
+
+    int height() const
+    {
+        return h;
+    }
+
+private:
+    static void add(std::atomic<float> &sum, float value)
+    {
+        float old = sum.load(std::memory_order_relaxed);
+        while (!sum.compare_exchange_weak(old, old + value, std::memory_order_relaxed))
+        {
+            // old now holds the current value
+        }
+    }
+
+    int w, h;
+    std::unique_ptr<std::atomic<float>[]> sums; // 3 per pixel
+};
+
+#endif // SPLATBUFFER_H
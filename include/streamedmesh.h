@@ -0,0 +1,157 @@
+// Out-of-core meshes: spatial clusters on disk, paged in on demand.
+// SPDX-FileCopyrightText: 2023 42yeah <email>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef STREAMEDMESH_H
+#define STREAMEDMESH_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+#ifdef _WIN32
+#include <fstream>
+#endif
+#include <glm/glm.hpp>
+#include "luamath.h"
+#include "material.h"
+#include "bbox.h"
+
+#define STREAMED_FILE_MAGIC "LUAPTSTR"
+#define STREAMED_FILE_VERSION 1
+#define STREAMED_DEFAULT_BUDGET (256ull << 20)
+
+extern "C"
+{
+    /**
+     * Cache statistics of a streamed mesh. Counters accumulate until streamed_reset_stats.
+     */
+    typedef struct
+    {
+        uint64_t hits, misses, evictions;
+        uint64_t bytes_read;
+        uint64_t resident_bytes, budget_bytes;
+        int resident_clusters, num_clusters;
+    } StreamStats;
+}
+
+struct StreamedFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // MESH_FILE_BYTE_ORDER
+    uint32_t num_tris, num_clusters;
+    uint32_t num_top_nodes, num_materials;
+    uint64_t top_nodes, clusters; // Node[num_top_nodes], ClusterInfo[num_clusters]
+    uint64_t materials, materials_size; // Serialized like in mesh files
+};
+
+/**
+ * Where a cluster is on disk. Its triangles are numbered first_tri...first_tri + num_tris - 1 globally.
+ */
+struct ClusterInfo
+{
+    BBox bbox;
+    uint32_t first_tri, num_tris, num_nodes;
+    uint32_t reserved;
+    uint64_t offset, size; // The blob is Node[num_nodes], TriHot[num_tris], ClusterShading[num_tris]
+};
+
+struct ClusterShading
+{
+    glm::vec3 normal[3];
+    glm::vec2 tex_coord[3];
+    int material_id;
+};
+
+/**
+ * A resident cluster: its own sub-BVH over its triangles.
+ */
+struct Cluster
+{
+    std::vector<Node> nodes;
+    std::vector<TriHot> hot;
+    std::vector<ClusterShading> shading;
+};
+
+/**
+ * A mesh too large to keep in memory. Geometry is split into spatial clusters, each stored on disk
+ * together with its own sub-BVH. Only the top-level BVH over the clusters and the materials stay
+ * resident; clusters are read in when traversal reaches them and kept in an LRU cache whose size is
+ * bounded by a memory budget. Triangle indices in RayHits are global (see ClusterInfo.)
+ */
+class StreamedMesh
+{
+public:
+    StreamedMesh();
+
+    StreamedMesh(const StreamedMesh &other) = delete;
+
+    ~StreamedMesh();
+
+    /**
+     * Partition model into clusters of at most cluster_size triangles and write them to path.
+     * Works on memory-mapped models, so the source does not need to fit in memory either.
+     */
+    static bool build(const Model &model, const std::string &path, int cluster_size, std::string &errors);
+
+    bool open(const std::string &path, uint64_t budget_bytes, std::string &errors);
+    void close();
+
+    /**
+     * Clusters beyond the budget are evicted, least recently used first. Clusters still in use
+     * by a traversal stay alive until it is done with them.
+     */
+    void set_budget(uint64_t budget_bytes);
+
+    RayHit intersect(const glm::vec3 &ro, const glm::vec3 &rd, float tmin, float tmax) const;
+    VertexC get_hit_surface(const RayHit &hit) const;
+    HitInfo get_hit_info(int material_id, const glm::vec2 &uv, float footprint = 0.0f, unsigned int mask = HIT_INFO_ALL) const;
+    void get_hit_info_batch(const int *material_ids, const glm::vec2 *uvs, const float *footprints, int count, unsigned int mask, HitInfo *out) const;
+    const MaterialTable *get_material_table() const;
+
+    int get_num_triangles() const;
+    int get_num_clusters() const;
+    StreamStats get_stats() const;
+    void reset_stats();
+
+private:
+    std::shared_ptr<const Cluster> acquire(int cluster) const;
+    bool read_cluster(int cluster, Cluster &out) const;
+    bool read_at(uint64_t offset, void *dst, uint64_t size) const;
+    void evict(uint64_t budget) const;
+    void intersect_cluster(const Cluster &cluster, uint32_t first_tri, const glm::vec3 &ro, const glm::vec3 &rd, float tmin, RayHit &hit) const;
+
+    std::vector<Node> top_nodes; // Leaves have start = cluster index, size = 1
+    std::vector<ClusterInfo> clusters;
+    std::vector<uint32_t> cluster_first; // first_tri of every cluster, for lookups by triangle
+    std::vector<Material> mat;
+    MaterialTableData material_table;
+    uint32_t num_tris;
+
+#ifndef _WIN32
+    int fd;
+#else
+    mutable std::ifstream reader;
+    mutable std::mutex read_mutex;
+#endif
+
+    struct CacheEntry
+    {
+        std::shared_ptr<const Cluster> cluster;
+        std::list<int>::iterator lru;
+    };
+    mutable std::mutex cache_mutex;
+    mutable std::unordered_map<int, CacheEntry> cache;
+    mutable std::list<int> lru; // Most recently used first
+    mutable std::vector<bool> failed; // Clusters that could not be read; reported once and skipped afterwards
+    mutable uint64_t resident_bytes;
+    uint64_t budget_bytes;
+    mutable std::atomic<uint64_t> hits, misses, evictions, bytes_read;
+};
+
+#endif // STREAMEDMESH_H
@@ -3,6 +3,8 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include "job.h"
+#include <algorithm>
+#include <functional>
 
 Job::Job(JobType type, const ParallelParams &pparams, const std::string &script_path, const std::string &code_injection, int target_worker) : type(type), script_path(script_path), code_injection(code_injection), pparams(pparams), target_worker(target_worker)
 {
@@ -34,3 +36,216 @@ int Job::get_target_worker() const
 {
     return target_worker;
 }
+
+uint64_t curve_index(int x, int y, int n, PixelOrder order)
+{
+    switch (order)
+    {
+        case PIXEL_ORDER_MORTON:
+        {
+            uint64_t index = 0;
+            for (int bit = 0; (1 << bit) < n; bit++)
+            {
+                index |= (uint64_t) ((x >> bit) & 1) << (2 * bit);
+                index |= (uint64_t) ((y >> bit) & 1) << (2 * bit + 1);
+            }
+            return index;
+        }
+
+        case PIXEL_ORDER_HILBERT:
+        {
+            // https://en.wikipedia.org/wiki/Hilbert_curve#Applications_and_mapping_algorithms
+            uint64_t index = 0;
+            for (int s = n / 2; s > 0; s /= 2)
+            {
+                int rx = (x & s) > 0, ry = (y & s) > 0;
+                index += (uint64_t) s * s * ((3 * rx) ^ ry);
+                if (ry == 0)
+                {
+                    if (rx == 1)
+                    {
+                        x = s - 1 - x;
+                        y = s - 1 - y;
+                    }
+                    std::swap(x, y);
+                }
+            }
+            return index;
+        }
+
+        default:
+            return (uint64_t) y * n + x;
+    }
+}
+
+/**
+ * Smallest power of two that is at least n.
+ */
+static int ceil_pow2(int n)
+{
+    int p = 1;
+    while (p < n)
+    {
+        p *= 2;
+    }
+    return p;
+}
+
+void order_pixels(int x0, int y0, int x1, int y1, PixelOrder order, int tile_size, std::vector<std::pair<int, int>> &out)
+{
+    if (x1 <= x0 || y1 <= y0)
+    {
+        return;
+    }
+    if (order == PIXEL_ORDER_SCANLINE)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                out.emplace_back(x, y);
+            }
+        }
+        return;
+    }
+
+    tile_size = ceil_pow2(std::max(tile_size, 1));
+    int tiles_x = (x1 - x0 + tile_size - 1) / tile_size, tiles_y = (y1 - y0 + tile_size - 1) / tile_size;
+    int grid = ceil_pow2(std::max(tiles_x, tiles_y));
+
+    std::vector<std::pair<uint64_t, int>> tiles; // Curve index, tile
+    tiles.reserve((size_t) tiles_x * tiles_y);
+    for (int ty = 0; ty < tiles_y; ty++)
+    {
+        for (int tx = 0; tx < tiles_x; tx++)
+        {
+            tiles.emplace_back(curve_index(tx, ty, grid, order), ty * tiles_x + tx);
+        }
+    }
+    std::sort(tiles.begin(), tiles.end());
+
+    // Every full tile visits its pixels in the same order
+    std::vector<std::pair<uint64_t, int>> inner;
+    inner.reserve((size_t) tile_size * tile_size);
+    for (int y = 0; y < tile_size; y++)
+    {
+        for (int x = 0; x < tile_size; x++)
+        {
+            inner.emplace_back(curve_index(x, y, tile_size, order), y * tile_size + x);
+        }
+    }
+    std::sort(inner.begin(), inner.end());
+
+    out.reserve(out.size() + (size_t) (x1 - x0) * (y1 - y0));
+    for (const auto &tile : tiles)
+    {
+        int tx = x0 + (tile.second % tiles_x) * tile_size, ty = y0 + (tile.second / tiles_x) * tile_size;
+        for (const auto &pixel : inner)
+        {
+            int x = tx + pixel.second % tile_size, y = ty + pixel.second / tile_size;
+            if (x < x1 && y < y1)
+            {
+                out.emplace_back(x, y);
+            }
+        }
+    }
+}
+
+TileCosts::TileCosts() : w(0), h(0), tile(0), cells_x(0), cells_y(0), src_hash(0), typical(0.0f)
+{
+
+}
+
+void TileCosts::begin(int w, int h, int tile, const std::string &src)
+{
+    std::lock_guard<std::mutex> lk(mu);
+    size_t hash = std::hash<std::string>()(src);
+    if (w != this->w || h != this->h || tile != this->tile || hash != src_hash)
+    {
+        this->w = w;
+        this->h = h;
+        this->tile = tile;
+        src_hash = hash;
+        cells_x = (w + tile - 1) / tile;
+        cells_y = (h + tile - 1) / tile;
+        last.assign((size_t) cells_x * cells_y, -1.0f);
+        current.assign(last.size(), -1.0f);
+    }
+
+    // Cells the previous batch did not get to (cropped, aborted) keep their older costs
+    std::vector<float> known;
+    for (size_t i = 0; i < last.size(); i++)
+    {
+        if (current[i] >= 0.0f)
+        {
+            last[i] = current[i];
+        }
+        current[i] = -1.0f;
+        if (last[i] >= 0.0f)
+        {
+            known.push_back(last[i]);
+        }
+    }
+    typical = 0.0f;
+    if (!known.empty())
+    {
+        std::nth_element(known.begin(), known.begin() + known.size() / 2, known.end());
+        typical = known[known.size() / 2];
+    }
+}
+
+void TileCosts::record(int x, int y, float seconds)
+{
+    std::lock_guard<std::mutex> lk(mu);
+    int cx = x / std::max(tile, 1), cy = y / std::max(tile, 1);
+    if (x < 0 || y < 0 || cx >= cells_x || cy >= cells_y)
+    {
+        return;
+    }
+    float &c = current[(size_t) cy * cells_x + cx];
+    c = std::max(c, 0.0f) + seconds;
+}
+
+float TileCosts::cost(int cx, int cy) const
+{
+    if (cx < 0 || cy < 0 || cx >= cells_x || cy >= cells_y)
+    {
+        return -1.0f;
+    }
+    return last[(size_t) cy * cells_x + cx];
+}
+
+float TileCosts::typical_cost() const
+{
+    return typical;
+}
+
+int TileCosts::split_factor(int cx, int cy) const
+{
+    float c = cost(cx, cy);
+    if (typical <= 0.0f || c < 0.0f)
+    {
+        return 1;
+    }
+    if (c > 16.0f * typical)
+    {
+        return 4;
+    }
+    return c > 4.0f * typical ? 2 : 1;
+}
+
+void TileCosts::prioritize(std::vector<std::pair<int, int>> &cells) const
+{
+    if (typical <= 0.0f)
+    {
+        return;
+    }
+    auto expensive_end = std::stable_partition(cells.begin(), cells.end(), [&](const std::pair<int, int> &c)
+    {
+        return cost(c.first, c.second) > typical;
+    });
+    std::stable_sort(cells.begin(), expensive_end, [&](const std::pair<int, int> &a, const std::pair<int, int> &b)
+    {
+        return cost(a.first, a.second) > cost(b.first, b.second);
+    });
+}
@@ -77,10 +77,11 @@ void generate_demo_image(int w, int h, const char *path)
 }
 
 
-void Lua::call_shade(const std::string &src, float u, float v, int x, int y, int w, int h)
+void Lua::call_shade(const ParallelParams &pparams)
 {
     assert(lua_ready && l && "Lua is not ready");
 
+    const std::string &src = pparams.src;
     int error = luaL_loadbuffer(l, src.c_str(), src.size(), "shade");
     if (error)
     {
@@ -89,26 +90,41 @@ void Lua::call_shade(const std::string &src, float u, float v, int x, int y, int
         res()->report_error(err.str());
     }
 
-    lua_createtable(l, 0, 6);
+    lua_createtable(l, 0, 11);
 
-    lua_pushnumber(l, u);
+    lua_pushnumber(l, pparams.u);
     lua_setfield(l, -2, "u");
 
-    lua_pushnumber(l, v);
+    lua_pushnumber(l, pparams.v);
     lua_setfield(l, -2, "v");
 
-    lua_pushnumber(l, x);
+    lua_pushnumber(l, pparams.x);
     lua_setfield(l, -2, "x");
 
-    lua_pushnumber(l, y);
+    lua_pushnumber(l, pparams.y);
     lua_setfield(l, -2, "y");
 
-    lua_pushnumber(l, w);
+    lua_pushnumber(l, pparams.w);
     lua_setfield(l, -2, "w");
 
-    lua_pushnumber(l, h);
+    lua_pushnumber(l, pparams.h);
     lua_setfield(l, -2, "h");
 
+    lua_pushnumber(l, pparams.tile_w);
+    lua_setfield(l, -2, "tile_w");
+
+    lua_pushnumber(l, pparams.tile_h);
+    lua_setfield(l, -2, "tile_h");
+
+    lua_pushnumber(l, pparams.samples);
+    lua_setfield(l, -2, "samples");
+
+    lua_pushnumber(l, pparams.pass);
+    lua_setfield(l, -2, "pass");
+
+    lua_pushnumber(l, pparams.block);
+    lua_setfield(l, -2, "block");
+
     lua_setglobal(l, "pparams");
 
     if (lua_pcall(l, 0, 0, 0))
@@ -141,7 +157,7 @@ FloatImage *make_image(int width, int height)
 {
     Resources *r = res();
     std::shared_ptr<FloatImage> img = std::make_shared<FloatImage>(width, height, 4);
-    r->images.push_back(img);
+    r->add_image(img);
     return img.get();
 }
 
@@ -156,33 +172,132 @@ FloatImage *load_image(const char *path)
         r->report_error(ss.str());
         return nullptr;
     }
-    r->images.push_back(img);
+    r->add_image(img);
     return img.get();
 }
 
+struct TileOutput
+{
+    bool active = false;
+    int x = 0, y = 0, w = 0, h = 0;
+    FloatImage *image = nullptr; // The first image written to
+    std::vector<float> rgb;
+    std::vector<char> written;
+    bool pending = false; // Something in written is set; spares flushes from scanning the tile
+
+    bool contains(FloatImage *img, int px, int py) const
+    {
+        return active && img == image && px >= x && py >= y && px < x + w && py < y + h;
+    }
+};
+
+static thread_local TileOutput tile_output;
+
+void begin_tile_output(int x, int y, int w, int h)
+{
+    TileOutput &t = tile_output;
+    t.active = true;
+    t.x = x;
+    t.y = y;
+    t.w = w;
+    t.h = h;
+    t.image = nullptr;
+    t.rgb.resize((size_t) w * h * 3);
+    t.written.assign((size_t) w * h, 0);
+    t.pending = false;
+}
+
+/**
+ * Write the buffered pixels of img (if it is the image the tile buffers) to it and forget them.
+ * Calls that read or write img directly come after this, so they see set_pixel's writes in order.
+ */
+static void flush_tile_output(const FloatImage *img)
+{
+    TileOutput &t = tile_output;
+    if (t.image == nullptr || t.image != img || !t.pending)
+    {
+        return;
+    }
+    for (int row = 0; row < t.h; row++)
+    {
+        // Runs of written pixels; the rest of the image is not touched
+        int start = 0;
+        while (start < t.w)
+        {
+            size_t i = (size_t) row * t.w + start;
+            if (!t.written[i])
+            {
+                start++;
+                continue;
+            }
+            int end = start;
+            while (end < t.w && t.written[(size_t) row * t.w + end])
+            {
+                end++;
+            }
+            t.image->write_rect(t.x + start, t.y + row, end - start, 1, &t.rgb[i * 3]);
+            start = end;
+        }
+    }
+    std::fill(t.written.begin(), t.written.end(), 0);
+    t.pending = false;
+}
+
+void end_tile_output()
+{
+    TileOutput &t = tile_output;
+    flush_tile_output(t.image);
+    t.active = false;
+    t.image = nullptr;
+}
+
 void set_pixel(FloatImage *img, int x, int y, float r, float g, float b)
 {
+    TileOutput &t = tile_output;
+    if (t.active && t.image == nullptr && img->get_layout() == ImageLayout::Linear)
+    {
+        t.image = img;
+    }
+    if (t.contains(img, x, y))
+    {
+        size_t i = (size_t) (y - t.y) * t.w + (x - t.x);
+        t.rgb[i * 3 + 0] = r;
+        t.rgb[i * 3 + 1] = g;
+        t.rgb[i * 3 + 2] = b;
+        t.written[i] = 1;
+        t.pending = true;
+        return;
+    }
     img->set_rgb(x, y, RGB<float>(r, g, b));
 }
 
 bool save_image(FloatImage *img, const char *path)
 {
+    flush_tile_output(img);
     return img->save(path);
 }
 
 void free_image(FloatImage *img)
 {
-    Resources *r = res();
-    auto it = std::find_if(r->images.begin(), r->images.end(), [&](const std::shared_ptr<BaseImage> im)
+    TileOutput &t = tile_output;
+    if (t.image == img)
     {
-        return im.get() == img;
-    });
-    assert(it != r->images.end() && "Non-existent image");
-    r->images.erase(it, it + 1); // WARNING: img now becomes a dangling pointer
+        t.image = nullptr; // Nothing left to write the buffered pixels to
+        std::fill(t.written.begin(), t.written.end(), 0);
+        t.pending = false;
+    }
+    bool removed = res()->remove_image(img);
+    assert(removed && "Non-existent image"); // WARNING: img now becomes a dangling pointer
 }
 
 Vec3C get_pixel(FloatImage *img, int x, int y)
 {
+    const TileOutput &t = tile_output;
+    if (t.contains(img, x, y) && t.written[(size_t) (y - t.y) * t.w + (x - t.x)])
+    {
+        size_t i = (size_t) (y - t.y) * t.w + (x - t.x);
+        return { t.rgb[i * 3 + 0], t.rgb[i * 3 + 1], t.rgb[i * 3 + 2] };
+    }
     RGB<float> rgb = img->get_rgb_float(x, y);
     return { rgb.r, rgb.g, rgb.b };
 }
@@ -190,10 +305,139 @@ Vec3C get_pixel(FloatImage *img, int x, int y)
 Vec3C sample_image(FloatImage *img, float u, float v)
 {
     // One of these days...
+    flush_tile_output(img);
     RGB<float> rgb = img->sample_rgb(u, v, SampleMethod::Repeat);
     return { rgb.r, rgb.g, rgb.b };
 }
 
+void image_write_rect(FloatImage *img, int x, int y, int w, int h, const float *rgb)
+{
+    flush_tile_output(img);
+    img->write_rect(x, y, w, h, rgb);
+}
+
+void image_read_rect(const FloatImage *img, int x, int y, int w, int h, float *rgb)
+{
+    flush_tile_output(img);
+    img->read_rect(x, y, w, h, rgb);
+}
+
+void image_accumulate_rect(FloatImage *img, int x, int y, int w, int h, const float *rgb)
+{
+    flush_tile_output(img);
+    img->accumulate_rect(x, y, w, h, rgb);
+}
+
+AccumBuffer *make_accum_buffer(int width, int height, bool double_precision)
+{
+    std::shared_ptr<AccumBuffer> buf;
+    if (double_precision)
+    {
+        buf = std::make_shared<TypedAccumBuffer<double> >(width, height);
+    }
+    else
+    {
+        buf = std::make_shared<TypedAccumBuffer<float> >(width, height);
+    }
+    res()->accum_buffers.push_back(buf);
+    return buf.get();
+}
+
+void accum_add(AccumBuffer *buf, int x, int y, float r, float g, float b)
+{
+    buf->add(x, y, RGB<float>(r, g, b));
+}
+
+void accum_add_rect(AccumBuffer *buf, int x, int y, int w, int h, const float *rgb)
+{
+    buf->add_rect(x, y, w, h, rgb);
+}
+
+int accum_count(const AccumBuffer *buf, int x, int y)
+{
+    return buf->get_count(x, y);
+}
+
+Vec3C accum_sum(const AccumBuffer *buf, int x, int y)
+{
+    RGB<float> rgb = buf->get_sum(x, y);
+    return { rgb.r, rgb.g, rgb.b };
+}
+
+Vec3C accum_mean(const AccumBuffer *buf, int x, int y)
+{
+    RGB<float> rgb = buf->get_mean(x, y);
+    return { rgb.r, rgb.g, rgb.b };
+}
+
+Vec3C accum_variance(const AccumBuffer *buf, int x, int y)
+{
+    RGB<float> rgb = buf->get_variance(x, y);
+    return { rgb.r, rgb.g, rgb.b };
+}
+
+void accum_resolve(const AccumBuffer *buf, FloatImage *img)
+{
+    flush_tile_output(img);
+    buf->resolve(*img);
+}
+
+void accum_clear(AccumBuffer *buf)
+{
+    buf->clear();
+}
+
+void free_accum_buffer(AccumBuffer *buf)
+{
+    Resources *r = res();
+    auto it = std::find_if(r->accum_buffers.begin(), r->accum_buffers.end(), [&](const std::shared_ptr<AccumBuffer> b)
+    {
+        return b.get() == buf;
+    });
+    assert(it != r->accum_buffers.end() && "Non-existent accumulation buffer");
+    r->accum_buffers.erase(it, it + 1); // WARNING: buf now becomes a dangling pointer
+}
+
+SplatBuffer *make_splat_buffer(int width, int height)
+{
+    std::shared_ptr<SplatBuffer> buf = std::make_shared<SplatBuffer>(width, height);
+    res()->splat_buffers.push_back(buf);
+    return buf.get();
+}
+
+void splat(SplatBuffer *buf, int x, int y, float r, float g, float b)
+{
+    buf->splat(x, y, RGB<float>(r, g, b));
+}
+
+Vec3C splat_get(const SplatBuffer *buf, int x, int y)
+{
+    RGB<float> rgb = buf->get(x, y);
+    return { rgb.r, rgb.g, rgb.b };
+}
+
+void splat_resolve(const SplatBuffer *buf, FloatImage *img, float scale, bool accumulate)
+{
+    flush_tile_output(img);
+    buf->resolve(*img, scale, accumulate);
+}
+
+void splat_clear(SplatBuffer *buf)
+{
+    buf->clear();
+}
+
+void free_splat_buffer(SplatBuffer *buf)
+{
+    Resources *r = res();
+    auto it = std::find_if(r->splat_buffers.begin(), r->splat_buffers.end(), [&](const std::shared_ptr<SplatBuffer> b)
+    {
+        return b.get() == buf;
+    });
+    assert(it != r->splat_buffers.end() && "Non-existent splat buffer");
+    r->splat_buffers.erase(it, it + 1); // WARNING: buf now becomes a dangling pointer
+}
+
 
 // Models
 Model *make_model(const char *path, const char *mtl_base_path)
@@ -217,12 +461,13 @@ int model_tri_count(const Model *model)
     return model->get_num_tris();
 }
 
-TriC *model_get_tri(const Model *model, int index)
+TriC model_get_tri(const Model *model, int index)
 {
     assert(index >= 0 && index < model->get_num_tris() && "Model index out of bounds");
 
     // Don't worry honey, it's perfectly fine... maybe.
-    return (TriC *) &model->get_triangle(index);
+    Triangle t = model->get_triangle(index);
+    return *((TriC *) &t);
 }
 
 void free_model(Model *model)
@@ -236,6 +481,42 @@ void free_model(Model *model)
     r->models.erase(it, it + 1); // WARNING: img now becomes a dangling pointer
 }
 
+bool model_save_binary(Model *model, const BVH *bvh, const char *path)
+{
+    if (!model->save_binary(path, bvh))
+    {
+        std::stringstream ss;
+        ss << "Cannot save model to " << path << ": " << model->get_load_errors();
+        res()->report_error(ss.str());
+        return false;
+    }
+    return true;
+}
+
+bool convert_model(const char *path, const char *mtl_base_path, const char *out_path)
+{
+    Model model;
+    if (!model.load(path, mtl_base_path ? mtl_base_path : ""))
+    {
+        std::stringstream ss;
+        ss << "Cannot load model: " << path << ": " << model.get_load_errors();
+        res()->report_error(ss.str());
+        return false;
+    }
+    return model_save_binary(&model, nullptr, out_path);
+}
+
+void set_texture_srgb(bool srgb)
+{
+    res()->srgb_textures = srgb;
+}
+
+void set_pixel_order(PixelOrder order, int tile_size)
+{
+    res()->pixel_order = order;
+    res()->pixel_order_tile = std::max(tile_size, 1);
+}
+
 BVH *make_bvh(Model *model)
 {
     Resources *r = res();
@@ -252,10 +533,11 @@ BVH *make_bvh(Model *model)
     return bvh.get();
 }
 
-TriC *bvh_get_tri(const BVH *bvh, int index)
+TriC bvh_get_tri(const BVH *bvh, int index)
 {
     assert(index >= 0 && index < bvh->get_num_triangles() && "BVH triangle index out of bounds");
-    return (TriC *) &bvh->get_triangle(index);
+    Triangle t = bvh->get_triangle(index);
+    return *((TriC *) &t);
 }
 
 int bvh_tri_count(const BVH *bvh)
@@ -263,10 +545,11 @@ int bvh_tri_count(const BVH *bvh)
     return bvh->get_num_triangles();
 }
 
-TriC *bvh_get_emitter(const BVH *bvh, int index)
+TriC bvh_get_emitter(const BVH *bvh, int index)
 {
     assert(index >= 0 && index < bvh->get_num_emitters() && "BVH emitter index out of bounds");
-    return (TriC *) &bvh->get_emitter(index);
+    Triangle t = bvh->get_emitter(index);
+    return *((TriC *) &t);
 }
 
 int bvh_emitter_count(const BVH *bvh)
@@ -274,6 +557,28 @@ int bvh_emitter_count(const BVH *bvh)
     return bvh->get_num_emitters();
 }
 
+EmitterSample bvh_sample_emitter(const BVH *bvh, const Vec3C &ref, float u0, float u1, float u2)
+{
+    return bvh->sample_emitter(*((glm::vec3 *) &ref), u0, u1, u2);
+}
+
+float bvh_emitter_pdf(const BVH *bvh, const Vec3C &ref, int emitter)
+{
+    assert(emitter >= 0 && emitter < bvh->get_num_emitters() && "BVH emitter index out of bounds");
+    return bvh->emitter_pdf(*((glm::vec3 *) &ref), emitter);
+}
+
+float bvh_emitter_power(const BVH *bvh, int emitter)
+{
+    assert(emitter >= 0 && emitter < bvh->get_num_emitters() && "BVH emitter index out of bounds");
+    return bvh->get_emitter_power(emitter);
+}
+
+void bvh_build_light_tree(BVH *bvh)
+{
+    bvh->build_light_tree();
+}
+
 int bvh_push_node(BVH *bvh, const BBox &bbox, int start, int size, int l, int r)
 {
     return bvh->make_node(bbox, start, size, l, r);
@@ -284,8 +589,21 @@ int bvh_node_count(const BVH *bvh)
     return bvh->get_num_nodes();
 }
 
+bool bvh_prebuilt(const BVH *bvh)
+{
+    return bvh->is_prebuilt();
+}
+
 const Node bvh_get_node(BVH *bvh, int index)
 {
+    if (bvh->is_compressed())
+    {
+        // The node array is gone once compressed; hand back an empty box so callers see a miss.
+        std::stringstream ss;
+        ss << "bvh_get_node: BVH " << bvh->id() << " is compressed and has no node array; use bvh_trace";
+        res()->report_error(ss.str());
+        return Node{ bbox(), 0, 0, 0, 0 };
+    }
     assert(index >= 0 && index < bvh->get_num_nodes() && "BVH node index out of bounds");
     return bvh->get_node(index);
 }
@@ -295,6 +613,43 @@ void bvh_node_set_children(BVH *bvh, int who, int l, int r)
     bvh->set_children(who, l, r);
 }
 
+bool bvh_compress(BVH *bvh)
+{
+    return bvh->compress();
+}
+
+RayHit bvh_trace(const BVH *bvh, const Vec3C &ro, const Vec3C &rd, float tmin, float tmax)
+{
+    return bvh->intersect(*((glm::vec3 *) &ro), *((glm::vec3 *) &rd), tmin, tmax);
+}
+
+void bvh_finalize(BVH *bvh)
+{
+    bvh->finalize();
+}
+
+VertexC bvh_hit_surface(const BVH *bvh, const RayHit &hit)
+{
+    assert(hit.tri >= 0 && hit.tri < bvh->get_num_triangles() && "BVH triangle index out of bounds");
+    return bvh->get_hit_surface(hit);
+}
+
+RayDiffHit bvh_trace_differential(const BVH *bvh, const Vec3C &ro, const Vec3C &rd, const Vec3C &rd_dx, const Vec3C &rd_dy, float tmin, float tmax)
+{
+    const glm::vec3 &o = *((glm::vec3 *) &ro);
+    RayDiffHit ret{ bvh->intersect(o, *((glm::vec3 *) &rd), tmin, tmax), vec2(0.0f, 0.0f), vec2(0.0f, 0.0f), 0.0f };
+    if (ret.hit.tri < 0)
+    {
+        return ret;
+    }
+    glm::vec2 duvdx, duvdy;
+    bvh->get_uv_differentials(ret.hit, o, *((glm::vec3 *) &rd_dx), *((glm::vec3 *) &rd_dy), duvdx, duvdy);
+    ret.duvdx = vec2(duvdx.x, duvdx.y);
+    ret.duvdy = vec2(duvdy.x, duvdy.y);
+    ret.footprint = std::max(glm::length(duvdx), glm::length(duvdy));
+    return ret;
+}
+
 void free_bvh(BVH *bvh)
 {
     Resources *r = res();
@@ -318,9 +673,126 @@ int partition(BVH *bvh, bool *table, int begin, int end)
     return sep;
 }
 
+// Streamed meshes
+bool build_streamed_mesh(const Model *model, const char *path, int cluster_size)
+{
+    std::string errors;
+    if (!StreamedMesh::build(*model, path, cluster_size, errors))
+    {
+        std::stringstream ss;
+        ss << "Cannot build streamed mesh " << path << ": " << errors;
+        res()->report_error(ss.str());
+        return false;
+    }
+    return true;
+}
+
+StreamedMesh *load_streamed_mesh(const char *path, uint64_t budget_bytes)
+{
+    Resources *r = res();
+    std::shared_ptr<StreamedMesh> mesh = std::make_shared<StreamedMesh>();
+    std::string errors;
+    if (!mesh->open(path, budget_bytes > 0 ? budget_bytes : STREAMED_DEFAULT_BUDGET, errors))
+    {
+        std::stringstream ss;
+        ss << "Cannot load streamed mesh: " << path << ": " << errors << " (returning nil)";
+        r->report_error(ss.str());
+        return nullptr;
+    }
+    r->streamed_meshes.push_back(mesh);
+    return mesh.get();
+}
+
+void streamed_set_budget(StreamedMesh *mesh, uint64_t budget_bytes)
+{
+    mesh->set_budget(budget_bytes > 0 ? budget_bytes : STREAMED_DEFAULT_BUDGET);
+}
+
+RayHit streamed_trace(const StreamedMesh *mesh, const Vec3C &ro, const Vec3C &rd, float tmin, float tmax)
+{
+    return mesh->intersect(*((glm::vec3 *) &ro), *((glm::vec3 *) &rd), tmin, tmax);
+}
+
+VertexC streamed_hit_surface(const StreamedMesh *mesh, const RayHit &hit)
+{
+    return mesh->get_hit_surface(hit);
+}
+
+HitInfo streamed_hit_info(const StreamedMesh *mesh, int material_id, Vec2C uv)
+{
+    return mesh->get_hit_info(material_id, *((glm::vec2 *) &uv));
+}
+
+HitInfo streamed_hit_info_masked(const StreamedMesh *mesh, int material_id, Vec2C uv, float footprint, unsigned int mask)
+{
+    return mesh->get_hit_info(material_id, *((glm::vec2 *) &uv), footprint, mask);
+}
+
+void streamed_hit_info_batch(const StreamedMesh *mesh, const int *material_ids, const Vec2C *uvs, const float *footprints, int count, unsigned int mask, HitInfo *out)
+{
+    mesh->get_hit_info_batch(material_ids, (const glm::vec2 *) uvs, footprints, count, mask, out);
+}
+
+const MaterialTable *streamed_material_table(const StreamedMesh *mesh)
+{
+    return mesh->get_material_table();
+}
+
+int streamed_tri_count(const StreamedMesh *mesh)
+{
+    return mesh->get_num_triangles();
+}
+
+StreamStats streamed_stats(const StreamedMesh *mesh)
+{
+    return mesh->get_stats();
+}
+
+void streamed_reset_stats(StreamedMesh *mesh)
+{
+    mesh->reset_stats();
+}
+
+void free_streamed_mesh(StreamedMesh *mesh)
+{
+    Resources *r = res();
+    auto it = std::find_if(r->streamed_meshes.begin(), r->streamed_meshes.end(), [&](const std::shared_ptr<StreamedMesh> m)
+    {
+        return m.get() == mesh;
+    });
+    assert(it != r->streamed_meshes.end() && "Non-existent streamed mesh");
+    r->streamed_meshes.erase(it, it + 1); // WARNING: mesh now becomes a dangling pointer
+}
+
 void shade(int width, int height, const char *path)
 {
-    res()->parallel_launcher(width, height, path);
+    res()->parallel_launcher(width, height, path, nullptr);
+}
+
+void shade_region(int width, int height, const char *path, int rx, int ry, int rw, int rh)
+{
+    ImageRect crop = { rx, ry, rw, rh };
+    res()->parallel_launcher(width, height, path, &crop);
+}
+
+void shade_coarse_to_fine(int width, int height, const char *path, FloatImage *target, int coarsest)
+{
+    if (!res()->coarse_to_fine_launcher || target == nullptr || target->w != width || target->h != height)
+    {
+        res()->report_error("Coarse to fine batches need a target image of the batch's size and the UI's worker pool");
+        return;
+    }
+    res()->coarse_to_fine_launcher(width, height, path, target, coarsest);
+}
+
+BatchResult shade_adaptive(int width, int height, const char *path, const BatchParams *params)
+{
+    if (!res()->adaptive_launcher || params->accum == nullptr)
+    {
+        res()->report_error("Adaptive batches need an accumulation buffer and the UI's worker pool");
+        return BatchResult{ 0, 0, 0.0f, 0.0f, false };
+    }
+    return res()->adaptive_launcher(width, height, path, *params);
 }
 
 void inventory_add(const char *k, void *v)
@@ -366,3 +838,29 @@ HitInfo model_hit_info(Model *model, int material_id, Vec2C uv)
     return model->get_hit_info(material_id, *((glm::vec2 *) &uv));
 }
 
+HitInfo model_hit_info_footprint(Model *model, int material_id, Vec2C uv, float footprint)
+{
+    return model->get_hit_info(material_id, *((glm::vec2 *) &uv), footprint);
+}
+
+HitInfo model_hit_info_masked(const Model *model, int material_id, Vec2C uv, float footprint, unsigned int mask)
+{
+    return model->get_hit_info(material_id, *((glm::vec2 *) &uv), footprint, mask);
+}
+
+void model_hit_info_batch(const Model *model, const int *material_ids, const Vec2C *uvs, const float *footprints, int count, unsigned int mask, HitInfo *out)
+{
+    model->get_hit_info_batch(material_ids, (const glm::vec2 *) uvs, footprints, count, mask, out);
+}
+
+const MaterialTable *model_material_table(const Model *model)
+{
+    return model->get_material_table();
+}
+
+Vec3C texture_sample(const U8Image *tex, Vec2C uv, float footprint)
+{
+    RGB<float> rgb = sample_texture(*tex, *((glm::vec2 *) &uv), footprint);
+    return vec3(rgb.r, rgb.g, rgb.b);
+}
+
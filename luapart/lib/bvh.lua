@@ -110,6 +110,8 @@ function bvh_construct(bvh, node_idx, start, fin)
     bvh_construct(bvh, r, offset, fin)
 end
 
+-- Reference traversal in Lua over the node array; only works before bvh_compress.
+-- Rendering goes through bvh_trace (see trace below.)
 function bvh_hits(bvh, node_idx, ro, rd)
     local n = bvh_get_node(bvh, node_idx)
     if intersect_box(ro, rd, n.bbox) == nil then
@@ -149,30 +151,95 @@ function bvh_hits(bvh, node_idx, ro, rd)
     return closest_tri, closest_uvt
 end
 
-function trace(bvh, model, ro, rd)
-    local tri, uvt = bvh_hits(bvh, 0, ro, rd)
-    if uvt == nil then
+-- Same as bvh_hits, but traverses the BVH natively. Works on compressed BVHs as well.
+function bvh_hits_native(bvh, ro, rd)
+    local hit = bvh_trace(bvh, ro, rd, 1.0, 2000.0)
+    if hit.tri < 0 then
         return nil
     end
-    local w = 1 - uvt.x - uvt.y
-    local n_bary = add3(add3(scl3(tri.b.normal, uvt.x), scl3(tri.c.normal, uvt.y)), scl3(tri.a.normal, w))
-    local p = add3(add3(ro, scl3(rd, uvt.z)), scl3(n_bary, 0.01))
-    local uv_bary = add2(add2(scl2(tri.b.tex_coord, uvt.x), scl2(tri.c.tex_coord, uvt.y)), scl2(tri.a.tex_coord, w))
+    return bvh_get_tri(bvh, hit.tri), hit.uvt
+end
+
+-- Material tables of the models seen so far (see model_material_table.)
+local material_tables = setmetatable({}, { __mode = "k" })
+
+-- Like model_hit_info_masked, but materials with nothing textured in mask are read straight
+-- from the model's material table instead of calling into C.
+function material_info(model, material_id, uv, footprint, mask)
+    local mt = material_tables[model]
+    if mt == nil then
+        mt = model_material_table(model)
+        material_tables[model] = mt
+    end
+    if bit.band(mt.textured[material_id], mask) ~= 0 then
+        return model_hit_info_masked(model, material_id, uv, footprint, mask)
+    end
+
+    local info = ffi.new("HitInfo")
+    if bit.band(mask, HIT_INFO_METALLIC) ~= 0 then info.metallic = mt.metallic[material_id] end
+    if bit.band(mask, HIT_INFO_IOR) ~= 0 then info.ior = mt.ior[material_id] end
+    if bit.band(mask, HIT_INFO_EMISSION) ~= 0 then info.emission = mt.emission[material_id] end
+    if bit.band(mask, HIT_INFO_AMBIENT) ~= 0 then info.ambient = mt.ambient[material_id] end
+    if bit.band(mask, HIT_INFO_DIFFUSE) ~= 0 then info.diffuse = mt.diffuse[material_id] end
+    if bit.band(mask, HIT_INFO_NORMAL_BUMP) ~= 0 then info.normal_bump = mt.normal_bump[material_id] end
+    if bit.band(mask, HIT_INFO_SPECULAR) ~= 0 then info.specular = mt.specular[material_id] end
+    return info
+end
+
+-- mask (a sum of HIT_INFO_* fields, all of them by default) picks what info is evaluated.
+function trace(bvh, model, ro, rd, mask)
+    local hit = bvh_trace(bvh, ro, rd, 1.0, 2000.0)
+    if hit.tri < 0 then
+        return nil
+    end
+    local tri = bvh_get_tri(bvh, hit.tri)
+    local surface = bvh_hit_surface(bvh, hit)
+    local p = add3(surface.position, scl3(surface.normal, 0.01))
+
+    local info = nil
+    if tri.a.material_id >= 0 then
+        info = material_info(model, tri.a.material_id, vec2(0.0, 0.0), 0.0, mask or HIT_INFO_ALL)
+    else
+        info = hit_info()
+        info.emission = vec3(MISSING_MATERIAL_EMISSION, MISSING_MATERIAL_EMISSION, MISSING_MATERIAL_EMISSION)
+    end
+
+    return {
+        tri = tri,
+        uvt = hit.uvt,
+        position = p,
+        normal = surface.normal,
+        tex_coord = surface.tex_coord,
+        info = info
+    }
+end
+
+-- Like trace, but traverses natively and samples textures with the ray differentials of a camera ray.
+-- rd_dx and rd_dy are the directions of the rays through the next pixel over in x and y.
+function trace_differential(bvh, model, ro, rd, rd_dx, rd_dy, mask)
+    local dh = bvh_trace_differential(bvh, ro, rd, rd_dx, rd_dy, 1.0, 2000.0)
+    if dh.hit.tri < 0 then
+        return nil
+    end
+    local tri = bvh_get_tri(bvh, dh.hit.tri)
+    local surface = bvh_hit_surface(bvh, dh.hit)
+    local p = add3(surface.position, scl3(surface.normal, 0.01))
 
     local info = nil
     if tri.a.material_id >= 0 then
-        info = model_hit_info(model, tri.a.material_id, vec2(0.0, 0.0))
+        info = material_info(model, tri.a.material_id, surface.tex_coord, dh.footprint, mask or HIT_INFO_ALL)
     else
         info = hit_info()
-        info.emission = vec3(10.0, 10.0, 10.0)
+        info.emission = vec3(MISSING_MATERIAL_EMISSION, MISSING_MATERIAL_EMISSION, MISSING_MATERIAL_EMISSION)
     end
 
     return {
         tri = tri,
-        uvt = uvt,
+        uvt = dh.hit.uvt,
         position = p,
-        normal = n_bary,
-        tex_coord = uv_bary,
+        normal = surface.normal,
+        tex_coord = surface.tex_coord,
+        footprint = dh.footprint,
         info = info
     }
 end
@@ -8,6 +8,10 @@ ffi.cdef[[
     typedef struct Image Image;
     typedef struct Model Model;
     typedef struct BVH BVH;
+    typedef struct StreamedMesh StreamedMesh;
+    typedef struct Texture Texture;
+    typedef struct AccumBuffer AccumBuffer;
+    typedef struct SplatBuffer SplatBuffer;
 
     // Defined in material.h
     typedef struct
@@ -23,6 +27,51 @@ ffi.cdef[[
 
     HitInfo hit_info();
 
+    enum HitInfoField
+    {
+        HIT_INFO_METALLIC = 1 << 0,
+        HIT_INFO_IOR = 1 << 1,
+        HIT_INFO_EMISSION = 1 << 2,
+        HIT_INFO_AMBIENT = 1 << 3,
+        HIT_INFO_DIFFUSE = 1 << 4,
+        HIT_INFO_NORMAL_BUMP = 1 << 5,
+        HIT_INFO_SPECULAR = 1 << 6,
+        HIT_INFO_ALL = (1 << 7) - 1
+    };
+
+    enum
+    {
+        MISSING_MATERIAL_EMISSION = 10
+    };
+
+    typedef struct
+    {
+        int count;
+        const unsigned int *textured;
+        const float *metallic;
+        const float *ior;
+        const Vec3C *emission;
+        const Vec3C *ambient;
+        const Vec3C *diffuse;
+        const Vec3C *normal_bump;
+        const Vec3C *specular;
+        const Texture *const *metallic_tex;
+        const Texture *const *emissive_tex;
+        const Texture *const *ambient_tex;
+        const Texture *const *diffuse_tex;
+        const Texture *const *normal_tex;
+        const Texture *const *specular_tex;
+    } MaterialTable;
+
+    // Defined in streamedmesh.h
+    typedef struct
+    {
+        uint64_t hits, misses, evictions;
+        uint64_t bytes_read;
+        uint64_t resident_bytes, budget_bytes;
+        int resident_clusters, num_clusters;
+    } StreamStats;
+
     // Defined in luaenv.h
     // Images
     Image *make_image(int width, int height);
@@ -32,27 +81,100 @@ ffi.cdef[[
     void free_image(Image *img);
     Vec3C get_pixel(Image *img, int x, int y);
     Vec3C sample_image(Image *img, float u, float v);
+    void image_write_rect(Image *img, int x, int y, int w, int h, const float *rgb);
+    void image_read_rect(const Image *img, int x, int y, int w, int h, float *rgb);
+    void image_accumulate_rect(Image *img, int x, int y, int w, int h, const float *rgb);
+
+    // Accumulation buffers
+    AccumBuffer *make_accum_buffer(int width, int height, bool double_precision);
+    void accum_add(AccumBuffer *buf, int x, int y, float r, float g, float b);
+    void accum_add_rect(AccumBuffer *buf, int x, int y, int w, int h, const float *rgb);
+    int accum_count(const AccumBuffer *buf, int x, int y);
+    Vec3C accum_sum(const AccumBuffer *buf, int x, int y);
+    Vec3C accum_mean(const AccumBuffer *buf, int x, int y);
+    Vec3C accum_variance(const AccumBuffer *buf, int x, int y);
+    void accum_resolve(const AccumBuffer *buf, Image *img);
+    void accum_clear(AccumBuffer *buf);
+    void free_accum_buffer(AccumBuffer *buf);
+
+    SplatBuffer *make_splat_buffer(int width, int height);
+    void splat(SplatBuffer *buf, int x, int y, float r, float g, float b);
+    Vec3C splat_get(const SplatBuffer *buf, int x, int y);
+    void splat_resolve(const SplatBuffer *buf, Image *img, float scale, bool accumulate);
+    void splat_clear(SplatBuffer *buf);
+    void free_splat_buffer(SplatBuffer *buf);
     void generate_demo_image(int w, int h, const char *path);
 
     // Models
     Model *make_model(const char *path, const char *mtl_base_path);
     int model_tri_count(const Model *model);
-    TriC *model_get_tri(const Model *model, int index);
+    // Triangles are reconstructed from the index buffer, and are therefore returned by value.
+    TriC model_get_tri(const Model *model, int index);
     void free_model(Model *model);
     HitInfo model_hit_info(Model *model, int material_id, Vec2C uv);
+    HitInfo model_hit_info_footprint(Model *model, int material_id, Vec2C uv, float footprint);
+    HitInfo model_hit_info_masked(const Model *model, int material_id, Vec2C uv, float footprint, unsigned int mask);
+    void model_hit_info_batch(const Model *model, const int *material_ids, const Vec2C *uvs, const float *footprints, int count, unsigned int mask, HitInfo *out);
+    const MaterialTable *model_material_table(const Model *model);
+    Vec3C texture_sample(const Texture *tex, Vec2C uv, float footprint);
+    bool model_save_binary(Model *model, const BVH *bvh, const char *path);
+    bool convert_model(const char *path, const char *mtl_base_path, const char *out_path);
+    void set_texture_srgb(bool srgb);
+
+    // Defined in job.h
+    typedef enum
+    {
+        PIXEL_ORDER_SCANLINE, PIXEL_ORDER_MORTON, PIXEL_ORDER_HILBERT
+    } PixelOrder;
+
+    /**
+     * The order batches queue their pixels in; curves go through tile_size x tile_size tiles.
+     */
+    void set_pixel_order(PixelOrder order, int tile_size);
 
     // BVHs
     BVH *make_bvh(Model *model);
-    TriC *bvh_get_tri(const BVH *bvh, int index);
+    TriC bvh_get_tri(const BVH *bvh, int index);
     int bvh_tri_count(const BVH *bvh);
-    TriC *bvh_get_emitter(const BVH *bvh, int index);
+    TriC bvh_get_emitter(const BVH *bvh, int index);
     int bvh_emitter_count(const BVH *bvh);
+
+    /**
+     * Light sampling. Emitters are picked proportional to their power, or by their estimated
+     * contribution to ref once the light tree is built. u0, u1 and u2 are uniform random numbers.
+     * The returned PDF (and that of bvh_emitter_pdf) is with respect to area.
+     */
+    EmitterSample bvh_sample_emitter(const BVH *bvh, const Vec3C &ref, float u0, float u1, float u2);
+    float bvh_emitter_pdf(const BVH *bvh, const Vec3C &ref, int emitter);
+    float bvh_emitter_power(const BVH *bvh, int emitter);
+    void bvh_build_light_tree(BVH *bvh);
     int bvh_push_node(BVH *bvh, const BBox &bbox, int start, int size, int l, int r);
     const Node bvh_get_node(BVH *bvh, int index);
     void bvh_node_set_children(BVH *bvh, int who, int l, int r);
     int bvh_node_count(const BVH *bvh);
+    bool bvh_prebuilt(const BVH *bvh);
     void free_bvh(BVH *bvh);
 
+    /**
+     * Compress a fully constructed BVH. Afterwards, nodes can no longer be accessed from Lua;
+     * use bvh_trace for traversal instead.
+     */
+    bool bvh_compress(BVH *bvh);
+    RayHit bvh_trace(const BVH *bvh, const Vec3C &ro, const Vec3C &rd, float tmin, float tmax);
+
+    /**
+     * Build the intersection-only triangle array once construction is done (bvh_compress does this as well.)
+     * Shading attributes of a hit are only fetched afterwards, through bvh_hit_surface.
+     */
+    void bvh_finalize(BVH *bvh);
+    VertexC bvh_hit_surface(const BVH *bvh, const RayHit &hit);
+
+    /**
+     * bvh_trace for camera rays: rd_dx and rd_dy are the directions through the next pixel over in x and y.
+     * Pass the resulting footprint to model_hit_info_footprint to sample textures at a matching mip level.
+     */
+    RayDiffHit bvh_trace_differential(const BVH *bvh, const Vec3C &ro, const Vec3C &rd, const Vec3C &rd_dx, const Vec3C &rd_dy, float tmin, float tmax);
+
     /**
      * Returns an array of booleans. This will be used to partition the array.
      * The partitioning array __will be freed__ upon calling `partition`.
@@ -60,6 +182,26 @@ ffi.cdef[[
     bool *make_partitioning_table(BVH *bvh);
     int partition(BVH *bvh, bool *table, int begin, int end);
 
+    /**
+     * Out-of-core meshes. build_streamed_mesh splits a model into clusters of at most cluster_size
+     * triangles on disk; load_streamed_mesh only reads the cluster table, and clusters are paged in
+     * by streamed_trace within budget_bytes (0 picks a default of 256 MB.)
+     * Triangle indices in the returned RayHits only mean something to the same mesh.
+     */
+    bool build_streamed_mesh(const Model *model, const char *path, int cluster_size);
+    StreamedMesh *load_streamed_mesh(const char *path, uint64_t budget_bytes);
+    void streamed_set_budget(StreamedMesh *mesh, uint64_t budget_bytes);
+    RayHit streamed_trace(const StreamedMesh *mesh, const Vec3C &ro, const Vec3C &rd, float tmin, float tmax);
+    VertexC streamed_hit_surface(const StreamedMesh *mesh, const RayHit &hit);
+    HitInfo streamed_hit_info(const StreamedMesh *mesh, int material_id, Vec2C uv);
+    HitInfo streamed_hit_info_masked(const StreamedMesh *mesh, int material_id, Vec2C uv, float footprint, unsigned int mask);
+    void streamed_hit_info_batch(const StreamedMesh *mesh, const int *material_ids, const Vec2C *uvs, const float *footprints, int count, unsigned int mask, HitInfo *out);
+    const MaterialTable *streamed_material_table(const StreamedMesh *mesh);
+    int streamed_tri_count(const StreamedMesh *mesh);
+    StreamStats streamed_stats(const StreamedMesh *mesh);
+    void streamed_reset_stats(StreamedMesh *mesh);
+    void free_streamed_mesh(StreamedMesh *mesh);
+
     // Inventory
     void inventory_add(const char *k, void *v);
     void *inventory_get(const char *k);
@@ -84,6 +226,48 @@ ffi.cdef[[
      */
     void shade(int width, int height, const char *path);
 
+    /**
+     * shade, for the pixels in the rw x rh rectangle at (rx, ry) only.
+     * pparams still describes the full frame. shade, shade_coarse_to_fine and shade_adaptive
+     * are cropped to the region selected in the image viewer, if that image has the same size.
+     */
+    void shade_region(int width, int height, const char *path, int rx, int ry, int rw, int rh);
+
+    /**
+     * shade, for a quick look: every coarsest-th pixel first, each stretched over its block of target,
+     * then levels of halved blocks until every pixel is done (see luaenv.h.)
+     */
+    void shade_coarse_to_fine(int width, int height, const char *path, Image *target, int coarsest);
+
+    // Defined in job.h
+    typedef struct
+    {
+        int tile_size;
+        int base_samples, pass_samples, max_samples;
+        float error_threshold;
+        float time_limit;
+        float sample_budget;
+        int max_passes;
+        bool clear_accum;
+        AccumBuffer *accum;
+        Image *preview;
+    } BatchParams;
+
+    typedef struct
+    {
+        int passes, tiles_shaded;
+        float samples_per_pixel;
+        float seconds;
+        bool stopped;
+    } BatchResult;
+
+    /**
+     * Shade in tiles and keep revisiting the noisy ones (see job.h.)
+     * Scripts shade the pparams.tile_w x pparams.tile_h pixels at (pparams.x, pparams.y),
+     * adding pparams.samples samples per pixel to the accumulation buffer.
+     */
+    BatchResult shade_adaptive(int width, int height, const char *path, const BatchParams *params);
+
     /**
      * Trigger the debugger.
      * Insert your own breakpoint here!
@@ -92,6 +276,15 @@ ffi.cdef[[
 ]]
 
 hit_info = ffi.C.hit_info
+HIT_INFO_METALLIC = ffi.C.HIT_INFO_METALLIC
+HIT_INFO_IOR = ffi.C.HIT_INFO_IOR
+HIT_INFO_EMISSION = ffi.C.HIT_INFO_EMISSION
+HIT_INFO_AMBIENT = ffi.C.HIT_INFO_AMBIENT
+HIT_INFO_DIFFUSE = ffi.C.HIT_INFO_DIFFUSE
+HIT_INFO_NORMAL_BUMP = ffi.C.HIT_INFO_NORMAL_BUMP
+HIT_INFO_SPECULAR = ffi.C.HIT_INFO_SPECULAR
+HIT_INFO_ALL = ffi.C.HIT_INFO_ALL
+MISSING_MATERIAL_EMISSION = ffi.C.MISSING_MATERIAL_EMISSION
 
 make_image = ffi.C.make_image
 load_image = ffi.C.load_image
@@ -100,6 +293,26 @@ save_image = ffi.C.save_image
 free_image = ffi.C.free_image
 get_pixel = ffi.C.get_pixel
 sample_image = ffi.C.sample_image
+image_write_rect = ffi.C.image_write_rect
+image_read_rect = ffi.C.image_read_rect
+image_accumulate_rect = ffi.C.image_accumulate_rect
+
+make_accum_buffer = ffi.C.make_accum_buffer
+accum_add = ffi.C.accum_add
+accum_add_rect = ffi.C.accum_add_rect
+accum_count = ffi.C.accum_count
+accum_sum = ffi.C.accum_sum
+accum_mean = ffi.C.accum_mean
+accum_variance = ffi.C.accum_variance
+accum_resolve = ffi.C.accum_resolve
+accum_clear = ffi.C.accum_clear
+free_accum_buffer = ffi.C.free_accum_buffer
+make_splat_buffer = ffi.C.make_splat_buffer
+splat = ffi.C.splat
+splat_get = ffi.C.splat_get
+splat_resolve = ffi.C.splat_resolve
+splat_clear = ffi.C.splat_clear
+free_splat_buffer = ffi.C.free_splat_buffer
 generate_demo_image = ffi.C.generate_demo_image
 
 make_model = ffi.C.make_model
@@ -107,19 +320,54 @@ model_tri_count = ffi.C.model_tri_count
 model_get_tri = ffi.C.model_get_tri
 free_model = ffi.C.free_model
 model_hit_info = ffi.C.model_hit_info
+model_hit_info_footprint = ffi.C.model_hit_info_footprint
+model_hit_info_masked = ffi.C.model_hit_info_masked
+model_hit_info_batch = ffi.C.model_hit_info_batch
+model_material_table = ffi.C.model_material_table
+texture_sample = ffi.C.texture_sample
+model_save_binary = ffi.C.model_save_binary
+convert_model = ffi.C.convert_model
+set_texture_srgb = ffi.C.set_texture_srgb
+PIXEL_ORDER_SCANLINE = ffi.C.PIXEL_ORDER_SCANLINE
+PIXEL_ORDER_MORTON = ffi.C.PIXEL_ORDER_MORTON
+PIXEL_ORDER_HILBERT = ffi.C.PIXEL_ORDER_HILBERT
+set_pixel_order = ffi.C.set_pixel_order
 
 make_bvh = ffi.C.make_bvh
 bvh_get_tri = ffi.C.bvh_get_tri
 bvh_tri_count = ffi.C.bvh_tri_count
 bvh_get_emitter = ffi.C.bvh_get_emitter
 bvh_emitter_count = ffi.C.bvh_emitter_count
+bvh_sample_emitter = ffi.C.bvh_sample_emitter
+bvh_emitter_pdf = ffi.C.bvh_emitter_pdf
+bvh_emitter_power = ffi.C.bvh_emitter_power
+bvh_build_light_tree = ffi.C.bvh_build_light_tree
 bvh_push_node = ffi.C.bvh_push_node
 bvh_get_node = ffi.C.bvh_get_node
 bvh_node_set_children = ffi.C.bvh_node_set_children
 bvh_node_count = ffi.C.bvh_node_count
+bvh_prebuilt = ffi.C.bvh_prebuilt
 free_bvh = ffi.C.free_bvh
+bvh_compress = ffi.C.bvh_compress
+bvh_trace = ffi.C.bvh_trace
+bvh_finalize = ffi.C.bvh_finalize
+bvh_hit_surface = ffi.C.bvh_hit_surface
+bvh_trace_differential = ffi.C.bvh_trace_differential
 make_partitioning_table = ffi.C.make_partitioning_table
 partition = ffi.C.partition
+build_streamed_mesh = ffi.C.build_streamed_mesh
+load_streamed_mesh = ffi.C.load_streamed_mesh
+streamed_set_budget = ffi.C.streamed_set_budget
+streamed_trace = ffi.C.streamed_trace
+streamed_hit_surface = ffi.C.streamed_hit_surface
+streamed_hit_info = ffi.C.streamed_hit_info
+streamed_hit_info_masked = ffi.C.streamed_hit_info_masked
+streamed_hit_info_batch = ffi.C.streamed_hit_info_batch
+streamed_material_table = ffi.C.streamed_material_table
+streamed_tri_count = ffi.C.streamed_tri_count
+streamed_stats = ffi.C.streamed_stats
+streamed_reset_stats = ffi.C.streamed_reset_stats
+free_streamed_mesh = ffi.C.free_streamed_mesh
 
 inventory_add = ffi.C.inventory_add
 inventory_get = ffi.C.inventory_get
@@ -143,6 +391,11 @@ shared_clear = ffi.C.shared_clear
 
 -- pparams contains:
 -- x, y, u, v, w, h
+-- and for adaptive batches, tile_w, tile_h, samples, pass
+-- and for coarse to fine batches, block
 shade = ffi.C.shade
+shade_region = ffi.C.shade_region
+shade_coarse_to_fine = ffi.C.shade_coarse_to_fine
+shade_adaptive = ffi.C.shade_adaptive
 debug = ffi.C.debug
 
@@ -64,6 +64,34 @@ ffi.cdef[[
     } Node;
     BBox bbox();
     void enclose(BBox &bbox, const Vec3C &p);
+
+    typedef struct
+    {
+        int tri; // Triangle index in BVH order, -1 if nothing is hit
+        Vec3C uvt;
+    } RayHit;
+
+    /**
+     * A RayHit plus ray differentials: how far the texture coordinates move when the ray is
+     * replaced by the ones through the neighbouring pixels. footprint is the larger of the two.
+     */
+    typedef struct
+    {
+        RayHit hit;
+        Vec2C duvdx, duvdy;
+        float footprint;
+    } RayDiffHit;
+
+    /**
+     * A point sampled on an emitter. The PDF is with respect to surface area.
+     */
+    typedef struct
+    {
+        Vec3C position;
+        Vec3C normal;
+        int emitter; // Emitter index, -1 if there are no emitters
+        float pdf;
+    } EmitterSample;
 ]]
 
 vec2 = ffi.C.vec2
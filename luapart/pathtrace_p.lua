@@ -1,4 +1,4 @@
--- "Fragment shader" for pathtrace.lua.
+-- "Fragment shader" for ptrace.lua.
 require "lib/pervasives"
 require "lib/camera"
 require "lib/intersect"
@@ -32,27 +32,28 @@ end
 
 -- Take light source samples, together with pdf.
 -- Takes in the reference point.
--- Returns the light direction and the PDF.
+-- Returns the light direction and the PDF (with respect to solid angle).
 function emitter_sample(ref, nor)
-    -- Step 1. choose a random sample
-    local picked_i = math.random(bvh_emitter_count(bvh)) - 1
-    local sample_uv = sample_uniform_triangle(vec2(math.random(), math.random()))
-
-    -- Step 2. calculate target point, interpolate using barycentric coordinate
-    local tri = bvh_get_emitter(bvh, picked_i)
-    local sample_p = vec3(sample_uv.u, sample_uv.v, 1 - sample_uv.u - sample_uv.v)
-    local tar = add3(add3(scl3(tri.a.position, sample_p.x), scl3(tri.b.position, sample_p.y)), scl3(tri.c.position, sample_p.z))
+    -- Step 1. choose an emitter (proportional to its power) and a point on it
+    local sample = bvh_sample_emitter(bvh, ref, math.random(), math.random(), math.random())
+    if sample.emitter < 0 then
+        return nor, 0
+    end
 
-    -- Step 3. calculate distance squared, ray direction
-    local dist_sqr = len3(sub3(tar, ref)) ^ 2
-    local rd = nor3(sub3(tar, ref))
+    -- Step 2. calculate distance squared, ray direction
+    local dist_sqr = len3(sub3(sample.position, ref)) ^ 2
+    local rd = nor3(sub3(sample.position, ref))
 
-    -- Step 4. see if its occluded
+    -- Step 3. see if its occluded
     -- Do we need to consider this? If we generate a ray from ref to tar, then its guaranteed to hit.
     -- True, it might be occluded by other triangles. But that can be done later, and its expensive to traverse the BVH again. Maybe we'll skip this step.
 
-    -- Step 5. evaluate PDF
-    return rd, 1 / (math.abs(dot3(nor, scl3(rd, -1.0))) * tri_area(tri))
+    -- Step 4. convert the PDF from area to solid angle
+    local cosine = math.abs(dot3(sample.normal, scl3(rd, -1.0)))
+    if cosine < 0.0001 then
+        return rd, 0
+    end
+    return rd, sample.pdf * dist_sqr / cosine
 end
 
 
@@ -70,8 +71,17 @@ function brdf(wo, wi, p)
     return 1.0 / math.pi
 end
 
-function get_brightness(ro, rd, depth)
-    local interaction = trace(bvh, model, ro, rd)
+-- Emission and ambient is all the shading below looks at.
+local shading_mask = HIT_INFO_EMISSION + HIT_INFO_AMBIENT
+
+-- rd_dx and rd_dy are only given for camera rays; they pick the texture mip level.
+function get_brightness(ro, rd, depth, rd_dx, rd_dy)
+    local interaction = nil
+    if rd_dx ~= nil then
+        interaction = trace_differential(bvh, model, ro, rd, rd_dx, rd_dy, shading_mask)
+    else
+        interaction = trace(bvh, model, ro, rd, shading_mask)
+    end
     if interaction == nil then
         -- Sample sky color
         return get_sky(rd)
@@ -128,16 +138,41 @@ function get_brightness(ro, rd, depth)
 --     return light_dir
 end
 
-local uv = vec2(pparams.u * 2.0 - 1.0, pparams.v * 2.0 - 1.0)
 local ro = vec3(0, 1, 3)
 local center = vec3(0, 0.5, 0)
-local right, up, front, rd = view_vectors(uv, ro, center)
+
+-- Camera ray (and its differentials) through the center of pixel (x, y).
+function camera_ray(x, y)
+    local uv = vec2(((x + 0.5) / pparams.w) * 2.0 - 1.0, ((y + 0.5) / pparams.h) * 2.0 - 1.0)
+    local right, up, front, rd = view_vectors(uv, ro, center)
+    local _, _, _, rd_dx = view_vectors(vec2(uv.u + 2.0 / pparams.w, uv.v), ro, center)
+    local _, _, _, rd_dy = view_vectors(vec2(uv.u, uv.v + 2.0 / pparams.h), ro, center)
+    return rd, rd_dx, rd_dy
+end
+
+if pparams.samples > 0 then
+    -- Adaptive batch (see ptrace.lua): every sample goes into the accumulation buffer,
+    -- so the scheduler can tell which tiles are still noisy.
+    local accum = inventory_get("accum")
+    for y = pparams.y, pparams.y + pparams.tile_h - 1 do
+        for x = pparams.x, pparams.x + pparams.tile_w - 1 do
+            local rd, rd_dx, rd_dy = camera_ray(x, y)
+            for i = 1, pparams.samples do
+                local color = get_brightness(ro, rd, 0, rd_dx, rd_dy)
+                accum_add(accum, x, y, color.x, color.y, color.z)
+            end
+        end
+    end
+    return
+end
+
+local rd, rd_dx, rd_dy = camera_ray(pparams.x, pparams.y)
 
 -- Generate 100 samples!
 local num_samples = 28
 local color = vec3(0.0, 0.0, 0.0)
 for i = 1, num_samples do
-    color = add3(color, get_brightness(ro, rd, 0))
+    color = add3(color, get_brightness(ro, rd, 0, rd_dx, rd_dy))
 end
 
 color = scl3(color, 1 / num_samples)
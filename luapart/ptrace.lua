@@ -2,6 +2,11 @@
 require "lib/pervasives"
 local buffer = require "string.buffer"
 
+-- Set progressive = true (e.g. through Inject) for plain progressive passes,
+-- or look_dev = true for a quick coarse to fine preview instead.
+local progressive = progressive or false
+local look_dev = look_dev or false
+
 local size = {
     w = 200,
     h = 200
@@ -15,7 +20,42 @@ if shared_get("initialized") == nil then
     shared_add("initialized", "yes")
 end
 
-shade(size.w, size.h, "pathtrace_p.lua")
+if look_dev then
+    local im = inventory_get("image")
+    shade_coarse_to_fine(size.w, size.h, "pathtrace_p.lua", im, 8)
+    save_image(im, "trace.png")
+    return
+end
 
+-- Spend samples where the image is still noisy, instead of 28 everywhere.
+-- The image is updated after every pass; press Stop once it looks good enough.
+-- With a region selected in the viewer, only that part is rendered again and the rest is kept.
 local im = inventory_get("image")
+local accum = inventory_get("accum")
+local params = {
+    tile_size = 16,
+    base_samples = 8,
+    pass_samples = 8,
+    max_samples = 64,
+    error_threshold = 0.05,
+    time_limit = 0,
+    sample_budget = 28,
+    max_passes = 0,
+    clear_accum = true,
+    accum = accum,
+    preview = im
+}
+if progressive then
+    -- Progressive: a few samples everywhere per pass, until Stop or the last pass.
+    params.base_samples = 2
+    params.pass_samples = 2
+    params.max_samples = 0
+    params.error_threshold = 0
+    params.sample_budget = 0
+    params.max_passes = 64
+end
+local result = shade_adaptive(size.w, size.h, "pathtrace_p.lua", ffi.new("BatchParams", params))
+print("Passes: ", result.passes, "spp: ", result.samples_per_pixel, "seconds: ", result.seconds)
+
+-- The preview already holds the resolved image (only the region changed, if there is one.)
 save_image(im, "trace.png")
@@ -3,6 +3,7 @@
 -- 1. The output image.
 -- 2. The model.
 -- 3. The BVH.
+-- 4. The accumulation buffer adaptive batches add their samples to.
 -- Then we add them to global shared variables.
 require "lib/pervasives"
 require "lib/bvh"
@@ -17,7 +18,11 @@ local im = make_image(size.w, size.h)
 -- Load the mesh to be pathtraced.
 local model = make_model("cornell/CornellBox-Glossy-Floor.obj", "cornell")
 local bvh = make_bvh(model)
-bvh_construct(bvh, 0, 0, bvh_tri_count(bvh) - 1)
+-- Binary mesh files (see convert_model) may carry a prebuilt BVH.
+if not bvh_prebuilt(bvh) then
+    bvh_construct(bvh, 0, 0, bvh_tri_count(bvh) - 1)
+    bvh_finalize(bvh)
+end
 
 print("#emitters: ", bvh_emitter_count(bvh))
 
@@ -25,5 +30,6 @@ print("#emitters: ", bvh_emitter_count(bvh))
 inventory_add("image", im)
 inventory_add("model", model)
 inventory_add("bvh", bvh)
+inventory_add("accum", make_accum_buffer(size.w, size.h, false))
 
 print("Initialization complete.")
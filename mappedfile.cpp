@@ -0,0 +1,92 @@
+// Read-only memory-mapped files.
+// SPDX-FileCopyrightText: 2023 42yeah <email>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "mappedfile.h"
+#include <fstream>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() : ptr(nullptr), len(0), mapped(false), fallback(nullptr)
+{
+
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string &path)
+{
+    close();
+
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+    {
+        if (st.st_size == 0)
+        {
+            ::close(fd);
+            return true;
+        }
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED)
+        {
+            // The mapping stays valid after the descriptor is closed.
+            ::close(fd);
+            ptr = (const char *) addr;
+            len = st.st_size;
+            mapped = true;
+            return true;
+        }
+    }
+    ::close(fd);
+#endif
+
+    // Fall back to reading the whole thing.
+    std::ifstream reader(path, std::ios::binary | std::ios::ate);
+    if (!reader.good())
+    {
+        return false;
+    }
+    len = reader.tellg();
+    reader.seekg(0);
+    fallback.reset(new char[len]);
+    reader.read(fallback.get(), len);
+    ptr = fallback.get();
+    return true;
+}
+
+void MappedFile::close()
+{
+#ifndef _WIN32
+    if (mapped && ptr)
+    {
+        munmap((void *) ptr, len);
+    }
+#endif
+    ptr = nullptr;
+    len = 0;
+    mapped = false;
+    fallback.reset();
+}
+
+const char *MappedFile::data() const
+{
+    return ptr;
+}
+
+size_t MappedFile::size() const
+{
+    return len;
+}
@@ -3,6 +3,7 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include "material.h"
+#include <cstring>
 #include "luaenv.h"
 
 int material_id_counter = 0;
@@ -19,7 +20,7 @@ Material::Material() : material_name("boring"), metallic(0), metallic_tex(nullpt
 
 }
 
-Material::Material(const tinyobj::material_t &mat, std::string mtl_base_dir) : Material()
+static std::string texture_base_dir(std::string mtl_base_dir)
 {
     if (mtl_base_dir.empty())
     {
@@ -29,51 +30,67 @@ Material::Material(const tinyobj::material_t &mat, std::string mtl_base_dir) : M
     {
         mtl_base_dir += "/";
     }
+    return mtl_base_dir;
+}
 
-    Resources *r = res();
-    material_name = mat.name;
-    metallic = mat.metallic;
-    if (!mat.metallic_texname.empty())
+static std::shared_ptr<U8Image> load_texture(const std::string &mtl_base_dir, const std::string &texname, bool srgb)
+{
+    if (texname.empty())
     {
-        metallic_tex = std::make_shared<U8Image>();
-        metallic_tex->load(mtl_base_dir + mat.metallic_texname); // TODO: issues might arise in the future (path)
-        r->images.push_back(metallic_tex);
+        return nullptr;
     }
+    return res()->load_texture(mtl_base_dir + texname, srgb); // TODO: issues might arise in the future (path)
+}
+
+Material::Material(const tinyobj::material_t &mat, std::string mtl_base_dir) : Material()
+{
+    mtl_base_dir = texture_base_dir(mtl_base_dir);
+    bool srgb = res()->srgb_textures;
+
+    material_name = mat.name;
+    metallic = mat.metallic;
+    metallic_tex = load_texture(mtl_base_dir, mat.metallic_texname, false);
     ior = mat.ior;
     emission = RGB<float>(mat.emission[0], mat.emission[1], mat.emission[2]);
-    if (!mat.emissive_texname.empty())
-    {
-        emissive_tex = std::make_shared<U8Image>();
-        emissive_tex->load(mtl_base_dir + mat.emissive_texname);
-        r->images.push_back(emissive_tex);
-    }
+    emissive_tex = load_texture(mtl_base_dir, mat.emissive_texname, srgb);
     ambient = RGB<float>(mat.ambient[0], mat.ambient[1], mat.ambient[2]);
-    if (!mat.ambient_texname.empty())
-    {
-        ambient_tex = std::make_shared<U8Image>();
-        ambient_tex->load(mtl_base_dir + mat.ambient_texname);
-        r->images.push_back(ambient_tex);
-    }
+    ambient_tex = load_texture(mtl_base_dir, mat.ambient_texname, srgb);
     diffuse = RGB<float>(mat.diffuse[0], mat.diffuse[1], mat.diffuse[2]);
-    if (!mat.diffuse_texname.empty())
+    diffuse_tex = load_texture(mtl_base_dir, mat.diffuse_texname, srgb);
+    normal_tex = load_texture(mtl_base_dir, mat.normal_texname, false);
+    specular = RGB<float>(mat.specular[0], mat.specular[1], mat.specular[2]);
+    specular_tex = load_texture(mtl_base_dir, mat.specular_texname, srgb);
+}
+
+RGB<float> sample_texture(const U8Image &tex, const glm::vec2 &uv, float footprint)
+{
+    if (footprint > 0.0f)
     {
-        diffuse_tex = std::make_shared<U8Image>();
-        diffuse_tex->load(mtl_base_dir + mat.diffuse_texname);
-        r->images.push_back(diffuse_tex);
+        return tex.sample_rgb_footprint(uv.x, uv.y, footprint, SampleMethod::Repeat);
     }
-    if (!mat.normal_texname.empty())
+    return tex.sample_rgb(uv.x, uv.y, SampleMethod::Repeat);
+}
+
+std::vector<TextureRef> Material::textures(const tinyobj::material_t &mat, std::string mtl_base_dir)
+{
+    mtl_base_dir = texture_base_dir(mtl_base_dir);
+    bool srgb = res()->srgb_textures;
+    std::vector<TextureRef> refs;
+    for (const std::string *texname : { &mat.metallic_texname, &mat.normal_texname })
     {
-        normal_tex = std::make_shared<U8Image>();
-        normal_tex->load(mtl_base_dir + mat.normal_texname);
-        r->images.push_back(normal_tex);
+        if (!texname->empty())
+        {
+            refs.push_back({ mtl_base_dir + *texname, false });
+        }
     }
-    specular = RGB<float>(mat.specular[0], mat.specular[1], mat.specular[2]);
-    if (!mat.specular_texname.empty())
+    for (const std::string *texname : { &mat.emissive_texname, &mat.ambient_texname, &mat.diffuse_texname, &mat.specular_texname })
     {
-        specular_tex = std::make_shared<U8Image>();
-        specular_tex->load(mtl_base_dir + mat.specular_texname);
-        r->images.push_back(specular_tex);
+        if (!texname->empty())
+        {
+            refs.push_back({ mtl_base_dir + *texname, srgb });
+        }
     }
+    return refs;
 }
 
 Material::~Material()
@@ -86,11 +103,11 @@ const std::string &Material::get_name() const
     return material_name;
 }
 
-float Material::get_metallic(const glm::vec2 &uv) const
+float Material::get_metallic(const glm::vec2 &uv, float footprint) const
 {
     if (metallic_tex)
     {
-        return metallic_tex->sample_rgb(uv.x, uv.y, SampleMethod::Repeat).r;
+        return sample_texture(*metallic_tex, uv, footprint).r;
     }
     return metallic;
 }
@@ -100,74 +117,210 @@ float Material::get_ior() const
     return ior;
 }
 
-RGB<float> Material::get_emission(const glm::vec2 &uv) const
+RGB<float> Material::get_emission(const glm::vec2 &uv, float footprint) const
 {
     if (emissive_tex)
     {
-        return emissive_tex->sample_rgb(uv.x, uv.y, SampleMethod::Repeat);
+        return sample_texture(*emissive_tex, uv, footprint);
     }
     return emission;
 }
 
-RGB<float> Material::get_ambient(const glm::vec2 &uv) const
+RGB<float> Material::get_ambient(const glm::vec2 &uv, float footprint) const
 {
     if (ambient_tex)
     {
-        return ambient_tex->sample_rgb(uv.x, uv.y, SampleMethod::Repeat);
+        return sample_texture(*ambient_tex, uv, footprint);
     }
     return ambient;
 }
 
-RGB<float> Material::get_diffuse(const glm::vec2 &uv) const
+RGB<float> Material::get_diffuse(const glm::vec2 &uv, float footprint) const
 {
     if (diffuse_tex)
     {
-        return diffuse_tex->sample_rgb(uv.x, uv.y, SampleMethod::Repeat);
+        return sample_texture(*diffuse_tex, uv, footprint);
     }
     return diffuse;
 }
 
-RGB<float> Material::get_normal_bump(const glm::vec2 &uv) const
+RGB<float> Material::get_normal_bump(const glm::vec2 &uv, float footprint) const
 {
     if (normal_tex)
     {
-        return normal_tex->sample_rgb(uv.x, uv.y, SampleMethod::Repeat);
+        return sample_texture(*normal_tex, uv, footprint);
     }
     // Return straight up (no offset)
     return RGB<float>(0.0f, 1.0f, 0.0f);
 }
 
-RGB<float> Material::get_specular(const glm::vec2 &uv) const
+RGB<float> Material::get_specular(const glm::vec2 &uv, float footprint) const
 {
     if (specular_tex)
     {
-        return specular_tex->sample_rgb(uv.x, uv.y, SampleMethod::Repeat);
+        return sample_texture(*specular_tex, uv, footprint);
     }
     return specular;
 }
 
+RGB<float> Material::get_average_emission() const
+{
+    if (!emissive_tex || emissive_tex->w == 0 || emissive_tex->h == 0)
+    {
+        return emission;
+    }
+
+    double r = 0.0, g = 0.0, b = 0.0;
+    for (int y = 0; y < emissive_tex->h; y++)
+    {
+        for (int x = 0; x < emissive_tex->w; x++)
+        {
+            RGB<float> rgb = emissive_tex->get_rgb_float(x, y);
+            r += rgb.r;
+            g += rgb.g;
+            b += rgb.b;
+        }
+    }
+    double n = (double) emissive_tex->w * emissive_tex->h;
+    return RGB<float>(r / n, g / n, b / n);
+}
 
 int Material::id() const
 {
     return id_;
 }
 
+unsigned int Material::textured_fields() const
+{
+    unsigned int fields = 0;
+    fields |= metallic_tex ? HIT_INFO_METALLIC : 0;
+    fields |= emissive_tex ? HIT_INFO_EMISSION : 0;
+    fields |= ambient_tex ? HIT_INFO_AMBIENT : 0;
+    fields |= diffuse_tex ? HIT_INFO_DIFFUSE : 0;
+    fields |= normal_tex ? HIT_INFO_NORMAL_BUMP : 0;
+    fields |= specular_tex ? HIT_INFO_SPECULAR : 0;
+    return fields;
+}
 
-HitInfo Material::get_hit_info(const glm::vec2 &uv) const
+MaterialTableData::MaterialTableData()
 {
-    // That's a lot of texture samples...
+    build({});
+}
+
+static Vec3C to_vec3c(const RGB<float> &rgb)
+{
+    return vec3(rgb.r, rgb.g, rgb.b);
+}
+
+void MaterialTableData::build(const std::vector<Material> &mat)
+{
+    textured.clear();
+    for (std::vector<float> *v : { &metallic, &ior })
+    {
+        v->clear();
+    }
+    for (std::vector<Vec3C> *v : { &emission, &ambient, &diffuse, &normal_bump, &specular })
+    {
+        v->clear();
+    }
+    for (std::vector<const U8Image *> *v : { &metallic_tex, &emissive_tex, &ambient_tex, &diffuse_tex, &normal_tex, &specular_tex })
+    {
+        v->clear();
+    }
+
+    for (const Material &m : mat)
+    {
+        textured.push_back(m.textured_fields());
+        metallic.push_back(m.metallic);
+        ior.push_back(m.ior);
+        emission.push_back(to_vec3c(m.emission));
+        ambient.push_back(to_vec3c(m.ambient));
+        diffuse.push_back(to_vec3c(m.diffuse));
+        normal_bump.push_back(vec3(0.0f, 1.0f, 0.0f)); // See get_normal_bump
+        specular.push_back(to_vec3c(m.specular));
+        metallic_tex.push_back(m.metallic_tex.get());
+        emissive_tex.push_back(m.emissive_tex.get());
+        ambient_tex.push_back(m.ambient_tex.get());
+        diffuse_tex.push_back(m.diffuse_tex.get());
+        normal_tex.push_back(m.normal_tex.get());
+        specular_tex.push_back(m.specular_tex.get());
+    }
+
+    table.count = mat.size();
+    table.textured = textured.data();
+    table.metallic = metallic.data();
+    table.ior = ior.data();
+    table.emission = emission.data();
+    table.ambient = ambient.data();
+    table.diffuse = diffuse.data();
+    table.normal_bump = normal_bump.data();
+    table.specular = specular.data();
+    table.metallic_tex = metallic_tex.data();
+    table.emissive_tex = emissive_tex.data();
+    table.ambient_tex = ambient_tex.data();
+    table.diffuse_tex = diffuse_tex.data();
+    table.normal_tex = normal_tex.data();
+    table.specular_tex = specular_tex.data();
+}
+
+const MaterialTable *MaterialTableData::get() const
+{
+    return &table;
+}
+
+
+HitInfo Material::get_hit_info(const glm::vec2 &uv, float footprint, unsigned int mask) const
+{
+    // That's a lot of texture samples... so only take the ones asked for.
     HitInfo info;
-    info.metallic = get_metallic(uv);
-    info.ior = ior;
-    RGB<float> em = get_emission(uv);
-    info.emission = { em.r, em.g, em.b };
-    RGB<float> am = get_ambient(uv);
-    info.ambient = { am.r, am.g, am.b };
-    RGB<float> dif = get_diffuse(uv);
-    info.diffuse = { dif.r, dif.g, dif.b };
-    RGB<float> bump = get_normal_bump(uv);
-    info.normal_bump = { bump.r, bump.g, bump.b };
-    RGB<float> spec = get_specular(uv);
-    info.specular = { spec.r, spec.g, spec.b };
+    std::memset(&info, 0, sizeof(info));
+    if (mask & HIT_INFO_METALLIC)
+    {
+        info.metallic = get_metallic(uv, footprint);
+    }
+    if (mask & HIT_INFO_IOR)
+    {
+        info.ior = ior;
+    }
+    if (mask & HIT_INFO_EMISSION)
+    {
+        RGB<float> em = get_emission(uv, footprint);
+        info.emission = { em.r, em.g, em.b };
+    }
+    if (mask & HIT_INFO_AMBIENT)
+    {
+        RGB<float> am = get_ambient(uv, footprint);
+        info.ambient = { am.r, am.g, am.b };
+    }
+    if (mask & HIT_INFO_DIFFUSE)
+    {
+        RGB<float> dif = get_diffuse(uv, footprint);
+        info.diffuse = { dif.r, dif.g, dif.b };
+    }
+    if (mask & HIT_INFO_NORMAL_BUMP)
+    {
+        RGB<float> bump = get_normal_bump(uv, footprint);
+        info.normal_bump = { bump.r, bump.g, bump.b };
+    }
+    if (mask & HIT_INFO_SPECULAR)
+    {
+        RGB<float> spec = get_specular(uv, footprint);
+        info.specular = { spec.r, spec.g, spec.b };
+    }
     return info;
 }
+
+void get_hit_info_batch(const std::vector<Material> &mat, const int *material_ids, const glm::vec2 *uvs, const float *footprints, int count, unsigned int mask, HitInfo *out)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int id = material_ids[i];
+        if (id < 0)
+        {
+            out[i] = hit_info();
+            continue;
+        }
+        assert(id < mat.size() && "Material ID out of bounds");
+        out[i] = mat[id].get_hit_info(uvs[i], footprints != nullptr ? footprints[i] : 0.0f, mask);
+    }
+}
@@ -0,0 +1,319 @@
+// Binary mesh files: a native layout that can be memory-mapped and used as-is.
+// SPDX-FileCopyrightText: 2023 42yeah <email>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "meshfile.h"
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include "model.h"
+#include "bbox.h"
+
+static uint64_t align_offset(uint64_t offset)
+{
+    return (offset + MESH_FILE_ALIGNMENT - 1) / MESH_FILE_ALIGNMENT * MESH_FILE_ALIGNMENT;
+}
+
+static void put_string(std::string &out, const std::string &str)
+{
+    uint32_t len = str.size();
+    out.append((const char *) &len, sizeof(len));
+    out.append(str);
+}
+
+static void put_floats(std::string &out, const float *f, int n)
+{
+    out.append((const char *) f, sizeof(float) * n);
+}
+
+static bool get_string(const char *&ptr, const char *end, std::string &str)
+{
+    uint32_t len;
+    if (end - ptr < sizeof(len))
+    {
+        return false;
+    }
+    std::memcpy(&len, ptr, sizeof(len));
+    ptr += sizeof(len);
+    if (end - ptr < len)
+    {
+        return false;
+    }
+    str.assign(ptr, len);
+    ptr += len;
+    return true;
+}
+
+static bool get_floats(const char *&ptr, const char *end, float *f, int n)
+{
+    if (end - ptr < sizeof(float) * n)
+    {
+        return false;
+    }
+    std::memcpy(f, ptr, sizeof(float) * n);
+    ptr += sizeof(float) * n;
+    return true;
+}
+
+std::string serialize_materials(const std::string &mtl_base_dir, const std::vector<tinyobj::material_t> &materials)
+{
+    std::string out;
+    put_string(out, mtl_base_dir);
+    for (const tinyobj::material_t &m : materials)
+    {
+        put_string(out, m.name);
+        put_floats(out, &m.metallic, 1);
+        put_floats(out, &m.ior, 1);
+        put_floats(out, m.emission, 3);
+        put_floats(out, m.ambient, 3);
+        put_floats(out, m.diffuse, 3);
+        put_floats(out, m.specular, 3);
+        put_string(out, m.metallic_texname);
+        put_string(out, m.emissive_texname);
+        put_string(out, m.ambient_texname);
+        put_string(out, m.diffuse_texname);
+        put_string(out, m.normal_texname);
+        put_string(out, m.specular_texname);
+    }
+    return out;
+}
+
+bool deserialize_materials(const char *ptr, const char *end, int num_materials, std::string &mtl_base_dir, std::vector<tinyobj::material_t> &materials)
+{
+    if (!get_string(ptr, end, mtl_base_dir))
+    {
+        return false;
+    }
+    materials.resize(num_materials);
+    for (tinyobj::material_t &m : materials)
+    {
+        bool ok = get_string(ptr, end, m.name) &&
+            get_floats(ptr, end, &m.metallic, 1) &&
+            get_floats(ptr, end, &m.ior, 1) &&
+            get_floats(ptr, end, m.emission, 3) &&
+            get_floats(ptr, end, m.ambient, 3) &&
+            get_floats(ptr, end, m.diffuse, 3) &&
+            get_floats(ptr, end, m.specular, 3) &&
+            get_string(ptr, end, m.metallic_texname) &&
+            get_string(ptr, end, m.emissive_texname) &&
+            get_string(ptr, end, m.ambient_texname) &&
+            get_string(ptr, end, m.diffuse_texname) &&
+            get_string(ptr, end, m.normal_texname) &&
+            get_string(ptr, end, m.specular_texname);
+        if (!ok)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool is_mesh_file(const std::string &path)
+{
+    std::ifstream reader(path, std::ios::binary);
+    char magic[sizeof(MeshFileHeader::magic)];
+    if (!reader.read(magic, sizeof(magic)))
+    {
+        return false;
+    }
+    return std::memcmp(magic, MESH_FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+/**
+ * Check that indices, material IDs, nodes and the triangle order only refer to things that exist.
+ */
+static bool validate_mesh_view(const MeshFileView &view)
+{
+    const MeshFileHeader *header = view.header;
+    for (uint64_t i = 0; i < 3 * (uint64_t) header->num_tris; i++)
+    {
+        if (view.indices[i] >= header->num_verts)
+        {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->num_tris; i++)
+    {
+        if (view.material_ids[i] < -1 || view.material_ids[i] >= (int64_t) header->num_materials)
+        {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->num_nodes; i++)
+    {
+        const Node &n = view.nodes[i];
+        if (n.start < 0 || n.size < 0 || (int64_t) n.start + n.size > header->num_tris)
+        {
+            return false;
+        }
+        bool leaf = n.l == 0 && n.r == 0;
+        // Children always come after their parent; anything else could send traversal into a cycle.
+        if (!leaf && (n.l <= (int64_t) i || n.r <= (int64_t) i || n.l >= (int64_t) header->num_nodes || n.r >= (int64_t) header->num_nodes))
+        {
+            return false;
+        }
+    }
+    if (view.order != nullptr)
+    {
+        for (uint32_t i = 0; i < header->num_tris; i++)
+        {
+            if (view.order[i] < 0 || view.order[i] >= (int64_t) header->num_tris)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool read_mesh_file(const MappedFile &file, MeshFileView &view, std::string &errors)
+{
+    if (file.size() < sizeof(MeshFileHeader))
+    {
+        errors += "File is too small to be a mesh file\n";
+        return false;
+    }
+    const MeshFileHeader *header = (const MeshFileHeader *) file.data();
+    if (std::memcmp(header->magic, MESH_FILE_MAGIC, sizeof(header->magic)) != 0)
+    {
+        errors += "Not a mesh file\n";
+        return false;
+    }
+    if (header->version != MESH_FILE_VERSION)
+    {
+        errors += "Unsupported mesh file version: " + std::to_string(header->version) + "\n";
+        return false;
+    }
+    if (header->byte_order != MESH_FILE_BYTE_ORDER)
+    {
+        errors += "Mesh file was written on a host with a different byte order\n";
+        return false;
+    }
+
+    // Every section has to be aligned and lie inside the file.
+    struct { uint64_t offset, size; } sections[] = {
+        { header->positions, sizeof(glm::vec3) * (uint64_t) header->num_verts },
+        { header->normals, sizeof(glm::vec3) * (uint64_t) header->num_verts },
+        { header->tex_coords, sizeof(glm::vec2) * (uint64_t) header->num_verts },
+        { header->indices, sizeof(uint32_t) * 3 * (uint64_t) header->num_tris },
+        { header->material_ids, sizeof(int) * (uint64_t) header->num_tris },
+        { header->nodes, sizeof(Node) * (uint64_t) header->num_nodes },
+        { header->order, header->num_nodes > 0 ? sizeof(int) * (uint64_t) header->num_tris : 0 },
+        { header->materials, header->materials_size }
+    };
+    for (const auto &section : sections)
+    {
+        if (section.offset % MESH_FILE_ALIGNMENT != 0 || section.offset > file.size() || section.size > file.size() - section.offset)
+        {
+            errors += "Mesh file is truncated or corrupted\n";
+            return false;
+        }
+    }
+
+    const char *base = file.data();
+    view.header = header;
+    view.positions = (const glm::vec3 *) (base + header->positions);
+    view.normals = (const glm::vec3 *) (base + header->normals);
+    view.tex_coords = (const glm::vec2 *) (base + header->tex_coords);
+    view.indices = (const uint32_t *) (base + header->indices);
+    view.material_ids = (const int *) (base + header->material_ids);
+    view.nodes = header->num_nodes > 0 ? (const Node *) (base + header->nodes) : nullptr;
+    view.order = header->num_nodes > 0 ? (const int *) (base + header->order) : nullptr;
+
+    // The sections are used as-is, so every index in them has to be checked once up front.
+    if (!validate_mesh_view(view))
+    {
+        errors += "Mesh file is truncated or corrupted\n";
+        return false;
+    }
+
+    const char *materials = base + header->materials;
+    if (!deserialize_materials(materials, materials + header->materials_size, header->num_materials, view.mtl_base_dir, view.materials))
+    {
+        errors += "Corrupted material table\n";
+        return false;
+    }
+    return true;
+}
+
+bool write_mesh_file(const std::string &path, const Model &model, const BVH *bvh, std::string &errors)
+{
+    if (bvh != nullptr && bvh->is_compressed())
+    {
+        errors += "Compressed BVHs cannot be saved; save before compressing\n";
+        return false;
+    }
+
+    MeshFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MESH_FILE_MAGIC, sizeof(header.magic));
+    header.version = MESH_FILE_VERSION;
+    header.byte_order = MESH_FILE_BYTE_ORDER;
+    header.num_verts = model.get_num_verts();
+    header.num_tris = model.get_num_tris();
+    header.num_materials = model.get_material_descs().size();
+    header.num_nodes = bvh != nullptr ? bvh->get_num_nodes() : 0;
+
+    std::vector<Node> nodes(header.num_nodes);
+    std::vector<int> order(header.num_nodes > 0 ? header.num_tris : 0);
+    for (int i = 0; i < nodes.size(); i++)
+    {
+        nodes[i] = bvh->get_node(i);
+    }
+    for (int i = 0; i < order.size(); i++)
+    {
+        order[i] = bvh->get_model_index(i);
+    }
+    std::string materials = serialize_materials(model.get_mtl_base_dir(), model.get_material_descs());
+
+    struct { uint64_t *offset; const void *data; uint64_t size; } sections[] = {
+        { &header.positions, model.get_positions().data(), sizeof(glm::vec3) * (uint64_t) header.num_verts },
+        { &header.normals, model.get_normals().data(), sizeof(glm::vec3) * (uint64_t) header.num_verts },
+        { &header.tex_coords, model.get_tex_coords().data(), sizeof(glm::vec2) * (uint64_t) header.num_verts },
+        { &header.indices, model.get_indices().data(), sizeof(uint32_t) * 3 * (uint64_t) header.num_tris },
+        { &header.material_ids, model.get_material_ids().data(), sizeof(int) * (uint64_t) header.num_tris },
+        { &header.nodes, nodes.data(), sizeof(Node) * nodes.size() },
+        { &header.order, order.data(), sizeof(int) * order.size() },
+        { &header.materials, materials.data(), materials.size() }
+    };
+    uint64_t offset = sizeof(header);
+    for (auto &section : sections)
+    {
+        offset = align_offset(offset);
+        *section.offset = offset;
+        offset += section.size;
+    }
+    header.materials_size = materials.size();
+
+    // Write next to path and rename over it, so processes that have the old file mapped keep seeing it whole.
+    std::string tmp_path = path + ".tmp";
+    std::ofstream writer(tmp_path, std::ios::binary);
+    if (!writer.good())
+    {
+        errors += "Cannot open " + tmp_path + " for writing\n";
+        return false;
+    }
+    writer.write((const char *) &header, sizeof(header));
+    uint64_t written = sizeof(header);
+    const char padding[MESH_FILE_ALIGNMENT] = { 0 };
+    for (const auto &section : sections)
+    {
+        writer.write(padding, *section.offset - written);
+        writer.write((const char *) section.data, section.size);
+        written = *section.offset + section.size;
+    }
+    writer.close();
+    if (!writer.good())
+    {
+        errors += "Failed to write " + tmp_path + "\n";
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        errors += "Cannot replace " + path + " with " + tmp_path + "\n";
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -5,6 +5,9 @@
 #include "model.h"
 #include <tiny_obj_loader.h>
 #include <iostream>
+#include "objloader.h"
+#include "meshfile.h"
+#include "resources.h"
 
 int model_id_counter = 0;
 
@@ -17,7 +20,23 @@ Model::Model(const std::vector<Triangle> &tri) : Model()
 {
     if (tri.size() > 0)
     {
-        this->tri = tri;
+        storage.positions.reserve(tri.size() * 3);
+        storage.normals.reserve(tri.size() * 3);
+        storage.tex_coords.reserve(tri.size() * 3);
+        storage.indices.reserve(tri.size() * 3);
+        storage.material_ids.reserve(tri.size());
+        for (const Triangle &t : tri)
+        {
+            for (const Vertex *v : { &t.a, &t.b, &t.c })
+            {
+                storage.indices.push_back(storage.positions.size());
+                storage.positions.push_back(v->position);
+                storage.normals.push_back(v->normal);
+                storage.tex_coords.push_back(v->tex_coord);
+            }
+            storage.material_ids.push_back(t.a.material_id);
+        }
+        bind_storage();
         initialized = true;
     }
 }
@@ -36,73 +55,108 @@ bool Model::load(const std::string& path, const std::string &mtl_base_dir)
 {
     load_warnings = "";
     load_errors = "";
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
+    if (is_mesh_file(path))
+    {
+        return load_binary(path, mtl_base_dir);
+    }
 
-    bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &load_warnings, &load_errors, path.c_str(), mtl_base_dir.c_str());
-    if (!ret)
+    ObjMesh mesh;
+    if (!load_obj(path, mtl_base_dir, mesh, load_warnings, load_errors))
     {
         return false;
     }
 
-    for (int i = 0; i < shapes.size(); i++)
-    {
-        int offset = 0;
-        auto &mesh = shapes[i].mesh;
-        for (int j = 0; j < mesh.num_face_vertices.size(); j++)
-        {
-            assert(mesh.num_face_vertices[j] == 3 && "Non-triangular meshes are not supported.");
-            Vertex vs[3];
-            int material_id = mesh.material_ids[j];
+    storage = std::move(mesh);
+    mapping = nullptr;
+    this->mtl_base_dir = mtl_base_dir;
+    bind_storage();
+    make_materials();
 
-            for (int k = 0; k < mesh.num_face_vertices[j]; k++)
-            {
-                auto idx = mesh.indices[offset + k];
-
-                Vertex v = { glm::vec3(0.0f), glm::vec3(0.0f), glm::vec2(0.0f), material_id };
-                if (idx.vertex_index != -1)
-                {
-                    v.position = glm::vec3(attrib.vertices[3 * idx.vertex_index + 0], attrib.vertices[3 * idx.vertex_index + 1], attrib.vertices[3 * idx.vertex_index + 2]);
-                }
-                if (idx.normal_index != -1)
-                {
-                    v.normal = glm::vec3(attrib.normals[3 * idx.normal_index + 0], attrib.normals[3 * idx.normal_index + 1], attrib.normals[3 * idx.normal_index + 2]);
-                }
-                if (idx.texcoord_index != -1)
-                {
-                    v.tex_coord = glm::vec2(attrib.texcoords[2 * idx.texcoord_index + 0], attrib.texcoords[2 * idx.texcoord_index + 1]);
-                }
-
-                if (idx.texcoord_index >= 0)
-                {
-                    v.tex_coord = glm::vec2(attrib.texcoords[2 * idx.texcoord_index + 0], attrib.texcoords[2 * idx.texcoord_index + 1]);
-                }
-                vs[k] = v;
-            }
+    initialized = true;
 
-            tri.push_back(Triangle{ vs[0], vs[1], vs[2] });
+    return true;
+}
 
-            offset += mesh.num_face_vertices[j];
-        }
+bool Model::load_binary(const std::string &path, const std::string &mtl_base_dir)
+{
+    std::unique_ptr<MappedFile> file = std::make_unique<MappedFile>();
+    if (!file->open(path))
+    {
+        load_errors = "Cannot open " + path;
+        return false;
     }
-
-    for (int i = 0; i < materials.size(); i++)
+    MeshFileView view;
+    if (!read_mesh_file(*file, view, load_errors))
     {
-        Material m(materials[i], mtl_base_dir);
-        mat.push_back(m);
+        return false;
     }
 
+    // Geometry stays in the mapping; only the material table is deserialized.
+    const MeshFileHeader *header = view.header;
+    storage = ObjMesh();
+    storage.materials = std::move(view.materials);
+    positions = ArrayView<glm::vec3>(view.positions, header->num_verts);
+    normals = ArrayView<glm::vec3>(view.normals, header->num_verts);
+    tex_coords = ArrayView<glm::vec2>(view.tex_coords, header->num_verts);
+    indices = ArrayView<uint32_t>(view.indices, header->num_tris * 3);
+    material_ids = ArrayView<int>(view.material_ids, header->num_tris);
+    prebuilt_nodes = ArrayView<Node>(view.nodes, header->num_nodes);
+    prebuilt_order = ArrayView<int>(view.order, header->num_nodes > 0 ? header->num_tris : 0);
+    mapping = std::move(file);
+
+    this->mtl_base_dir = mtl_base_dir.empty() ? view.mtl_base_dir : mtl_base_dir;
+    make_materials();
+
     initialized = true;
 
     return true;
 }
 
+bool Model::save_binary(const std::string &path, const BVH *bvh)
+{
+    assert(initialized && "Model is not initialized yet.");
+
+    load_errors = "";
+    return write_mesh_file(path, *this, bvh, load_errors);
+}
+
+void Model::make_materials()
+{
+    // Decode all distinct textures concurrently first; the materials then just pick them up from the cache.
+    std::vector<TextureRef> textures;
+    for (const tinyobj::material_t &m : storage.materials)
+    {
+        std::vector<TextureRef> refs = Material::textures(m, mtl_base_dir);
+        textures.insert(textures.end(), refs.begin(), refs.end());
+    }
+    res()->load_textures(textures);
+
+    mat.clear();
+    mat.reserve(storage.materials.size());
+    for (int i = 0; i < storage.materials.size(); i++)
+    {
+        Material m(storage.materials[i], mtl_base_dir);
+        mat.push_back(m);
+    }
+    material_table.build(mat);
+}
+
+void Model::bind_storage()
+{
+    positions = storage.positions;
+    normals = storage.normals;
+    tex_coords = storage.tex_coords;
+    indices = storage.indices;
+    material_ids = storage.material_ids;
+    prebuilt_nodes = ArrayView<Node>();
+    prebuilt_order = ArrayView<int>();
+}
+
 int Model::get_num_verts() const
 {
     assert(initialized && "Model is not initialized yet.");
 
-    return tri.size() * 3;
+    return positions.size();
 }
 
 
@@ -110,7 +164,7 @@ int Model::get_num_tris() const
 {
     assert(initialized && "Model is not initialized yet.");
 
-    return tri.size();
+    return material_ids.size();
 }
 
 std::string Model::get_load_warnings() const
@@ -123,23 +177,89 @@ std::string Model::get_load_errors() const
     return load_errors;
 }
 
-const Triangle &Model::get_triangle(int index) const
+Triangle Model::get_triangle(int index) const
 {
     assert(initialized && "Model is not initialized yet.");
-    assert((index >= 0 || index < tri.size()) && "Triangle index out of bound");
+    assert(index >= 0 && index < material_ids.size() && "Triangle index out of bound");
 
-    return tri[index];
+    const uint32_t *idx = &indices[3 * index];
+    int material_id = material_ids[index];
+    return Triangle{
+        Vertex{ positions[idx[0]], normals[idx[0]], tex_coords[idx[0]], material_id },
+        Vertex{ positions[idx[1]], normals[idx[1]], tex_coords[idx[1]], material_id },
+        Vertex{ positions[idx[2]], normals[idx[2]], tex_coords[idx[2]], material_id }
+    };
 }
 
-const std::vector<Triangle> &Model::get_all_triangles() const
+ArrayView<glm::vec3> Model::get_positions() const
 {
-    assert(initialized && "Model is not initialized yet.");
+    return positions;
+}
+
+ArrayView<glm::vec3> Model::get_normals() const
+{
+    return normals;
+}
+
+ArrayView<glm::vec2> Model::get_tex_coords() const
+{
+    return tex_coords;
+}
+
+ArrayView<uint32_t> Model::get_indices() const
+{
+    return indices;
+}
+
+ArrayView<int> Model::get_material_ids() const
+{
+    return material_ids;
+}
 
-    return tri;
+const std::vector<tinyobj::material_t> &Model::get_material_descs() const
+{
+    return storage.materials;
 }
 
-HitInfo Model::get_hit_info(int material_id, const glm::vec2 &uv) const
+const std::string &Model::get_mtl_base_dir() const
+{
+    return mtl_base_dir;
+}
+
+ArrayView<Node> Model::get_prebuilt_nodes() const
+{
+    return prebuilt_nodes;
+}
+
+ArrayView<int> Model::get_prebuilt_order() const
+{
+    return prebuilt_order;
+}
+
+HitInfo Model::get_hit_info(int material_id, const glm::vec2 &uv, float footprint, unsigned int mask) const
 {
     assert(material_id >= 0 && material_id < mat.size() && "Material ID out of bounds");
-    return mat[material_id].get_hit_info(uv);
+    return mat[material_id].get_hit_info(uv, footprint, mask);
+}
+
+const MaterialTable *Model::get_material_table() const
+{
+    return material_table.get();
+}
+
+void Model::get_hit_info_batch(const int *material_ids, const glm::vec2 *uvs, const float *footprints, int count, unsigned int mask, HitInfo *out) const
+{
+    ::get_hit_info_batch(mat, material_ids, uvs, footprints, count, mask, out);
+}
+
+
+RGB<float> Model::get_average_emission(int material_id) const
+{
+    assert(material_id >= 0 && material_id < mat.size() && "Material ID out of bounds");
+    return mat[material_id].get_average_emission();
+}
+
+int Model::get_num_materials() const
+{
+    return mat.size();
 }
@@ -4,7 +4,7 @@
 
 #include "modelgl.h"
 
-ModelGL::ModelGL() : initialized(false), vao(GL_NONE), vbo(GL_NONE), num_verts(0), model(nullptr)
+ModelGL::ModelGL() : initialized(false), vao(GL_NONE), vbo(GL_NONE), ebo(GL_NONE), num_indices(0), model(nullptr)
 {
 
 }
@@ -14,7 +14,6 @@ ModelGL::ModelGL(std::shared_ptr<Model> model) : ModelGL()
     if (model != nullptr)
     {
         this->model = model;
-        this->num_verts = model->get_num_verts();
         import_from_model(*model);
     }
 }
@@ -26,17 +25,29 @@ bool ModelGL::import_from_model(const Model &model)
     {
         glDeleteVertexArrays(1, &vao);
         glDeleteBuffers(1, &vbo);
+        glDeleteBuffers(1, &ebo);
     }
 
     initialized = false;
 
     glGenVertexArrays(1, &vao);
     glGenBuffers(1, &vbo);
+    glGenBuffers(1, &ebo);
     glBindVertexArray(vao);
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
 
-    const std::vector<Triangle> &tris = model.get_all_triangles();
-    glBufferData(GL_ARRAY_BUFFER, tris.size() * sizeof(Triangle), tris.data(), GL_STATIC_DRAW);
+    // Interleave the vertex streams; material IDs are per-triangle and not needed for display.
+    std::vector<Vertex> verts(model.get_num_verts());
+    for (int i = 0; i < verts.size(); i++)
+    {
+        verts[i] = Vertex{ model.get_positions()[i], model.get_normals()[i], model.get_tex_coords()[i], 0 };
+    }
+    glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(Vertex), verts.data(), GL_STATIC_DRAW);
+
+    ArrayView<uint32_t> indices = model.get_indices();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+    num_indices = indices.size();
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), nullptr);
     glEnableVertexAttribArray(1);
@@ -60,6 +71,7 @@ ModelGL::~ModelGL()
     {
         glDeleteVertexArrays(1, &vao);
         glDeleteBuffers(1, &vbo);
+        glDeleteBuffers(1, &ebo);
         initialized = false;
     }
 }
@@ -68,6 +80,6 @@ void ModelGL::draw() const
 {
     assert(initialized && "ModelGL is not initialized");
     glBindVertexArray(vao);
-    glDrawArrays(GL_TRIANGLES, 0, num_verts);
+    glDrawElements(GL_TRIANGLES, num_indices, GL_UNSIGNED_INT, nullptr);
 }
 
@@ -0,0 +1,462 @@
+// Parallel OBJ loader.
+// SPDX-FileCopyrightText: 2023 42yeah <email>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "objloader.h"
+#include <charconv>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <sstream>
+#include "mappedfile.h"
+#include "parallel.h"
+
+constexpr size_t min_chunk_size = 1 << 20;
+
+/**
+ * A line-aligned piece of the OBJ file.
+ * The first pass only counts things, so that the second pass knows where its vertices go
+ * and can resolve relative (negative) indices right away.
+ */
+struct ObjChunk
+{
+    const char *begin, *end;
+
+    // First pass
+    size_t num_v, num_vt, num_vn;
+    std::vector<std::string> mtllibs;
+    std::string last_usemtl;
+    bool has_usemtl;
+
+    // Second pass
+    size_t base_v, base_vt, base_vn;
+    std::string initial_usemtl;
+    std::vector<int> corners; // (v, vt, vn) per corner; -1 if absent
+    std::vector<int> face_sizes, face_materials;
+    std::string warnings, errors;
+};
+
+static const char *skip_space(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+    {
+        p++;
+    }
+    return p;
+}
+
+static const char *find_line_end(const char *p, const char *end)
+{
+    const char *nl = (const char *) std::memchr(p, '\n', end - p);
+    return nl ? nl : end;
+}
+
+/**
+ * Does the line start with the keyword, followed by whitespace?
+ */
+static bool is_keyword(const char *p, const char *end, const char *keyword)
+{
+    size_t n = std::strlen(keyword);
+    if (end - p <= n || std::strncmp(p, keyword, n) != 0)
+    {
+        return false;
+    }
+    return p[n] == ' ' || p[n] == '\t';
+}
+
+/**
+ * The rest of the line, without surrounding whitespace.
+ */
+static std::string rest_of_line(const char *p, const char *end)
+{
+    p = skip_space(p, end);
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+    {
+        end--;
+    }
+    return std::string(p, end);
+}
+
+static const char *parse_float(const char *p, const char *end, float &value)
+{
+    p = skip_space(p, end);
+    if (p < end && *p == '+')
+    {
+        p++;
+    }
+    auto res = std::from_chars(p, end, value);
+    if (res.ec != std::errc())
+    {
+        value = 0.0f;
+    }
+    return res.ptr;
+}
+
+static void count_pass(ObjChunk &chunk)
+{
+    chunk.num_v = chunk.num_vt = chunk.num_vn = 0;
+    chunk.has_usemtl = false;
+
+    for (const char *p = chunk.begin; p < chunk.end;)
+    {
+        const char *eol = find_line_end(p, chunk.end);
+        p = skip_space(p, eol);
+        if (is_keyword(p, eol, "v"))
+        {
+            chunk.num_v++;
+        }
+        else if (is_keyword(p, eol, "vt"))
+        {
+            chunk.num_vt++;
+        }
+        else if (is_keyword(p, eol, "vn"))
+        {
+            chunk.num_vn++;
+        }
+        else if (is_keyword(p, eol, "usemtl"))
+        {
+            std::istringstream name(rest_of_line(p + 6, eol));
+            chunk.last_usemtl = "";
+            name >> chunk.last_usemtl;
+            chunk.has_usemtl = true;
+        }
+        else if (is_keyword(p, eol, "mtllib"))
+        {
+            chunk.mtllibs.push_back(rest_of_line(p + 6, eol));
+        }
+        p = eol + 1;
+    }
+}
+
+/**
+ * Resolve a 1-based (or negative, relative) OBJ index into a 0-based absolute one.
+ * Returns -2 if it is out of bounds.
+ */
+static int resolve_index(int idx, size_t seen, size_t total)
+{
+    long long abs = idx > 0 ? (long long) idx - 1 : (long long) seen + idx;
+    if (idx == 0 || abs < 0 || abs >= (long long) total)
+    {
+        return -2;
+    }
+    return (int) abs;
+}
+
+struct ObjTotals
+{
+    size_t v, vt, vn;
+};
+
+static void parse_pass(ObjChunk &chunk, const ObjTotals &totals, const std::map<std::string, int> &material_map, glm::vec3 *positions, glm::vec2 *tex_coords, glm::vec3 *normals)
+{
+    size_t v = chunk.base_v, vt = chunk.base_vt, vn = chunk.base_vn;
+    auto lookup_material = [&](const std::string &name)
+    {
+        auto pos = material_map.find(name);
+        if (pos == material_map.end())
+        {
+            chunk.warnings += "material [ '" + name + "' ] not found in .mtl\n";
+            return -1;
+        }
+        return pos->second;
+    };
+    int material_id = chunk.initial_usemtl.empty() ? -1 : lookup_material(chunk.initial_usemtl);
+
+    for (const char *p = chunk.begin; p < chunk.end;)
+    {
+        const char *eol = find_line_end(p, chunk.end);
+        p = skip_space(p, eol);
+        if (is_keyword(p, eol, "v"))
+        {
+            glm::vec3 &pos = positions[v++];
+            p = parse_float(p + 1, eol, pos.x);
+            p = parse_float(p, eol, pos.y);
+            p = parse_float(p, eol, pos.z);
+        }
+        else if (is_keyword(p, eol, "vt"))
+        {
+            glm::vec2 &tc = tex_coords[vt++];
+            p = parse_float(p + 2, eol, tc.x);
+            p = parse_float(p, eol, tc.y);
+        }
+        else if (is_keyword(p, eol, "vn"))
+        {
+            glm::vec3 &nor = normals[vn++];
+            p = parse_float(p + 2, eol, nor.x);
+            p = parse_float(p, eol, nor.y);
+            p = parse_float(p, eol, nor.z);
+        }
+        else if (is_keyword(p, eol, "usemtl"))
+        {
+            std::istringstream name(rest_of_line(p + 6, eol));
+            std::string name_str;
+            name >> name_str;
+            material_id = lookup_material(name_str);
+        }
+        else if (is_keyword(p, eol, "f"))
+        {
+            const char *face = p;
+            int num_corners = 0;
+            p = skip_space(p + 1, eol);
+            while (p < eol && *p != '\r' && *p != '#')
+            {
+                // v, v/vt, v//vn or v/vt/vn
+                int idx[3] = { 0, 0, 0 };
+                for (int k = 0; k < 3 && p < eol; k++)
+                {
+                    if (*p != '/')
+                    {
+                        p = std::from_chars(p, eol, idx[k]).ptr;
+                    }
+                    if (p < eol && *p == '/' && k < 2)
+                    {
+                        p++;
+                        continue;
+                    }
+                    break;
+                }
+                int rv = resolve_index(idx[0], v, totals.v);
+                int rvt = idx[1] == 0 ? -1 : resolve_index(idx[1], vt, totals.vt);
+                int rvn = idx[2] == 0 ? -1 : resolve_index(idx[2], vn, totals.vn);
+                if (rv < 0 || rvt == -2 || rvn == -2)
+                {
+                    chunk.errors += "Invalid face index: " + rest_of_line(face, eol) + "\n";
+                    return;
+                }
+                chunk.corners.push_back(rv);
+                chunk.corners.push_back(rvt);
+                chunk.corners.push_back(rvn);
+                num_corners++;
+
+                // Skip whatever is left of the corner
+                while (p < eol && *p != ' ' && *p != '\t')
+                {
+                    p++;
+                }
+                p = skip_space(p, eol);
+            }
+
+            // Triangulation needs positions, which may live in other chunks; it happens during the merge.
+            chunk.face_sizes.push_back(num_corners);
+            chunk.face_materials.push_back(material_id);
+        }
+        p = eol + 1;
+    }
+}
+
+static void load_materials(const std::vector<ObjChunk> &chunks, std::string mtl_base_dir, ObjMesh &mesh, std::map<std::string, int> &material_map, std::string &warnings, std::string &errors)
+{
+    if (!mtl_base_dir.empty() && mtl_base_dir[mtl_base_dir.size() - 1] != '/')
+    {
+        mtl_base_dir += "/";
+    }
+    tinyobj::MaterialFileReader reader(mtl_base_dir);
+
+    for (const ObjChunk &chunk : chunks)
+    {
+        for (const std::string &line : chunk.mtllibs)
+        {
+            // Like tinyobjloader: the first file on the line that loads wins.
+            std::istringstream names(line);
+            std::string name;
+            bool found = false;
+            while (!found && names >> name)
+            {
+                std::string warn, err;
+                found = reader(name, &mesh.materials, &material_map, &warn, &err);
+                warnings += warn;
+                errors += err;
+            }
+            if (!found)
+            {
+                warnings += "Failed to load material file(s). Use default material.\n";
+            }
+        }
+    }
+}
+
+bool load_obj(const std::string &path, const std::string &mtl_base_dir, ObjMesh &mesh, std::string &warnings, std::string &errors)
+{
+    MappedFile file;
+    if (!file.open(path))
+    {
+        errors += "Cannot open file [" + path + "]\n";
+        return false;
+    }
+
+    // Split the file into line-aligned chunks.
+    const char *data = file.data(), *end = data + file.size();
+    size_t chunk_size = std::max(min_chunk_size, file.size() / (parallel_concurrency() * 4) + 1);
+    std::vector<ObjChunk> chunks;
+    for (const char *p = data; p < end;)
+    {
+        const char *chunk_end = p + std::min(chunk_size, (size_t) (end - p));
+        if (chunk_end < end)
+        {
+            chunk_end = find_line_end(chunk_end, end);
+            chunk_end = chunk_end < end ? chunk_end + 1 : end;
+        }
+        ObjChunk chunk{};
+        chunk.begin = p;
+        chunk.end = chunk_end;
+        chunks.push_back(chunk);
+        p = chunk_end;
+    }
+
+    parallel_for(chunks.size(), [&](int i)
+    {
+        count_pass(chunks[i]);
+    });
+
+    ObjTotals totals{ 0, 0, 0 };
+    std::string usemtl;
+    for (ObjChunk &chunk : chunks)
+    {
+        chunk.base_v = totals.v;
+        chunk.base_vt = totals.vt;
+        chunk.base_vn = totals.vn;
+        chunk.initial_usemtl = usemtl;
+        totals.v += chunk.num_v;
+        totals.vt += chunk.num_vt;
+        totals.vn += chunk.num_vn;
+        if (chunk.has_usemtl)
+        {
+            usemtl = chunk.last_usemtl;
+        }
+    }
+
+    std::map<std::string, int> material_map;
+    load_materials(chunks, mtl_base_dir, mesh, material_map, warnings, errors);
+
+    std::vector<glm::vec3> positions(totals.v), normals(totals.vn);
+    std::vector<glm::vec2> tex_coords(totals.vt);
+    parallel_for(chunks.size(), [&](int i)
+    {
+        parse_pass(chunks[i], totals, material_map, positions.data(), tex_coords.data(), normals.data());
+    });
+
+    size_t num_tris = 0;
+    bool ok = true;
+    for (const ObjChunk &chunk : chunks)
+    {
+        warnings += chunk.warnings;
+        errors += chunk.errors;
+        for (int n : chunk.face_sizes)
+        {
+            num_tris += std::max(n - 2, 0);
+        }
+        ok = ok && chunk.errors.empty();
+    }
+    if (!ok)
+    {
+        return false;
+    }
+
+    // Merge & deduplicate. Most positions are only ever paired with one (vt, vn) combination,
+    // so that is checked through a flat table; only the exceptions go through the hash map.
+    struct Key
+    {
+        int v, vt, vn;
+        bool operator==(const Key &other) const
+        {
+            return v == other.v && vt == other.vt && vn == other.vn;
+        }
+    };
+    struct KeyHash
+    {
+        size_t operator()(const Key &k) const
+        {
+            size_t h = std::hash<int>()(k.v);
+            h = h * 31 + std::hash<int>()(k.vt);
+            return h * 31 + std::hash<int>()(k.vn);
+        }
+    };
+    std::vector<uint32_t> first_vertex(totals.v, UINT32_MAX);
+    std::vector<int> vertex_vt, vertex_vn;
+    std::unordered_map<Key, uint32_t, KeyHash> other_vertices;
+
+    mesh.indices.reserve(mesh.indices.size() + num_tris * 3);
+    mesh.material_ids.reserve(mesh.material_ids.size() + num_tris);
+    mesh.positions.reserve(totals.v);
+    mesh.normals.reserve(totals.v);
+    mesh.tex_coords.reserve(totals.v);
+    vertex_vt.reserve(totals.v);
+    vertex_vn.reserve(totals.v);
+
+    auto make_vertex = [&](const Key &k)
+    {
+        uint32_t vertex = mesh.positions.size();
+        mesh.positions.push_back(positions[k.v]);
+        mesh.normals.push_back(k.vn >= 0 ? normals[k.vn] : glm::vec3(0.0f));
+        mesh.tex_coords.push_back(k.vt >= 0 ? tex_coords[k.vt] : glm::vec2(0.0f));
+        vertex_vt.push_back(k.vt);
+        vertex_vn.push_back(k.vn);
+        return vertex;
+    };
+
+    auto add_corner = [&](const int *corner)
+    {
+        Key k{ corner[0], corner[1], corner[2] };
+        uint32_t &first = first_vertex[k.v];
+        if (first == UINT32_MAX)
+        {
+            first = make_vertex(k);
+            mesh.indices.push_back(first);
+        }
+        else if (vertex_vt[first] == k.vt && vertex_vn[first] == k.vn)
+        {
+            mesh.indices.push_back(first);
+        }
+        else
+        {
+            auto pos = other_vertices.find(k);
+            if (pos == other_vertices.end())
+            {
+                pos = other_vertices.insert({ k, make_vertex(k) }).first;
+            }
+            mesh.indices.push_back(pos->second);
+        }
+    };
+
+    for (const ObjChunk &chunk : chunks)
+    {
+        const int *corner = chunk.corners.data();
+        for (int f = 0; f < chunk.face_sizes.size(); f++)
+        {
+            int n = chunk.face_sizes[f];
+            if (n == 4)
+            {
+                // Split quads along the shorter diagonal, like tinyobjloader does.
+                glm::vec3 e02 = positions[corner[6]] - positions[corner[0]];
+                glm::vec3 e13 = positions[corner[9]] - positions[corner[3]];
+                int order[6] = { 0, 1, 3, 1, 2, 3 };
+                if (glm::dot(e02, e02) < glm::dot(e13, e13))
+                {
+                    int shorter[6] = { 0, 1, 2, 0, 2, 3 };
+                    std::copy(shorter, shorter + 6, order);
+                }
+                for (int k = 0; k < 6; k++)
+                {
+                    add_corner(corner + 3 * order[k]);
+                }
+            }
+            else
+            {
+                // Everything else becomes a fan.
+                for (int k = 1; k + 1 < n; k++)
+                {
+                    add_corner(corner);
+                    add_corner(corner + 3 * k);
+                    add_corner(corner + 3 * (k + 1));
+                }
+            }
+            for (int k = 0; k < n - 2; k++)
+            {
+                mesh.material_ids.push_back(chunk.face_materials[f]);
+            }
+            corner += 3 * n;
+        }
+    }
+
+    return true;
+}
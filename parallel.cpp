@@ -0,0 +1,49 @@
+// Minimal data-parallel helpers for loading assets.
+// SPDX-FileCopyrightText: 2023 42yeah <email>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "parallel.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+int parallel_concurrency()
+{
+    int con = std::thread::hardware_concurrency();
+    return con > 0 ? con : 1;
+}
+
+void parallel_for(int count, const std::function<void(int)> &fn)
+{
+    int num_threads = std::min(count, parallel_concurrency());
+    if (num_threads <= 1)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            fn(i);
+        }
+        return;
+    }
+
+    std::atomic<int> next(0);
+    auto work = [&]()
+    {
+        for (int i = next++; i < count; i = next++)
+        {
+            fn(i);
+        }
+    };
+
+    // The calling thread works as well.
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_threads; i++)
+    {
+        threads.push_back(std::thread(work));
+    }
+    work();
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+}
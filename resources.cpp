@@ -3,6 +3,10 @@
 
 #include "resources.h"
 #include <sstream>
+#include <filesystem>
+#include <algorithm>
+#include <set>
+#include "parallel.h"
 
 
 void Resources::report_error(const std::string &msg)
@@ -102,3 +106,102 @@ void Resources::shared_clear()
     }
     shared.clear();
 }
+
+void Resources::add_image(std::shared_ptr<BaseImage> image)
+{
+    std::lock_guard<std::mutex> lk(images_mu);
+    images.push_back(image);
+}
+
+bool Resources::remove_image(const BaseImage *image)
+{
+    std::lock_guard<std::mutex> lk(images_mu);
+    auto it = std::find_if(images.begin(), images.end(), [&](const std::shared_ptr<BaseImage> &im)
+    {
+        return im.get() == image;
+    });
+    if (it == images.end())
+    {
+        return false;
+    }
+    images.erase(it);
+    return true;
+}
+
+std::vector<std::shared_ptr<BaseImage> > Resources::get_images()
+{
+    std::lock_guard<std::mutex> lk(images_mu);
+    return images;
+}
+
+static std::string canonical_texture_path(std::string path)
+{
+    std::replace(path.begin(), path.end(), '\\', '/');
+    std::error_code ec;
+    std::filesystem::path canonical = std::filesystem::weakly_canonical(path, ec);
+    if (ec)
+    {
+        return path;
+    }
+    return canonical.string();
+}
+
+static std::string texture_key(const std::string &path, bool srgb)
+{
+    return canonical_texture_path(path) + (srgb ? "|srgb" : "");
+}
+
+std::shared_ptr<U8Image> Resources::load_texture(const std::string &path, bool srgb)
+{
+    std::string key = texture_key(path, srgb);
+    {
+        std::lock_guard<std::mutex> lk(texture_mu);
+        auto it = textures.find(key);
+        if (it != textures.end())
+        {
+            std::shared_ptr<U8Image> cached = it->second.lock();
+            if (cached)
+            {
+                return cached;
+            }
+        }
+    }
+
+    // Decode outside of the lock so that different textures load concurrently.
+    std::shared_ptr<U8Image> image = std::make_shared<U8Image>();
+    if (image->load(canonical_texture_path(path)))
+    {
+        image->set_srgb(srgb);
+        image->generate_mipmaps();
+        image->set_layout(ImageLayout::Tiled); // Textures are only ever sampled from here on
+    }
+
+    std::lock_guard<std::mutex> lk(texture_mu);
+    std::shared_ptr<U8Image> cached = textures[key].lock();
+    if (cached)
+    {
+        return cached; // Someone else was faster
+    }
+    textures[key] = image;
+    add_image(image);
+    return image;
+}
+
+void Resources::load_textures(const std::vector<TextureRef> &refs)
+{
+    std::vector<TextureRef> distinct;
+    std::set<std::string> seen;
+    for (const TextureRef &ref : refs)
+    {
+        if (seen.insert(texture_key(ref.path, ref.srgb)).second)
+        {
+            distinct.push_back(ref);
+        }
+    }
+
+    // The images stay alive in the images list until the caller picks them up through load_texture.
+    parallel_for(distinct.size(), [&](int i)
+    {
+        load_texture(distinct[i].path, distinct[i].srgb);
+    });
+}
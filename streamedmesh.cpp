@@ -0,0 +1,667 @@
+// Out-of-core meshes: spatial clusters on disk, paged in on demand.
+// SPDX-FileCopyrightText: 2023 42yeah <email>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "streamedmesh.h"
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include "model.h"
+#include "meshfile.h"
+#include "resources.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static glm::vec3 to_glm(const Vec3C &v)
+{
+    return glm::vec3(v.x, v.y, v.z);
+}
+
+static glm::vec3 centroid(const BBox &b)
+{
+    return (to_glm(b.min) + to_glm(b.max)) * 0.5f;
+}
+
+/**
+ * Median split on the longest axis of the centroids, until at most leaf_size primitives are left.
+ * order[begin, end) is rearranged; leaves refer to ranges in it. Returns the index of the new node.
+ */
+static int build_nodes(const std::vector<BBox> &boxes, std::vector<int> &order, int begin, int end, int leaf_size, std::vector<Node> &nodes)
+{
+    BBox box = bbox();
+    BBox centroids = bbox();
+    for (int i = begin; i < end; i++)
+    {
+        const BBox &b = boxes[order[i]];
+        enclose(box, b.min);
+        enclose(box, b.max);
+        glm::vec3 c = centroid(b);
+        enclose(centroids, *((Vec3C *) &c));
+    }
+
+    int index = nodes.size();
+    nodes.push_back(Node{ box, begin, end - begin, 0, 0 });
+    if (end - begin <= leaf_size)
+    {
+        return index;
+    }
+
+    glm::vec3 span = to_glm(centroids.max) - to_glm(centroids.min);
+    int axis = span.x > span.y ? (span.x > span.z ? 0 : 2) : (span.y > span.z ? 1 : 2);
+    int mid = (begin + end) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b)
+    {
+        return centroid(boxes[a])[axis] < centroid(boxes[b])[axis];
+    });
+
+    int l = build_nodes(boxes, order, begin, mid, leaf_size, nodes);
+    int r = build_nodes(boxes, order, mid, end, leaf_size, nodes);
+    nodes[index].l = l;
+    nodes[index].r = r;
+    return index;
+}
+
+/**
+ * Leaves have to stay inside [0, num_prims) and children have to come after their parent,
+ * which is how build_nodes lays them out. Anything else is a corrupted file.
+ */
+static bool valid_nodes(const Node *nodes, uint64_t num_nodes, uint64_t num_prims)
+{
+    for (uint64_t i = 0; i < num_nodes; i++)
+    {
+        const Node &n = nodes[i];
+        if (n.l == 0 && n.r == 0)
+        {
+            if (n.start < 0 || n.size < 0 || (uint64_t) n.start + n.size > num_prims)
+            {
+                return false;
+            }
+        }
+        else if (n.l <= (int64_t) i || n.r <= (int64_t) i || n.l >= (int64_t) num_nodes || n.r >= (int64_t) num_nodes)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static BBox tri_bbox(const Triangle &t)
+{
+    BBox b = bbox();
+    for (const Vertex *v : { &t.a, &t.b, &t.c })
+    {
+        enclose(b, *((Vec3C *) &v->position));
+    }
+    return b;
+}
+
+StreamedMesh::StreamedMesh() : num_tris(0),
+#ifndef _WIN32
+    fd(-1),
+#endif
+    resident_bytes(0), budget_bytes(STREAMED_DEFAULT_BUDGET), hits(0), misses(0), evictions(0), bytes_read(0)
+{
+
+}
+
+StreamedMesh::~StreamedMesh()
+{
+    close();
+}
+
+bool StreamedMesh::build(const Model &model, const std::string &path, int cluster_size, std::string &errors)
+{
+    if (cluster_size <= 0)
+    {
+        errors += "Cluster size has to be positive\n";
+        return false;
+    }
+
+    // Only the triangle bounding boxes are needed to form the clusters.
+    int num_tris = model.get_num_tris();
+    std::vector<BBox> boxes(num_tris);
+    std::vector<int> order(num_tris);
+    for (int i = 0; i < num_tris; i++)
+    {
+        boxes[i] = tri_bbox(model.get_triangle(i));
+        order[i] = i;
+    }
+    std::vector<Node> top_nodes;
+    if (num_tris > 0)
+    {
+        build_nodes(boxes, order, 0, num_tris, cluster_size, top_nodes);
+    }
+
+    std::vector<ClusterInfo> clusters;
+    for (const Node &n : top_nodes)
+    {
+        if (n.l == 0 && n.r == 0)
+        {
+            clusters.push_back(ClusterInfo{ n.bbox, (uint32_t) n.start, (uint32_t) n.size, 0, 0, 0, 0 });
+        }
+    }
+
+    StreamedFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, STREAMED_FILE_MAGIC, sizeof(header.magic));
+    header.version = STREAMED_FILE_VERSION;
+    header.byte_order = MESH_FILE_BYTE_ORDER;
+    header.num_tris = num_tris;
+    header.num_clusters = clusters.size();
+    header.num_top_nodes = top_nodes.size();
+    header.num_materials = model.get_material_descs().size();
+    std::string materials = serialize_materials(model.get_mtl_base_dir(), model.get_material_descs());
+    header.top_nodes = sizeof(header);
+    header.clusters = header.top_nodes + sizeof(Node) * top_nodes.size();
+    header.materials = header.clusters + sizeof(ClusterInfo) * clusters.size();
+    header.materials_size = materials.size();
+
+    // Write next to path and rename over it, so processes reading the old file keep seeing it whole.
+    std::string tmp_path = path + ".tmp";
+    std::ofstream writer(tmp_path, std::ios::binary);
+    if (!writer.good())
+    {
+        errors += "Cannot open " + tmp_path + " for writing\n";
+        return false;
+    }
+    // The cluster table is written again once the offsets are known.
+    writer.write((const char *) &header, sizeof(header));
+    writer.write((const char *) top_nodes.data(), sizeof(Node) * top_nodes.size());
+    writer.write((const char *) clusters.data(), sizeof(ClusterInfo) * clusters.size());
+    writer.write(materials.data(), materials.size());
+
+    uint64_t offset = header.materials + header.materials_size;
+    std::vector<BBox> local_boxes;
+    std::vector<int> local_order;
+    std::vector<Node> nodes;
+    std::vector<TriHot> hot;
+    std::vector<ClusterShading> shading;
+    for (int c = 0, leaf = 0; c < top_nodes.size(); c++)
+    {
+        Node &n = top_nodes[c];
+        if (n.l != 0 || n.r != 0)
+        {
+            continue;
+        }
+        ClusterInfo &info = clusters[leaf];
+
+        local_boxes.resize(info.num_tris);
+        local_order.resize(info.num_tris);
+        for (int i = 0; i < info.num_tris; i++)
+        {
+            local_boxes[i] = boxes[order[info.first_tri + i]];
+            local_order[i] = i;
+        }
+        nodes.clear();
+        build_nodes(local_boxes, local_order, 0, info.num_tris, 4, nodes);
+
+        hot.resize(info.num_tris);
+        shading.resize(info.num_tris);
+        for (int i = 0; i < info.num_tris; i++)
+        {
+            Triangle t = model.get_triangle(order[info.first_tri + local_order[i]]);
+            hot[i] = TriHot{ t.a.position, t.b.position - t.a.position, t.c.position - t.a.position };
+            shading[i] = ClusterShading{
+                { t.a.normal, t.b.normal, t.c.normal },
+                { t.a.tex_coord, t.b.tex_coord, t.c.tex_coord },
+                t.a.material_id
+            };
+        }
+
+        info.num_nodes = nodes.size();
+        info.offset = offset;
+        info.size = sizeof(Node) * nodes.size() + (sizeof(TriHot) + sizeof(ClusterShading)) * info.num_tris;
+        writer.write((const char *) nodes.data(), sizeof(Node) * nodes.size());
+        writer.write((const char *) hot.data(), sizeof(TriHot) * hot.size());
+        writer.write((const char *) shading.data(), sizeof(ClusterShading) * shading.size());
+        offset += info.size;
+
+        n.start = leaf;
+        n.size = 1;
+        leaf++;
+    }
+
+    writer.seekp(header.top_nodes);
+    writer.write((const char *) top_nodes.data(), sizeof(Node) * top_nodes.size());
+    writer.write((const char *) clusters.data(), sizeof(ClusterInfo) * clusters.size());
+    writer.close();
+    if (!writer.good())
+    {
+        errors += "Failed to write " + tmp_path + "\n";
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        errors += "Cannot replace " + path + " with " + tmp_path + "\n";
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool StreamedMesh::open(const std::string &path, uint64_t budget_bytes, std::string &errors)
+{
+    close();
+    this->budget_bytes = budget_bytes;
+
+    // The header, the top-level BVH and the materials are small and stay resident.
+    std::ifstream header_reader(path, std::ios::binary);
+    StreamedFileHeader header;
+    if (!header_reader.read((char *) &header, sizeof(header)) || std::memcmp(header.magic, STREAMED_FILE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        errors += "Not a streamed mesh file: " + path + "\n";
+        return false;
+    }
+    if (header.version != STREAMED_FILE_VERSION || header.byte_order != MESH_FILE_BYTE_ORDER)
+    {
+        errors += "Unsupported streamed mesh file version or byte order\n";
+        return false;
+    }
+    header_reader.seekg(0, std::ios::end);
+    uint64_t file_size = header_reader.tellg();
+    struct { uint64_t offset, size; } sections[] = {
+        { header.top_nodes, sizeof(Node) * (uint64_t) header.num_top_nodes },
+        { header.clusters, sizeof(ClusterInfo) * (uint64_t) header.num_clusters },
+        { header.materials, header.materials_size }
+    };
+    for (const auto &section : sections)
+    {
+        if (section.offset > file_size || section.size > file_size - section.offset)
+        {
+            errors += "Streamed mesh file is truncated or corrupted\n";
+            return false;
+        }
+    }
+    top_nodes.resize(header.num_top_nodes);
+    clusters.resize(header.num_clusters);
+    std::string materials(header.materials_size, '\0');
+    header_reader.seekg(header.top_nodes);
+    header_reader.read((char *) top_nodes.data(), sizeof(Node) * top_nodes.size());
+    header_reader.seekg(header.clusters);
+    header_reader.read((char *) clusters.data(), sizeof(ClusterInfo) * clusters.size());
+    header_reader.seekg(header.materials);
+    header_reader.read(&materials[0], materials.size());
+    if (!header_reader.good())
+    {
+        errors += "Streamed mesh file is truncated\n";
+        close();
+        return false;
+    }
+
+    // Clusters are read with pread straight from these numbers, so they have to be sane.
+    bool valid = valid_nodes(top_nodes.data(), top_nodes.size(), clusters.size());
+    for (const Node &n : top_nodes)
+    {
+        valid = valid && ((n.l != 0 || n.r != 0) || n.size == 1);
+    }
+    uint64_t next_tri = 0;
+    for (const ClusterInfo &info : clusters)
+    {
+        uint64_t size = sizeof(Node) * (uint64_t) info.num_nodes + (sizeof(TriHot) + sizeof(ClusterShading)) * (uint64_t) info.num_tris;
+        valid = valid && info.first_tri == next_tri && info.num_nodes > 0 && info.size == size &&
+            info.offset <= file_size && info.size <= file_size - info.offset;
+        next_tri += info.num_tris;
+    }
+    if (!valid || next_tri != header.num_tris)
+    {
+        errors += "Streamed mesh file is truncated or corrupted\n";
+        close();
+        return false;
+    }
+
+    std::string mtl_base_dir;
+    std::vector<tinyobj::material_t> descs;
+    if (!deserialize_materials(materials.data(), materials.data() + materials.size(), header.num_materials, mtl_base_dir, descs))
+    {
+        errors += "Corrupted material table\n";
+        close();
+        return false;
+    }
+    std::vector<TextureRef> textures;
+    for (const tinyobj::material_t &desc : descs)
+    {
+        std::vector<TextureRef> refs = Material::textures(desc, mtl_base_dir);
+        textures.insert(textures.end(), refs.begin(), refs.end());
+    }
+    res()->load_textures(textures);
+    for (const tinyobj::material_t &desc : descs)
+    {
+        mat.push_back(Material(desc, mtl_base_dir));
+    }
+    material_table.build(mat);
+
+    cluster_first.resize(clusters.size());
+    for (int i = 0; i < clusters.size(); i++)
+    {
+        cluster_first[i] = clusters[i].first_tri;
+    }
+    num_tris = header.num_tris;
+    failed.assign(clusters.size(), false);
+
+#ifndef _WIN32
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        errors += "Cannot open " + path + "\n";
+        close();
+        return false;
+    }
+#else
+    reader.open(path, std::ios::binary);
+    if (!reader.good())
+    {
+        errors += "Cannot open " + path + "\n";
+        close();
+        return false;
+    }
+#endif
+    return true;
+}
+
+void StreamedMesh::close()
+{
+#ifndef _WIN32
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+#else
+    reader.close();
+#endif
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache.clear();
+    lru.clear();
+    failed.clear();
+    resident_bytes = 0;
+    top_nodes.clear();
+    clusters.clear();
+    cluster_first.clear();
+    mat.clear();
+    material_table.build(mat);
+    num_tris = 0;
+}
+
+void StreamedMesh::set_budget(uint64_t budget_bytes)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    this->budget_bytes = budget_bytes;
+    evict(budget_bytes);
+}
+
+bool StreamedMesh::read_at(uint64_t offset, void *dst, uint64_t size) const
+{
+#ifndef _WIN32
+    char *ptr = (char *) dst;
+    while (size > 0)
+    {
+        ssize_t n = pread(fd, ptr, size, offset);
+        if (n <= 0)
+        {
+            return false;
+        }
+        ptr += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+#else
+    std::lock_guard<std::mutex> lock(read_mutex);
+    reader.seekg(offset);
+    return (bool) reader.read((char *) dst, size);
+#endif
+}
+
+bool StreamedMesh::read_cluster(int cluster, Cluster &out) const
+{
+    const ClusterInfo &info = clusters[cluster];
+    out.nodes.resize(info.num_nodes);
+    out.hot.resize(info.num_tris);
+    out.shading.resize(info.num_tris);
+    uint64_t offset = info.offset;
+    bool ok = read_at(offset, out.nodes.data(), sizeof(Node) * out.nodes.size());
+    offset += sizeof(Node) * out.nodes.size();
+    ok = ok && read_at(offset, out.hot.data(), sizeof(TriHot) * out.hot.size());
+    offset += sizeof(TriHot) * out.hot.size();
+    ok = ok && read_at(offset, out.shading.data(), sizeof(ClusterShading) * out.shading.size());
+    if (!ok || !valid_nodes(out.nodes.data(), out.nodes.size(), out.hot.size()))
+    {
+        return false;
+    }
+    for (const ClusterShading &s : out.shading)
+    {
+        if (s.material_id < -1 || s.material_id >= (int) mat.size())
+        {
+            return false;
+        }
+    }
+    bytes_read += info.size; // Failed or corrupted reads do not count as streamed in
+    return true;
+}
+
+void StreamedMesh::evict(uint64_t budget) const
+{
+    // Never evict the most recently used cluster; a budget smaller than one cluster still has to work.
+    while (resident_bytes > budget && lru.size() > 1)
+    {
+        int victim = lru.back();
+        lru.pop_back();
+        cache.erase(victim);
+        resident_bytes -= clusters[victim].size;
+        evictions++;
+    }
+}
+
+std::shared_ptr<const Cluster> StreamedMesh::acquire(int cluster) const
+{
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto it = cache.find(cluster);
+        if (it != cache.end())
+        {
+            lru.splice(lru.begin(), lru, it->second.lru);
+            hits++;
+            return it->second.cluster;
+        }
+        if (failed[cluster])
+        {
+            return nullptr;
+        }
+    }
+
+    // Read without holding the lock so other threads can keep traversing resident clusters.
+    // Two threads missing on the same cluster both read it; the first one to finish is kept.
+    misses++;
+    std::shared_ptr<Cluster> loaded = std::make_shared<Cluster>();
+    if (!read_cluster(cluster, *loaded))
+    {
+        // Give up on the cluster for good, so rays do not keep re-reading it.
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (!failed[cluster])
+        {
+            failed[cluster] = true;
+            std::stringstream ss;
+            ss << "Streamed mesh cluster " << cluster << " is unreadable or corrupted; its triangles are skipped";
+            res()->report_error(ss.str());
+        }
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = cache.find(cluster);
+    if (it != cache.end())
+    {
+        return it->second.cluster;
+    }
+    lru.push_front(cluster);
+    cache[cluster] = CacheEntry{ loaded, lru.begin() };
+    resident_bytes += clusters[cluster].size;
+    evict(budget_bytes);
+    return loaded;
+}
+
+void StreamedMesh::intersect_cluster(const Cluster &cluster, uint32_t first_tri, const glm::vec3 &ro, const glm::vec3 &rd, float tmin, RayHit &hit) const
+{
+    glm::vec3 rd_inv(1.0f / rd.x, 1.0f / rd.y, 1.0f / rd.z);
+    thread_local std::vector<int> stack;
+    stack.clear();
+    stack.push_back(0);
+
+    while (!stack.empty())
+    {
+        const Node &n = cluster.nodes[stack.back()];
+        stack.pop_back();
+
+        float tnear;
+        if (!intersect_bbox(ro, rd_inv, to_glm(n.bbox.min), to_glm(n.bbox.max), tmin, hit.uvt.z, tnear))
+        {
+            continue;
+        }
+
+        if (n.l == 0 && n.r == 0)
+        {
+            for (int i = n.start; i < n.start + n.size; i++)
+            {
+                const TriHot &t = cluster.hot[i];
+                intersect_triangle(t.a, t.e1, t.e2, ro, rd, tmin, first_tri + i, hit);
+            }
+        }
+        else
+        {
+            stack.push_back(n.r);
+            stack.push_back(n.l);
+        }
+    }
+}
+
+struct TopEntry
+{
+    int node;
+    float tnear;
+};
+
+RayHit StreamedMesh::intersect(const glm::vec3 &ro, const glm::vec3 &rd, float tmin, float tmax) const
+{
+    RayHit hit{ -1, vec3(0.0f, 0.0f, tmax) };
+    if (top_nodes.empty())
+    {
+        return hit;
+    }
+
+    // Clusters are visited front to back, so the ones behind the closest hit are never paged in.
+    glm::vec3 rd_inv(1.0f / rd.x, 1.0f / rd.y, 1.0f / rd.z);
+    thread_local std::vector<TopEntry> stack;
+    stack.clear();
+    float tnear;
+    if (intersect_bbox(ro, rd_inv, to_glm(top_nodes[0].bbox.min), to_glm(top_nodes[0].bbox.max), tmin, tmax, tnear))
+    {
+        stack.push_back(TopEntry{ 0, tnear });
+    }
+
+    while (!stack.empty())
+    {
+        TopEntry e = stack.back();
+        stack.pop_back();
+        if (e.tnear > hit.uvt.z)
+        {
+            continue;
+        }
+
+        const Node &n = top_nodes[e.node];
+        if (n.l == 0 && n.r == 0)
+        {
+            std::shared_ptr<const Cluster> cluster = acquire(n.start);
+            if (cluster != nullptr)
+            {
+                intersect_cluster(*cluster, clusters[n.start].first_tri, ro, rd, tmin, hit);
+            }
+            continue;
+        }
+
+        float tl, tr;
+        const Node &l = top_nodes[n.l], &r = top_nodes[n.r];
+        bool hit_l = intersect_bbox(ro, rd_inv, to_glm(l.bbox.min), to_glm(l.bbox.max), tmin, hit.uvt.z, tl);
+        bool hit_r = intersect_bbox(ro, rd_inv, to_glm(r.bbox.min), to_glm(r.bbox.max), tmin, hit.uvt.z, tr);
+        if (hit_l && hit_r)
+        {
+            // The nearer child goes on top
+            stack.push_back(tl < tr ? TopEntry{ n.r, tr } : TopEntry{ n.l, tl });
+            stack.push_back(tl < tr ? TopEntry{ n.l, tl } : TopEntry{ n.r, tr });
+        }
+        else if (hit_l)
+        {
+            stack.push_back(TopEntry{ n.l, tl });
+        }
+        else if (hit_r)
+        {
+            stack.push_back(TopEntry{ n.r, tr });
+        }
+    }
+    return hit;
+}
+
+VertexC StreamedMesh::get_hit_surface(const RayHit &hit) const
+{
+    assert((hit.tri >= 0 && hit.tri < num_tris) && "Triangle index out of bound");
+
+    int c = std::upper_bound(cluster_first.begin(), cluster_first.end(), (uint32_t) hit.tri) - cluster_first.begin() - 1;
+    std::shared_ptr<const Cluster> cluster = acquire(c);
+    if (cluster == nullptr)
+    {
+        // Only if the cluster was hit and then failed to be read again after an eviction (already reported.)
+        return VertexC{ vec3(0.0f, 0.0f, 0.0f), vec3(0.0f, 0.0f, 0.0f), vec2(0.0f, 0.0f), -1 };
+    }
+    int local = hit.tri - clusters[c].first_tri;
+    const TriHot &t = cluster->hot[local];
+    const ClusterShading &s = cluster->shading[local];
+    float u = hit.uvt.x, v = hit.uvt.y, w = 1.0f - u - v;
+    glm::vec3 p = t.a + t.e1 * u + t.e2 * v;
+    glm::vec3 n = s.normal[0] * w + s.normal[1] * u + s.normal[2] * v;
+    glm::vec2 uv = s.tex_coord[0] * w + s.tex_coord[1] * u + s.tex_coord[2] * v;
+    return VertexC{ vec3(p.x, p.y, p.z), vec3(n.x, n.y, n.z), vec2(uv.x, uv.y), s.material_id };
+}
+
+HitInfo StreamedMesh::get_hit_info(int material_id, const glm::vec2 &uv, float footprint, unsigned int mask) const
+{
+    assert(material_id >= 0 && material_id < mat.size() && "Material ID out of bounds");
+    return mat[material_id].get_hit_info(uv, footprint, mask);
+}
+
+const MaterialTable *StreamedMesh::get_material_table() const
+{
+    return material_table.get();
+}
+
+void StreamedMesh::get_hit_info_batch(const int *material_ids, const glm::vec2 *uvs, const float *footprints, int count, unsigned int mask, HitInfo *out) const
+{
+    ::get_hit_info_batch(mat, material_ids, uvs, footprints, count, mask, out);
+}
+
+int StreamedMesh::get_num_triangles() const
+{
+    return num_tris;
+}
+
+int StreamedMesh::get_num_clusters() const
+{
+    return clusters.size();
+}
+
+StreamStats StreamedMesh::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return StreamStats{ hits, misses, evictions, bytes_read, resident_bytes, budget_bytes, (int) cache.size(), (int) clusters.size() };
+}
+
+void StreamedMesh::reset_stats()
+{
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+    bytes_read = 0;
+}